@@ -0,0 +1,408 @@
+// \brief
+//		Batched file reader
+//
+//
+
+#include <cstdio>
+#include <cstring>
+#include <climits>
+#include <memory>
+
+#ifdef __linux__
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+
+#include "FileBatchReader.h"
+
+
+FFileBatchReader::FFileBatchReader(uint32_t InQueueDepth)
+	: RingFd(-1)
+	, QueueDepth(0)
+	, pRingMemory(NULL)
+	, RingMemorySize(0)
+	, pSqes(NULL)
+	, SqesSize(0)
+	, pSqHead(NULL)
+	, pSqTail(NULL)
+	, SqMask(0)
+	, pSqArray(NULL)
+	, pCqHead(NULL)
+	, pCqTail(NULL)
+	, CqMask(0)
+	, pCqes(NULL)
+{
+	if (InQueueDepth >= 2)
+	{
+		SetupRing(InQueueDepth);
+	}
+}
+
+FFileBatchReader::~FFileBatchReader()
+{
+	ReleaseRing();
+}
+
+uint8_t* FFileBatchReader::ReadFile(const char *InFilename, uint32_t &OutFileSize)
+{
+	OutFileSize = 0;
+
+	FILE *pFile = fopen(InFilename, "rb");
+	if (!pFile)
+	{
+		return NULL;
+	}
+
+	uint8_t *pBytes = NULL;
+	do
+	{
+		if (fseek(pFile, 0, SEEK_END) != 0)
+		{
+			break;
+		}
+
+		const long kSize = ftell(pFile);
+		if (kSize < 0 || kSize > INT_MAX || fseek(pFile, 0, SEEK_SET) != 0)
+		{
+			break;
+		}
+
+		// one byte more, so an empty file is not a NULL buffer
+		pBytes = new uint8_t[kSize + 1];
+		if (fread(pBytes, 1, (size_t)kSize, pFile) != (size_t)kSize)
+		{
+			delete[] pBytes; pBytes = NULL;
+			break;
+		}
+		OutFileSize = (uint32_t)kSize;
+	} while (0);
+
+	fclose(pFile);
+	return pBytes;
+}
+
+static void ReadFilesWithStdio(const char *InFilenames[], uint32_t InBegin, uint32_t InEnd, const FFileBatchReader::FReadDone &InReadDone)
+{
+	for (uint32_t k = InBegin; k < InEnd; k++)
+	{
+		uint32_t FileSize = 0;
+		uint8_t *pBytes = FFileBatchReader::ReadFile(InFilenames[k], FileSize);
+		InReadDone(k, pBytes, FileSize);
+	} // end for k
+}
+
+#ifdef __linux__
+
+// what a completion is for, in the low bits of its user_data
+enum EReadStep
+{
+	STEP_Open = 0,
+	STEP_Stat,
+	STEP_Read,
+	STEP_Close,
+	STEP_MAX
+};
+
+// a file in flight
+struct FReadSlot
+{
+	uint32_t		Index;			// in the file list
+	int				Fd;
+	int				OpenResult;
+	int				StatResult;
+	uint32_t		PendingCount;	// submitted steps not completed, 0 is a free slot
+	bool			bDone;			// handed to the callback
+	struct statx	Stat;
+	uint8_t			*pBytes;
+};
+
+bool FFileBatchReader::SetupRing(uint32_t InQueueDepth)
+{
+	struct io_uring_params Params;
+	memset(&Params, 0, sizeof(Params));
+
+	const int kFd = (int)syscall(__NR_io_uring_setup, InQueueDepth, &Params);
+	if (kFd < 0)
+	{
+		return false; // ENOSYS, EPERM under seccomp ...
+	}
+
+	do
+	{
+		// the opens & reads are only in one batch with the other ones when the
+		// kernel keeps the submitted file names & sizes, it also has one mmap
+		// for both rings since the same release.
+		if (!(Params.features & IORING_FEAT_SUBMIT_STABLE) || !(Params.features & IORING_FEAT_SINGLE_MMAP))
+		{
+			break;
+		}
+
+		const size_t kSqSize = Params.sq_off.array + Params.sq_entries * sizeof(uint32_t);
+		const size_t kCqSize = Params.cq_off.cqes + Params.cq_entries * sizeof(struct io_uring_cqe);
+		const size_t kRingSize = kSqSize > kCqSize ? kSqSize : kCqSize;
+		void *pRing = mmap(NULL, kRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, kFd, IORING_OFF_SQ_RING);
+		if (pRing == MAP_FAILED)
+		{
+			break;
+		}
+
+		const size_t kSqesSize = Params.sq_entries * sizeof(struct io_uring_sqe);
+		void *pEntries = mmap(NULL, kSqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, kFd, IORING_OFF_SQES);
+		if (pEntries == MAP_FAILED)
+		{
+			munmap(pRing, kRingSize);
+			break;
+		}
+
+		uint8_t *pBase = (uint8_t*)pRing;
+		RingFd = kFd;
+		QueueDepth = Params.sq_entries;
+		pRingMemory = pRing;
+		RingMemorySize = kRingSize;
+		pSqes = pEntries;
+		SqesSize = kSqesSize;
+		pSqHead = (uint32_t*)(pBase + Params.sq_off.head);
+		pSqTail = (uint32_t*)(pBase + Params.sq_off.tail);
+		SqMask = *(uint32_t*)(pBase + Params.sq_off.ring_mask);
+		pSqArray = (uint32_t*)(pBase + Params.sq_off.array);
+		pCqHead = (uint32_t*)(pBase + Params.cq_off.head);
+		pCqTail = (uint32_t*)(pBase + Params.cq_off.tail);
+		CqMask = *(uint32_t*)(pBase + Params.cq_off.ring_mask);
+		pCqes = pBase + Params.cq_off.cqes;
+		return true;
+	} while (0);
+
+	close(kFd);
+	return false;
+}
+
+void FFileBatchReader::ReleaseRing()
+{
+	if (RingFd < 0)
+	{
+		return;
+	}
+
+	munmap(pSqes, SqesSize);
+	munmap(pRingMemory, RingMemorySize);
+	close(RingFd);
+	RingFd = -1;
+}
+
+void FFileBatchReader::ReadFiles(const char *InFilenames[], uint32_t InCount, const FReadDone &InReadDone)
+{
+	if (RingFd < 0)
+	{
+		ReadFilesWithStdio(InFilenames, 0, InCount, InReadDone);
+		return;
+	}
+
+	// a file takes 2 entries at a time: open & stat, then read & close.
+	// the completion ring has twice the entries, it never overflows.
+	const uint32_t kNumSlots = QueueDepth / 2;
+	std::unique_ptr<FReadSlot[]> Slots(new FReadSlot[kNumSlots]);
+	struct io_uring_sqe *pEntries = (struct io_uring_sqe*)pSqes;
+	struct io_uring_cqe *pCompletions = (struct io_uring_cqe*)pCqes;
+	uint32_t SqTail = *pSqTail;		// only this thread moves the tail
+	uint32_t Unsubmitted = 0;
+	uint32_t NextFile = 0;
+	uint32_t InFlight = 0;
+	bool bRingFailed = false;
+
+	for (uint32_t k = 0; k < kNumSlots; k++)
+	{
+		Slots[k].PendingCount = 0;
+	} // end for k
+
+	// the entries are filled in place & published with the tail
+	auto PushEntry = [&](uint8_t InOpcode, uint32_t InSlot, uint32_t InStep) -> struct io_uring_sqe*
+	{
+		const uint32_t kEntry = SqTail & SqMask;
+		struct io_uring_sqe *pEntry = &pEntries[kEntry];
+		memset(pEntry, 0, sizeof(*pEntry));
+		pEntry->opcode = InOpcode;
+		pEntry->user_data = (uint64_t)InSlot * STEP_MAX + InStep;
+		pSqArray[kEntry] = kEntry;
+		SqTail++;
+		Unsubmitted++;
+		return pEntry;
+	};
+
+	// the ring could not open, size or read the file
+	auto ReadWithStdio = [&](FReadSlot &Slot)
+	{
+		uint32_t FileSize = 0;
+		uint8_t *pBytes = ReadFile(InFilenames[Slot.Index], FileSize);
+		Slot.bDone = true;
+		InReadDone(Slot.Index, pBytes, FileSize);
+	};
+
+	while (NextFile < InCount || InFlight > 0)
+	{
+		// refill the free slots with the next files
+		for (uint32_t k = 0; k < kNumSlots && NextFile < InCount && !bRingFailed; k++)
+		{
+			FReadSlot &Slot = Slots[k];
+			if (Slot.PendingCount > 0)
+			{
+				continue;
+			}
+
+			Slot.Index = NextFile++;
+			Slot.Fd = -1;
+			Slot.OpenResult = 0;
+			Slot.StatResult = 0;
+			Slot.pBytes = NULL;
+			Slot.bDone = false;
+			Slot.PendingCount = 2;
+			InFlight++;
+
+			struct io_uring_sqe *pOpen = PushEntry(IORING_OP_OPENAT, k, STEP_Open);
+			pOpen->fd = AT_FDCWD;
+			pOpen->addr = (uint64_t)(uintptr_t)InFilenames[Slot.Index];
+			pOpen->open_flags = O_RDONLY | O_CLOEXEC;
+
+			struct io_uring_sqe *pStat = PushEntry(IORING_OP_STATX, k, STEP_Stat);
+			pStat->fd = AT_FDCWD;
+			pStat->addr = (uint64_t)(uintptr_t)InFilenames[Slot.Index];
+			pStat->len = STATX_SIZE;
+			pStat->off = (uint64_t)(uintptr_t)&Slot.Stat;
+		} // end for k
+
+		if (bRingFailed)
+		{
+			// the kernel may still write to the slots & buffers in flight,
+			// they are left alone. the rest is read with stdio.
+			for (uint32_t k = 0; k < kNumSlots; k++)
+			{
+				if (Slots[k].PendingCount > 0 && !Slots[k].bDone)
+				{
+					ReadWithStdio(Slots[k]);
+				}
+			} // end for k
+			ReadFilesWithStdio(InFilenames, NextFile, InCount, InReadDone);
+			Slots.release();
+			ReleaseRing();
+			return;
+		}
+
+		// submit the new entries & wait for one completion at least
+		__atomic_store_n(pSqTail, SqTail, __ATOMIC_RELEASE);
+		const int kResult = (int)syscall(__NR_io_uring_enter, RingFd, Unsubmitted, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+		if (kResult < 0)
+		{
+			if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+			{
+				bRingFailed = true;
+			}
+		}
+		else
+		{
+			Unsubmitted -= (uint32_t)kResult;
+		}
+
+		uint32_t CqHead = *pCqHead;
+		const uint32_t kCqTail = __atomic_load_n(pCqTail, __ATOMIC_ACQUIRE);
+		for (; CqHead != kCqTail; CqHead++)
+		{
+			const struct io_uring_cqe &Completion = pCompletions[CqHead & CqMask];
+			const uint32_t kSlot = (uint32_t)(Completion.user_data / STEP_MAX);
+			FReadSlot &Slot = Slots[kSlot];
+			const uint32_t kStep = (uint32_t)(Completion.user_data % STEP_MAX);
+			Slot.PendingCount--;
+
+			switch (kStep)
+			{
+			case STEP_Open:
+				Slot.OpenResult = Completion.res;
+				Slot.Fd = Completion.res >= 0 ? Completion.res : -1;
+				break;
+			case STEP_Stat:
+				Slot.StatResult = Completion.res;
+				break;
+			case STEP_Read:
+				if (Completion.res >= 0)
+				{
+					// shorter than the size when the file changed meanwhile
+					Slot.bDone = true;
+					InReadDone(Slot.Index, Slot.pBytes, (uint32_t)Completion.res);
+				}
+				else
+				{
+					delete[] Slot.pBytes;
+					ReadWithStdio(Slot);
+				}
+				break;
+			case STEP_Close:
+				// cancelled when the read before it failed or was short
+				if (Completion.res < 0)
+				{
+					close(Slot.Fd);
+				}
+				break;
+			default:
+				break;
+			}
+
+			if ((kStep == STEP_Open || kStep == STEP_Stat) && Slot.PendingCount == 0)
+			{
+				const uint64_t kSize = Slot.Stat.stx_size;
+				if (Slot.OpenResult < 0 || Slot.StatResult < 0 || kSize == 0 || kSize > INT_MAX)
+				{
+					// missing, empty or too large, stdio gives the same result
+					// as the other platforms.
+					if (Slot.Fd >= 0)
+					{
+						close(Slot.Fd);
+					}
+					ReadWithStdio(Slot);
+				}
+				else
+				{
+					Slot.pBytes = new uint8_t[kSize];
+					Slot.PendingCount = 2;
+
+					// the close waits for the read
+					struct io_uring_sqe *pRead = PushEntry(IORING_OP_READ, kSlot, STEP_Read);
+					pRead->fd = Slot.Fd;
+					pRead->addr = (uint64_t)(uintptr_t)Slot.pBytes;
+					pRead->len = (uint32_t)kSize;
+					pRead->off = 0;
+					pRead->flags = IOSQE_IO_LINK;
+
+					struct io_uring_sqe *pClose = PushEntry(IORING_OP_CLOSE, kSlot, STEP_Close);
+					pClose->fd = Slot.Fd;
+				}
+			}
+
+			if (Slot.PendingCount == 0)
+			{
+				InFlight--;
+			}
+		} // end for CqHead
+		__atomic_store_n(pCqHead, CqHead, __ATOMIC_RELEASE);
+	}
+}
+
+#else
+
+bool FFileBatchReader::SetupRing(uint32_t InQueueDepth)
+{
+	return false;
+}
+
+void FFileBatchReader::ReleaseRing()
+{
+}
+
+void FFileBatchReader::ReadFiles(const char *InFilenames[], uint32_t InCount, const FReadDone &InReadDone)
+{
+	ReadFilesWithStdio(InFilenames, 0, InCount, InReadDone);
+}
+
+#endif
@@ -0,0 +1,71 @@
+// \brief
+//		Batched file reader
+//		Reads many small files whole. On Linux the opens, size queries, reads
+//		and closes go through io_uring: a batch of them is submitted with one
+//		system call and many files are in flight at once, so the latency of
+//		each open & read is not paid one file after the other.
+//		Without io_uring (other platforms, old kernels, a seccomp filter) the
+//		files are read one by one with stdio.
+//
+
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <functional>
+
+
+class FFileBatchReader
+{
+public:
+	// \brief
+	//		called for every file when it is read, in the order the reads
+	//		complete. InFileBytes is freed by the callee with delete[], it is
+	//		NULL when the file could not be read.
+	typedef std::function<void(uint32_t InIndex, uint8_t *InFileBytes, uint32_t InFileSize)> FReadDone;
+
+	// \brief
+	//		InQueueDepth	io_uring submission entries, half as many files are
+	//						in flight. 0 reads with stdio only.
+	FFileBatchReader(uint32_t InQueueDepth = 64);
+	~FFileBatchReader();
+
+	// \brief
+	//		true when the files are read through io_uring.
+	bool IsBatched() const { return RingFd >= 0; }
+
+	// \brief
+	//		read InFilenames[0 .. InCount - 1], InReadDone runs on the calling
+	//		thread. a file the ring fails on is read again with stdio.
+	void ReadFiles(const char *InFilenames[], uint32_t InCount, const FReadDone &InReadDone);
+
+	// \brief
+	//		read one file with stdio.
+	//  NOTE: use delete[] to free the returned memory.
+	static uint8_t* ReadFile(const char *InFilename, uint32_t &OutFileSize);
+
+protected:
+	bool SetupRing(uint32_t InQueueDepth);
+	void ReleaseRing();
+
+private:
+	FFileBatchReader(const FFileBatchReader &InOther);
+	FFileBatchReader& operator =(const FFileBatchReader &InOther);
+
+	int			RingFd;			// -1 without io_uring
+	uint32_t	QueueDepth;
+
+	// the rings mapped from the kernel
+	void		*pRingMemory;
+	size_t		RingMemorySize;
+	void		*pSqes;
+	size_t		SqesSize;
+	uint32_t	*pSqHead;
+	uint32_t	*pSqTail;
+	uint32_t	SqMask;
+	uint32_t	*pSqArray;
+	uint32_t	*pCqHead;
+	uint32_t	*pCqTail;
+	uint32_t	CqMask;
+	void		*pCqes;
+};
@@ -0,0 +1,127 @@
+// \brief
+//		Image compare
+//
+//
+
+#include <cstddef>
+#include <cstring>
+#include <cassert>
+
+#include "ImageCompare.h"
+
+
+static inline uint64_t Mix64(uint64_t InValue)
+{
+	// finalizer of splitmix64
+	InValue ^= InValue >> 30;
+	InValue *= 0xbf58476d1ce4e5b9ULL;
+	InValue ^= InValue >> 27;
+	InValue *= 0x94d049bb133111ebULL;
+	InValue ^= InValue >> 31;
+	return InValue;
+}
+
+uint64_t FImageCompare::Hash(const FPixelRect &InRect)
+{
+	const uint64_t kPrime = 0x100000001b3ULL;
+	const size_t kRowBytes = (size_t)InRect.Width * InRect.PixelBytes;
+
+	uint64_t Hash = Mix64(((uint64_t)InRect.Width << 32) | InRect.Height);
+	for (uint32_t y = 0; y < InRect.Height; y++)
+	{
+		const uint8_t *pRow = &InRect.pPixels[(size_t)y * InRect.LineBytes];
+
+		// 8 bytes a step, the tail is padded with zero
+		size_t k = 0;
+		for (; k + 8 <= kRowBytes; k += 8)
+		{
+			uint64_t Word;
+			memcpy(&Word, &pRow[k], 8);
+			Hash = (Hash ^ Word) * kPrime;
+			Hash ^= Hash >> 29;
+		} // end for k
+		if (k < kRowBytes)
+		{
+			uint64_t Word = 0;
+			memcpy(&Word, &pRow[k], kRowBytes - k);
+			Hash = (Hash ^ Word) * kPrime;
+			Hash ^= Hash >> 29;
+		}
+	} // end for y
+
+	return Mix64(Hash);
+}
+
+uint64_t FImageCompare::HashAnyFlip(const FPixelRect &InRect)
+{
+	assert(InRect.PixelBytes <= 8);
+
+	// a sum does not depend on the order, flips keep the size.
+	uint64_t Sum = 0;
+	for (uint32_t y = 0; y < InRect.Height; y++)
+	{
+		const uint8_t *pPixel = &InRect.pPixels[(size_t)y * InRect.LineBytes];
+		for (uint32_t x = 0; x < InRect.Width; x++, pPixel += InRect.PixelBytes)
+		{
+			uint64_t Value = 0;
+			memcpy(&Value, pPixel, InRect.PixelBytes);
+			Sum += Mix64(Value);
+		} // end for x
+	} // end for y
+
+	return Mix64(Sum ^ Mix64(((uint64_t)InRect.Width << 32) | InRect.Height));
+}
+
+bool FImageCompare::IsSame(const FPixelRect &InA, const FPixelRect &InB, EImageTransform InTransform)
+{
+	if (InA.Width != InB.Width || InA.Height != InB.Height || InA.PixelBytes != InB.PixelBytes)
+	{
+		return false;
+	}
+
+	const uint32_t kW = InA.Width;
+	const uint32_t kH = InA.Height;
+	const uint32_t kPixelBytes = InA.PixelBytes;
+	const bool bFlipX = InTransform == TRANSFORM_FlipX || InTransform == TRANSFORM_Rotate180;
+	const bool bFlipY = InTransform == TRANSFORM_FlipY || InTransform == TRANSFORM_Rotate180;
+
+	for (uint32_t y = 0; y < kH; y++)
+	{
+		const uint8_t *pRowA = &InA.pPixels[(size_t)y * InA.LineBytes];
+		const uint8_t *pRowB = &InB.pPixels[(size_t)(bFlipY ? kH - 1 - y : y) * InB.LineBytes];
+
+		if (!bFlipX)
+		{
+			if (memcmp(pRowA, pRowB, (size_t)kW * kPixelBytes) != 0)
+			{
+				return false;
+			}
+			continue;
+		}
+
+		for (uint32_t x = 0; x < kW; x++)
+		{
+			if (memcmp(&pRowA[x * kPixelBytes], &pRowB[(kW - 1 - x) * kPixelBytes], kPixelBytes) != 0)
+			{
+				return false;
+			}
+		} // end for x
+	} // end for y
+
+	return true;
+}
+
+const char* FImageCompare::TransformName(EImageTransform InTransform)
+{
+	switch (InTransform)
+	{
+	case TRANSFORM_FlipX:
+		return "flip_x";
+	case TRANSFORM_FlipY:
+		return "flip_y";
+	case TRANSFORM_Rotate180:
+		return "rotate_180";
+	default:
+		return "none";
+	}
+}
@@ -0,0 +1,58 @@
+// \brief
+//		Image compare
+//		Hashes and byte compares of pixel rectangles, used to find the images
+//		that are the same as another one, or the same after a flip.
+//		A hash only picks the candidates, the compare decides.
+//
+
+#pragma once
+
+#include <cstdint>
+
+
+// how an image is made from another one
+enum EImageTransform
+{
+	TRANSFORM_None = 0,
+	TRANSFORM_FlipX,		// mirrored left to right
+	TRANSFORM_FlipY,		// mirrored top to bottom
+	TRANSFORM_Rotate180,	// both of above
+	TRANSFORM_MAX
+};
+
+// a rectangle of pixels in a larger image
+struct FPixelRect
+{
+	FPixelRect()
+		: pPixels(NULL), Width(0), Height(0), LineBytes(0), PixelBytes(0)
+	{}
+
+	FPixelRect(const uint8_t *InPixels, uint32_t InWidth, uint32_t InHeight, uint32_t InLineBytes, uint32_t InPixelBytes)
+		: pPixels(InPixels), Width(InWidth), Height(InHeight), LineBytes(InLineBytes), PixelBytes(InPixelBytes)
+	{}
+
+	const uint8_t	*pPixels;	// the first pixel
+	uint32_t		Width;
+	uint32_t		Height;
+	uint32_t		LineBytes;	// distance of two rows
+	uint32_t		PixelBytes;
+};
+
+class FImageCompare
+{
+public:
+	// \brief
+	//		hash of the size & pixels.
+	static uint64_t Hash(const FPixelRect &InRect);
+
+	// \brief
+	//		hash that is the same for the image and its flipped & 180 degrees
+	//		rotated copies, it does not depend on the pixel order.
+	static uint64_t HashAnyFlip(const FPixelRect &InRect);
+
+	// \brief
+	//		true if InA is InTransform applied to InB.
+	static bool IsSame(const FPixelRect &InA, const FPixelRect &InB, EImageTransform InTransform);
+
+	static const char* TransformName(EImageTransform InTransform);
+};
@@ -7,9 +7,62 @@
 #include <cassert>
 
 #include "SOIL.h"
+#include "image_png.h"
 #include "ImageIO.h"
+#include "ThreadPool.h"
 
 
+// per thread, several images are decoded at the same time
+static thread_local char tlsLastError[512] = "";
+
+const char* FImageIO::LastError()
+{
+	return tlsLastError;
+}
+
+void FImageIO::SetLastError(const char *InFilename, const char *InReason)
+{
+	snprintf(tlsLastError, sizeof(tlsLastError), "%s: %s", InFilename, InReason);
+}
+
+// SOIL keeps the temporary buffers of a decode per thread for the next
+// one. this frees them when a thread that decoded exits, e.g. a worker
+// of a FThreadPool.
+struct FScratchOwner
+{
+	~FScratchOwner()
+	{
+		SOIL_trim_scratch(0);
+	}
+
+	void Touch() {}
+};
+static thread_local FScratchOwner tlsScratchOwner;
+
+void FImageIO::TrimScratch(uint32_t InKeepBytes)
+{
+	SOIL_trim_scratch(InKeepBytes);
+}
+
+// png_save_settings::parallel_for & the SOIL jpeg parallel_for on a FThreadPool
+static void PoolParallelFor(void *InContext, int InCount, void (*InJob)(void *InArg, int InIndex), void *InArg)
+{
+	FThreadPool *pThreadPool = (FThreadPool*)InContext;
+	pThreadPool->ParallelFor((uint32_t)InCount, [InJob, InArg](uint32_t InIndex) { InJob(InArg, (int)InIndex); });
+}
+
+// per thread like the SOIL jpeg parallel_for, so packs on other threads
+// never run their jpegs on a pool another one deletes.
+static thread_local FThreadPool *tlsDecodeThreadPool = NULL;
+
+FThreadPool* FImageIO::SetDecodeThreadPool(FThreadPool *InThreadPool)
+{
+	FThreadPool *pPrevious = tlsDecodeThreadPool;
+	tlsDecodeThreadPool = InThreadPool;
+	SOIL_set_jpeg_parallel_for(InThreadPool ? PoolParallelFor : NULL, InThreadPool);
+	return pPrevious;
+}
+
 uint32_t FImageIO::BytesPerPixel(int32_t InFormat)
 {
 	uint32_t BytesCount = 0;
@@ -26,7 +79,33 @@ uint32_t FImageIO::BytesPerPixel(int32_t InFormat)
 	return BytesCount;
 }
 
+// the SOIL readers on the file, or on its bytes when they are already read
+static int LoadImageInfo(const char *InFilename, const uint8_t *InFileBytes, uint32_t InFileSize, int *OutWidth, int *OutHeight, int *OutChannels)
+{
+	return InFileBytes ? SOIL_load_image_info_from_memory(InFileBytes, (int)InFileSize, OutWidth, OutHeight, OutChannels)
+		: SOIL_load_image_info(InFilename, OutWidth, OutHeight, OutChannels);
+}
+
+static int LoadImageInto(const char *InFilename, const uint8_t *InFileBytes, uint32_t InFileSize, uint8_t *InDst, int InDstLineBytes, int InWidth, int InHeight, int InChannels)
+{
+	tlsScratchOwner.Touch();
+	return InFileBytes ? SOIL_load_image_into_from_memory(InFileBytes, (int)InFileSize, InDst, InDstLineBytes, InWidth, InHeight, InChannels)
+		: SOIL_load_image_into(InFilename, InDst, InDstLineBytes, InWidth, InHeight, InChannels);
+}
+
+static unsigned char* LoadImage(const char *InFilename, const uint8_t *InFileBytes, uint32_t InFileSize, int *OutWidth, int *OutHeight, int *OutChannels)
+{
+	tlsScratchOwner.Touch();
+	return InFileBytes ? SOIL_load_image_from_memory(InFileBytes, (int)InFileSize, OutWidth, OutHeight, OutChannels, SOIL_LOAD_AUTO)
+		: SOIL_load_image(InFilename, OutWidth, OutHeight, OutChannels, SOIL_LOAD_AUTO);
+}
+
 bool FImageIO::ReadImage(const char *InFilename, uint8_t *&OutBytes, uint32_t &OutWidth, uint32_t &OutHeight, int32_t &OutFormat)
+{
+	return ReadImage(InFilename, NULL, 0, OutBytes, OutWidth, OutHeight, OutFormat);
+}
+
+bool FImageIO::ReadImage(const char *InFilename, const uint8_t *InFileBytes, uint32_t InFileSize, uint8_t *&OutBytes, uint32_t &OutWidth, uint32_t &OutHeight, int32_t &OutFormat)
 {
 	OutBytes = NULL;
 	OutWidth = 0;
@@ -34,7 +113,30 @@ bool FImageIO::ReadImage(const char *InFilename, uint8_t *&OutBytes, uint32_t &O
 	OutFormat = PIXEL_Unknown;
 
 	int width, height, channels;
-	unsigned char *buffer = SOIL_load_image(InFilename, &width, &height, &channels, SOIL_LOAD_AUTO);
+
+	// the size is known from the header, decode straight into our own buffer
+	// instead of copying out of the one SOIL would allocate.
+	if (LoadImageInfo(InFilename, InFileBytes, InFileSize, &width, &height, &channels) && (channels == 3 || channels == 4))
+	{
+		const int32_t kFormat = channels == 3 ? PIXEL_RGB : PIXEL_RGBA;
+		const uint32_t kLineBytes = width * channels;
+		uint8_t *pBytes = new uint8_t[kLineBytes * height];
+		if (ReadImageInto(InFilename, InFileBytes, InFileSize, pBytes, kLineBytes, width, height, kFormat))
+		{
+			OutBytes = pBytes;
+			OutWidth = width;
+			OutHeight = height;
+			OutFormat = kFormat;
+			return true;
+		}
+
+		// a good header with a broken body fails the same way a second time,
+		// keep the error of the first decode.
+		delete[] pBytes;
+		return false;
+	}
+
+	unsigned char *buffer = LoadImage(InFilename, InFileBytes, InFileSize, &width, &height, &channels);
 	if (buffer)
 	{
 		switch (channels)
@@ -51,8 +153,9 @@ bool FImageIO::ReadImage(const char *InFilename, uint8_t *&OutBytes, uint32_t &O
 		{
 			if (OutFormat == PIXEL_Unknown)
 			{
-				printf("Unknown pixel format of %s\n", InFilename);
-				break;
+				SetLastError(InFilename, "unknown pixel format");
+				SOIL_free_image_data(buffer);
+				return false;
 			}
 
 			const uint32_t kBytesCount = width * height * channels;
@@ -73,11 +176,79 @@ bool FImageIO::ReadImage(const char *InFilename, uint8_t *&OutBytes, uint32_t &O
 		SOIL_free_image_data(buffer);
 	}
 
-	printf("ReadImage Failed: %s\n", SOIL_last_result());
+	SetLastError(InFilename, SOIL_last_result());
 	return false;
 }
 
-bool FImageIO::WriteImage(const char *InFilename, const uint8_t *InBytes, uint32_t InWidth, uint32_t InHeight, int32_t InFormat)
+bool FImageIO::ReadImageInfo(const char *InFilename, uint32_t &OutWidth, uint32_t &OutHeight, int32_t &OutFormat)
+{
+	return ReadImageInfo(InFilename, NULL, 0, OutWidth, OutHeight, OutFormat);
+}
+
+bool FImageIO::ReadImageInfo(const char *InFilename, const uint8_t *InFileBytes, uint32_t InFileSize, uint32_t &OutWidth, uint32_t &OutHeight, int32_t &OutFormat)
+{
+	OutWidth = 0;
+	OutHeight = 0;
+	OutFormat = PIXEL_Unknown;
+
+	int width, height, channels;
+	if (!LoadImageInfo(InFilename, InFileBytes, InFileSize, &width, &height, &channels))
+	{
+		// no header parser for this type, decode it once
+		uint8_t *pBytes = NULL;
+		if (!ReadImage(InFilename, InFileBytes, InFileSize, pBytes, OutWidth, OutHeight, OutFormat))
+		{
+			return false;
+		}
+		delete[] pBytes;
+		return true;
+	}
+
+	switch (channels)
+	{
+	case 3:
+		OutFormat = PIXEL_RGB; break;
+	case 4:
+		OutFormat = PIXEL_RGBA; break;
+	default:
+		OutFormat = PIXEL_Unknown; break;
+	}
+
+	if (OutFormat == PIXEL_Unknown)
+	{
+		SetLastError(InFilename, "unknown pixel format");
+		return false;
+	}
+
+	OutWidth = width;
+	OutHeight = height;
+	return true;
+}
+
+bool FImageIO::ReadImageInto(const char *InFilename, uint8_t *InDst, uint32_t InDstLineBytes, uint32_t InWidth, uint32_t InHeight, int32_t InFormat)
+{
+	return ReadImageInto(InFilename, NULL, 0, InDst, InDstLineBytes, InWidth, InHeight, InFormat);
+}
+
+bool FImageIO::ReadImageInto(const char *InFilename, const uint8_t *InFileBytes, uint32_t InFileSize, uint8_t *InDst, uint32_t InDstLineBytes, uint32_t InWidth, uint32_t InHeight, int32_t InFormat)
+{
+	const uint32_t kChannels = BytesPerPixel(InFormat);
+	if (!InDst || kChannels == 0 || InDstLineBytes < InWidth * kChannels)
+	{
+		SetLastError(InFilename, "bad destination");
+		return false;
+	}
+
+	if (!LoadImageInto(InFilename, InFileBytes, InFileSize, InDst, InDstLineBytes, InWidth, InHeight, kChannels))
+	{
+		SetLastError(InFilename, SOIL_last_result());
+		return false;
+	}
+	return true;
+}
+
+bool FImageIO::WriteImage(const char *InFilename, const uint8_t *InBytes, uint32_t InWidth, uint32_t InHeight, int32_t InFormat,
+	const FImageWriteSettings &InSettings)
 {
 	if (!InFilename)
 	{
@@ -99,9 +270,9 @@ bool FImageIO::WriteImage(const char *InFilename, const uint8_t *InBytes, uint32
 			{
 				image_type = SOIL_SAVE_TYPE_DDS;
 			}
-			else if (!_stricmp(postfix, ".tag"))
+			else if (!_stricmp(postfix, ".tga") || !_stricmp(postfix, ".tag"))
 			{
-				image_type = SOIL_SAVE_TYPE_TGA;
+				image_type = InSettings.bTgaRle ? SOIL_SAVE_TYPE_TGA_RLE : SOIL_SAVE_TYPE_TGA;
 			}
 		}
 	}
@@ -122,6 +293,23 @@ bool FImageIO::WriteImage(const char *InFilename, const uint8_t *InBytes, uint32
 		return false;
 	}
 
-	int result = SOIL_save_image(InFilename, image_type, InWidth, InHeight, channels, InBytes);
+	int result = 0;
+	if (image_type == SOIL_SAVE_TYPE_PNG)
+	{
+		png_save_settings settings;
+		png_default_save_settings(&settings);
+		settings.level = InSettings.PngLevel;
+		settings.filter = InSettings.bPngOptimize ? PNG_FILTER_OPTIMIZE : PNG_FILTER_ADAPTIVE;
+		if (InSettings.pThreadPool)
+		{
+			settings.parallel_for = PoolParallelFor;
+			settings.parallel_context = InSettings.pThreadPool;
+		}
+		result = save_image_as_PNG_ex(InFilename, InWidth, InHeight, channels, InBytes, &settings);
+	}
+	else
+	{
+		result = SOIL_save_image(InFilename, image_type, InWidth, InHeight, channels, InBytes);
+	}
 	return !!result;
 }
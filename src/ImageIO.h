@@ -7,6 +7,8 @@
 
 #include <cstdint>
 
+class FThreadPool;
+
 enum EPixelFormat
 {
 	PIXEL_Unknown = 0,
@@ -15,6 +17,23 @@ enum EPixelFormat
 	FIXEL_MAX
 };
 
+// \brief
+//		how WriteImage encodes, a type ignores the fields it has no use for.
+struct FImageWriteSettings
+{
+	FImageWriteSettings()
+		: PngLevel(6)
+		, bPngOptimize(false)
+		, bTgaRle(false)
+		, pThreadPool(NULL)
+	{}
+
+	int32_t		PngLevel;		// deflate level, 0 stored .. 9 smallest
+	bool		bPngOptimize;	// try every row filter strategy, keep the smallest. else adaptive per row
+	bool		bTgaRle;		// run-length encoded tga
+	FThreadPool	*pThreadPool;	// optional, png is then compressed in segments on all its threads
+};
+
 
 class FImageIO
 {
@@ -24,6 +43,67 @@ public:
 	// \brief
 	//  NOTE: use delete[] to free the OutBytes memeory.
 	static bool ReadImage(const char* InFilename, uint8_t *&OutBytes, uint32_t &OutWidth, uint32_t &OutHeight, int32_t &OutFormat);
-	static bool WriteImage(const char* InFilename, const uint8_t *InBytes, uint32_t InWidth, uint32_t InHeight, int32_t InFormat);
+
+	// \brief
+	//		size & format only, the pixels are not decoded for png & jpeg.
+	static bool ReadImageInfo(const char* InFilename, uint32_t &OutWidth, uint32_t &OutHeight, int32_t &OutFormat);
+
+	// \brief
+	//		decode into memory owned by the caller, e.g. a rectangle of a larger image.
+	//		the image must be InWidth x InHeight, its rows are written InDstLineBytes apart.
+	static bool ReadImageInto(const char* InFilename, uint8_t *InDst, uint32_t InDstLineBytes, uint32_t InWidth, uint32_t InHeight, int32_t InFormat);
+
+	// \brief
+	//		the readers above on a file already read into memory, e.g. by
+	//		FFileBatchReader. InFilename only names the image in the errors.
+	static bool ReadImage(const char* InFilename, const uint8_t *InFileBytes, uint32_t InFileSize, uint8_t *&OutBytes, uint32_t &OutWidth, uint32_t &OutHeight, int32_t &OutFormat);
+	static bool ReadImageInfo(const char* InFilename, const uint8_t *InFileBytes, uint32_t InFileSize, uint32_t &OutWidth, uint32_t &OutHeight, int32_t &OutFormat);
+	static bool ReadImageInto(const char* InFilename, const uint8_t *InFileBytes, uint32_t InFileSize, uint8_t *InDst, uint32_t InDstLineBytes, uint32_t InWidth, uint32_t InHeight, int32_t InFormat);
+
+	static bool WriteImage(const char* InFilename, const uint8_t *InBytes, uint32_t InWidth, uint32_t InHeight, int32_t InFormat,
+		const FImageWriteSettings &InSettings = FImageWriteSettings());
+
+	// \brief
+	//		the decoders keep their temporary buffers per thread at the size of
+	//		the largest image so far, so a batch of images does not allocate
+	//		them for every one. frees those of the calling thread larger than
+	//		InKeepBytes, 0 frees all. a thread frees its own when it exits.
+	static void TrimScratch(uint32_t InKeepBytes = 0);
+
+	// \brief
+	//		big jpegs with restart markers are decoded on the threads of
+	//		InThreadPool, NULL decodes them on the calling thread. applies to
+	//		the images the calling thread reads, set it in the task that reads
+	//		them. returns the one set before.
+	static FThreadPool* SetDecodeThreadPool(FThreadPool *InThreadPool);
+
+	// \brief
+	//		why the last ReadImage* call of the calling thread failed. the readers
+	//		do not print, so images decoded in parallel are reported in order.
+	static const char* LastError();
+
+protected:
+	static void SetLastError(const char *InFilename, const char *InReason);
+};
+
+// sets the decode thread pool of the calling thread in the scope, the one
+// set before comes back at the end.
+class FScopedDecodeThreadPool
+{
+public:
+	FScopedDecodeThreadPool(FThreadPool *InThreadPool)
+		: pPrevious(FImageIO::SetDecodeThreadPool(InThreadPool))
+	{}
+
+	~FScopedDecodeThreadPool()
+	{
+		FImageIO::SetDecodeThreadPool(pPrevious);
+	}
+
+private:
+	FScopedDecodeThreadPool(const FScopedDecodeThreadPool &InOther);
+	FScopedDecodeThreadPool& operator =(const FScopedDecodeThreadPool &InOther);
+
+	FThreadPool	*pPrevious;
 };
 
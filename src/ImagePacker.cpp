@@ -7,13 +7,29 @@
 #include <cassert>
 #include <string>
 #include <vector>
+#include <algorithm>
+#include <chrono>
+#include <atomic>
+#include <cmath>
+#include <unordered_map>
+#include <mutex>
+#include <condition_variable>
 
 #include "ImagePacker.h"
 #include "ImageIO.h"
+#include "RectPacker.h"
+#include "MaxRectsPacker.h"
+#include "SkylinePacker.h"
+#include "ThreadPool.h"
+#include "ImageTrim.h"
+#include "ImageCompare.h"
+#include "FileBatchReader.h"
 
 
 static void CopyRectangleMemory(uint8_t *pDst, uint32_t InDstX, uint32_t InDstY, uint32_t InDstLineBytes,
-	const uint8_t *pSrc, uint32_t InSrcWidth, uint32_t InSrcHeight);
+	const uint8_t *pSrc, uint32_t InSrcWidth, uint32_t InSrcHeight, uint32_t InSrcLineBytes);
+static void CopyRectangleRotated(uint8_t *pDst, uint32_t InDstX, uint32_t InDstY, uint32_t InDstLineBytes,
+	const uint8_t *pSrc, uint32_t InSrcWidth, uint32_t InSrcHeight, uint32_t InSrcLineBytes, uint32_t InPixelBytes);
 
 // FImage
 class FImage
@@ -21,7 +37,8 @@ class FImage
 public:
 	~FImage();
 
-	bool IsValid() const { return pixelData != NULL; }
+	bool IsValid() const { return width > 0 && height > 0; }
+	bool IsDecoded() const { return pixelData != NULL; }
 	const std::string& Filename() const { return filename; }
 	const uint8_t* Data() const { return pixelData; }
 	uint8_t* Data() { return pixelData; };
@@ -29,9 +46,29 @@ public:
 	uint32_t Height() const { return height; }
 	int32_t Format() const { return format; }
 
+	// the part to pack, the whole image unless it is trimmed.
+	const FPackRect& TrimRect() const { return trimRect; }
+	void SetTrimRect(const FPackRect &InRect) { trimRect = InRect; }
+	FPixelRect TrimPixels() const
+	{
+		const uint32_t kPixelBytes = FImageIO::BytesPerPixel(format);
+		return FPixelRect(&pixelData[trimRect.Y * width * kPixelBytes + trimRect.X * kPixelBytes], trimRect.W, trimRect.H, width * kPixelBytes, kPixelBytes);
+	}
+
 	static FImage* Create(uint32_t InW, uint32_t InH, int32_t InFormat);
 	static FImage* LoadFromFile(const char *InFilename);
 
+	// \brief
+	//		the file is already read into memory, e.g. by FFileBatchReader.
+	static FImage* LoadFromFile(const char *InFilename, const uint8_t *InFileBytes, uint32_t InFileSize);
+
+	// \brief
+	//		read the size & format only, Decode() loads the pixels later.
+	static FImage* ProbeFile(const char *InFilename);
+	static FImage* ProbeFile(const char *InFilename, const uint8_t *InFileBytes, uint32_t InFileSize);
+	bool Decode();
+	void ReleasePixels();
+
 protected:
 	FImage();
 	FImage(const FImage &InOther) { /* do nothing */}
@@ -43,6 +80,7 @@ private:
 	uint32_t	width;
 	uint32_t	height;
 	int32_t		format;
+	FPackRect	trimRect;
 };
 
 FImage::FImage()
@@ -85,12 +123,18 @@ FImage* FImage::Create(uint32_t InW, uint32_t InH, int32_t InFormat)
 		pNewImage->width = InW;
 		pNewImage->height = InH;
 		pNewImage->format = InFormat;
+		pNewImage->trimRect = FPackRect(0, 0, InW, InH);
 	} while (0);
 
 	return pNewImage;
 }
 
 FImage* FImage::LoadFromFile(const char *InFilename)
+{
+	return LoadFromFile(InFilename, NULL, 0);
+}
+
+FImage* FImage::LoadFromFile(const char *InFilename, const uint8_t *InFileBytes, uint32_t InFileSize)
 {
 	FImage *pNewImage = NULL;
 	
@@ -100,7 +144,7 @@ FImage* FImage::LoadFromFile(const char *InFilename)
 		uint32_t	width = 0;
 		uint32_t	height = 0;
 		int32_t		format = 0;
-		if (!FImageIO::ReadImage(InFilename, pData, width, height, format))
+		if (!FImageIO::ReadImage(InFilename, InFileBytes, InFileSize, pData, width, height, format))
 		{
 			break;
 		}
@@ -117,11 +161,113 @@ FImage* FImage::LoadFromFile(const char *InFilename)
 		pNewImage->width = width;
 		pNewImage->height = height;
 		pNewImage->format = format;
+		pNewImage->trimRect = FPackRect(0, 0, width, height);
+	} while (0);
+
+	return pNewImage;
+}
+
+FImage* FImage::ProbeFile(const char *InFilename)
+{
+	return ProbeFile(InFilename, NULL, 0);
+}
+
+FImage* FImage::ProbeFile(const char *InFilename, const uint8_t *InFileBytes, uint32_t InFileSize)
+{
+	FImage *pNewImage = NULL;
+
+	do
+	{
+		uint32_t	width = 0;
+		uint32_t	height = 0;
+		int32_t		format = 0;
+		if (!FImageIO::ReadImageInfo(InFilename, InFileBytes, InFileSize, width, height, format))
+		{
+			break;
+		}
+
+		pNewImage = new FImage();
+		if (!pNewImage)
+		{
+			break;
+		}
+
+		pNewImage->filename = InFilename;
+		pNewImage->width = width;
+		pNewImage->height = height;
+		pNewImage->format = format;
+		pNewImage->trimRect = FPackRect(0, 0, width, height);
 	} while (0);
 
 	return pNewImage;
 }
 
+bool FImage::Decode()
+{
+	if (pixelData)
+	{
+		return true;
+	}
+
+	uint8_t	   *pData = NULL;
+	uint32_t	decodedWidth = 0;
+	uint32_t	decodedHeight = 0;
+	int32_t		decodedFormat = 0;
+	if (!FImageIO::ReadImage(filename.c_str(), pData, decodedWidth, decodedHeight, decodedFormat))
+	{
+		printf("Failed to decode image %s\n", FImageIO::LastError());
+		return false;
+	}
+
+	// the file may have changed since it was probed
+	if (decodedWidth != width || decodedHeight != height || decodedFormat != format)
+	{
+		printf("Image %s changed after it was probed\n", filename.c_str());
+		delete[] pData;
+		return false;
+	}
+
+	pixelData = pData;
+	return true;
+}
+
+void FImage::ReleasePixels()
+{
+	delete[] pixelData; pixelData = NULL;
+}
+
+// keeps an image decoded in the scope, a probed image is released at the end.
+class FScopedDecode
+{
+public:
+	FScopedDecode(FImage *InImage)
+		: pImage(InImage)
+		, bDecodedHere(false)
+	{
+		if (pImage && !pImage->IsDecoded())
+		{
+			bDecodedHere = pImage->Decode();
+		}
+	}
+
+	~FScopedDecode()
+	{
+		if (bDecodedHere)
+		{
+			pImage->ReleasePixels();
+		}
+	}
+
+	bool IsDecoded() const { return pImage && pImage->IsDecoded(); }
+
+private:
+	FScopedDecode(const FScopedDecode &InOther);
+	FScopedDecode& operator =(const FScopedDecode &InOther);
+
+	FImage	*pImage;
+	bool	bDecodedHere;
+};
+
 // class merge context
 class FImageMergeContext
 {
@@ -133,78 +279,158 @@ public:
 			: pOriginImage(NULL)
 			, X(0)
 			, Y(0)
+			, PageIndex(0)
+			, bRotated(false)
+			, bDuplicate(false)
+			, Transform(TRANSFORM_None)
 		{}
 
-		FImageTileMeta(FImage *InOrigin, uint32_t InX, uint32_t InY)
+		FImageTileMeta(FImage *InOrigin, uint32_t InX, uint32_t InY, uint32_t InPageIndex = 0, bool InRotated = false)
 			: pOriginImage(InOrigin)
 			, X(InX)
 			, Y(InY)
+			, PageIndex(InPageIndex)
+			, bRotated(InRotated)
+			, bDuplicate(false)
+			, Transform(TRANSFORM_None)
 		{}
 
+		// size in the merged image
+		uint32_t PlacedWidth() const { return bRotated ? pOriginImage->TrimRect().H : pOriginImage->TrimRect().W; }
+		uint32_t PlacedHeight() const { return bRotated ? pOriginImage->TrimRect().W : pOriginImage->TrimRect().H; }
+
 		FImage	*pOriginImage;
 		uint32_t X; // position in the merged image.
 		uint32_t Y;
+		uint32_t PageIndex; // which merged image
+		bool	bRotated;	// stored 90 degrees clockwise
+		bool	bDuplicate;	// the rectangle holds the pixels of another image
+		EImageTransform	Transform;	// of the stored pixels to get this image
 	};
 
-	FImageMergeContext(uint32_t InWidth, uint32_t InHeight, uint32_t InHMargin, uint32_t InVMargin);
+	// \brief
+	//		InThreadPool	optional, used by sort-and-race, the size search and the page composition.
+	FImageMergeContext(const FPackSettings &InSettings, FThreadPool *InThreadPool = NULL);
 	~FImageMergeContext();
 
 	bool DoMerge(const std::vector<FImage*> &InImages);
-	const FImage* GetMergedImage() const { return pMergedImage; }
+
+	// \brief
+	//		with bLazyDecode DoMerge only lays out the pages, each one is made
+	//		by ComposePage & freed by ReleasePage once it is saved, so one page
+	//		is alive at a time. else DoMerge composes all of them.
+	bool ComposePage(uint32_t InPageIndex);
+	void ReleasePage(uint32_t InPageIndex);
+
+	uint32_t GetPageCount() const { return (uint32_t)MergedImages.size(); }
+	const FImage* GetMergedImage(uint32_t InPageIndex = 0) const { return InPageIndex < MergedImages.size() ? MergedImages[InPageIndex] : NULL; }
 	const std::vector<FImageTileMeta>& GetTileMeta() const { return ImageTileMetas; }
 
 protected:
-	class FZoneNode
+	// the guillotine zone tree.
+	// zones live in one contiguous pool and are linked by index, so an insert
+	// never calls new and the whole tree is released with a single clear().
+	class FZoneTree : public FRectPacker
 	{
 	public:
-		FZoneNode()
-			: X(0), Y(0), W(0), H(0)
-			, pRightChild(NULL)
-			, pLeftChild(NULL)
-			, bOccupied(false)
+		FZoneTree()
+			: UsedArea(0)
 		{}
 
-		FZoneNode(uint32_t InX, uint32_t InY, uint32_t InW, uint32_t InH)
-			: X(InX), Y(InY), W(InW), H(InH)
-			, pRightChild(NULL)
-			, pLeftChild(NULL)
-			, bOccupied(false)
-		{}
+		virtual void Init(uint32_t InWidth, uint32_t InHeight);
+		virtual bool Insert(uint32_t InW, uint32_t InH, FPackRect &OutRect);
+		virtual float Occupancy() const;
 
-		~FZoneNode()
+	protected:
+		struct FZoneNode
 		{
-			delete pRightChild;
-			delete pLeftChild;
-		}
+			FZoneNode()
+				: X(0), Y(0), W(0), H(0)
+				, RightChild(kInvalidZone)
+				, LeftChild(kInvalidZone)
+				, bOccupied(false)
+			{}
+
+			FZoneNode(uint32_t InX, uint32_t InY, uint32_t InW, uint32_t InH)
+				: X(InX), Y(InY), W(InW), H(InH)
+				, RightChild(kInvalidZone)
+				, LeftChild(kInvalidZone)
+				, bOccupied(false)
+			{}
+
+			uint32_t	X;
+			uint32_t	Y;
+			uint32_t	W;
+			uint32_t	H;
+			int32_t		RightChild;	// index in the pool
+			int32_t		LeftChild;
+			bool		bOccupied;
+		};
+
+		static const int32_t kInvalidZone = -1;
+
+		int32_t FindZone(const uint32_t InW, const uint32_t InH);
+
+	private:
+		uint64_t				UsedArea;
+		std::vector<FZoneNode>	ZoneNodes;	// [0] is the root
+		std::vector<int32_t>	ZoneStack;	// traversal stack, kept to reuse its memory
+	};
 
-		uint32_t	X;
-		uint32_t	Y;
-		uint32_t	W;
-		uint32_t	H;
-		FZoneNode	*pRightChild;
-		FZoneNode	*pLeftChild;
-		bool		bOccupied;
+	// a layout and its quality
+	struct FLayoutResult
+	{
+		FLayoutResult()
+			: PageCount(0)
+			, PlacedArea(0)
+			, BoundsArea(0)
+		{}
+
+		bool IsBetterThan(const FLayoutResult &InOther) const;
+
+		std::vector<FImageTileMeta>	TileMetas;
+		uint32_t	PageCount;
+		uint64_t	PlacedArea;		// area of the placed images
+		uint64_t	BoundsArea;		// sum of the boxes holding the placed images of each page
+	};
+
+	static FRectPacker *CreateRectPacker(const FPackSettings &InSettings);
+	static bool InsertImage(FRectPacker *InPacker, FImage *InImage, uint32_t InHMargin, uint32_t InVMargin, bool InAllowRotation, FImageTileMeta &OutMeta);
+
+	static void SortImages(std::vector<FImage*> &InOutImages, ESortKey InSortKey);
+	static bool LayoutImages(const std::vector<FImage*> &InImages, const FPackSettings &InSettings, FLayoutResult &OutResult);
+	bool RaceLayouts(const std::vector<FImage*> &InImages, const FPackSettings &InSettings, FLayoutResult &OutResult) const;
+	void TrimImages(const std::vector<FImage*> &InImages);
+
+	// an image that is not packed, it is the same as another one
+	struct FDuplicate
+	{
+		FImage			*pImage;
+		const FImage	*pSameImage;	// the packed one
+		EImageTransform	Transform;
 	};
+	void FindDuplicates(const std::vector<FImage*> &InImages, std::vector<FImage*> &OutUniqueImages, std::vector<FDuplicate> &OutDuplicates);
+	bool FitsOnePage(const std::vector<FImage*> &InImages, uint32_t InWidth, uint32_t InHeight) const;
+	bool FindAtlasSize(const std::vector<FImage*> &InImages, uint32_t &OutWidth, uint32_t &OutHeight);
+	bool ComposePages(int32_t InFormat);
+	bool ComposeTiles(const std::vector<uint32_t> &InTiles);
 
-	static bool InsertImage(FZoneNode *InZone, FImage *InImage, uint32_t InHMargin, uint32_t InVMargin, FImageTileMeta &OutMeta);
-	static FZoneNode *FindZoneRecursively(FZoneNode *InParent, const uint32_t InW, const uint32_t InH);
+	// the pool big jpegs are decoded on, set in every task that decodes
+	FThreadPool* DecodeThreadPool() const { return Settings.bParallelJpeg ? pThreadPool : NULL; }
 
 	void Purge();
 private:
-	uint32_t	Width;
-	uint32_t	Height;
-	uint32_t	HMargin;
-	uint32_t	VMargin;
-	FImage		*pMergedImage;
+	FPackSettings	Settings;
+	FThreadPool		*pThreadPool;
+	std::vector<FImage*>	MergedImages;	// one per page, NULL until composed
+	int32_t			PageFormat;
 	std::vector<FImageTileMeta>  ImageTileMetas;
 };
 
-FImageMergeContext::FImageMergeContext(uint32_t InWidth, uint32_t InHeight, uint32_t InHMargin, uint32_t InVMargin)
-	: Width(InWidth)
-	, Height(InHeight)
-	, HMargin(InHMargin)
-	, VMargin(InVMargin)
-	, pMergedImage(NULL)
+FImageMergeContext::FImageMergeContext(const FPackSettings &InSettings, FThreadPool *InThreadPool)
+	: Settings(InSettings)
+	, pThreadPool(InThreadPool)
+	, PageFormat(PIXEL_Unknown)
 {
 
 }
@@ -214,195 +440,1343 @@ FImageMergeContext::~FImageMergeContext()
 	Purge();
 }
 
-bool FImageMergeContext::InsertImage(FZoneNode *InZone, FImage *InImage, uint32_t InHMargin, uint32_t InVMargin, FImageTileMeta &OutMeta)
+void FImageMergeContext::FZoneTree::Init(uint32_t InWidth, uint32_t InHeight)
+{
+	UsedArea = 0;
+	ZoneNodes.clear();
+	ZoneNodes.push_back(FZoneNode(0, 0, InWidth, InHeight));
+}
+
+bool FImageMergeContext::FZoneTree::Insert(uint32_t InW, uint32_t InH, FPackRect &OutRect)
 {
-	if (!InZone || !InImage)
+	const int32_t kDstZone = FindZone(InW, InH);
+	if (kDstZone == kInvalidZone)
 	{
 		return false;
 	}
 
-	const uint32_t kTileWidth = InImage->Width() + InHMargin + InHMargin;
-	const uint32_t kTileHeight = InImage->Height() + InVMargin + InVMargin;
+	// copy it, the pool may grow below.
+	const FZoneNode kZone = ZoneNodes[kDstZone];
+	assert(kZone.bOccupied == false);
 
-	FZoneNode *pDstZone = FindZoneRecursively(InZone, kTileWidth, kTileHeight);
-	if (!pDstZone)
-	{
-		return false;
-	}
-	
-	assert(pDstZone->bOccupied == false);
-	pDstZone->bOccupied = true;
 	// split it into 2 zones
-	pDstZone->pRightChild = new FZoneNode(pDstZone->X + kTileWidth, pDstZone->Y, pDstZone->W - kTileWidth, kTileHeight);
-	pDstZone->pLeftChild = new FZoneNode(pDstZone->X, pDstZone->Y + kTileHeight, pDstZone->W, pDstZone->H - kTileHeight);
+	const int32_t kRightChild = (int32_t)ZoneNodes.size();
+	ZoneNodes.push_back(FZoneNode(kZone.X + InW, kZone.Y, kZone.W - InW, InH));
+	ZoneNodes.push_back(FZoneNode(kZone.X, kZone.Y + InH, kZone.W, kZone.H - InH));
 
-	// add the meta data
-	OutMeta = FImageTileMeta(InImage, pDstZone->X + InHMargin, pDstZone->Y + InVMargin);
+	FZoneNode &DstZone = ZoneNodes[kDstZone];
+	DstZone.bOccupied = true;
+	DstZone.RightChild = kRightChild;
+	DstZone.LeftChild = kRightChild + 1;
+
+	UsedArea += (uint64_t)InW * InH;
+	OutRect = FPackRect(kZone.X, kZone.Y, InW, InH);
 	return true;
 }
 
-FImageMergeContext::FZoneNode *FImageMergeContext::FindZoneRecursively(FZoneNode *InParent, const uint32_t InW, const uint32_t InH)
+float FImageMergeContext::FZoneTree::Occupancy() const
 {
-	if (!InParent || InW > InParent->W || InH > InParent->H)
+	if (ZoneNodes.empty())
 	{
-		return NULL;
+		return 0.f;
 	}
 
-	if (!InParent->bOccupied)
+	const uint64_t kBinArea = (uint64_t)ZoneNodes[0].W * ZoneNodes[0].H;
+	return kBinArea > 0 ? (float)((double)UsedArea / kBinArea) : 0.f;
+}
+
+int32_t FImageMergeContext::FZoneTree::FindZone(const uint32_t InW, const uint32_t InH)
+{
+	if (ZoneNodes.empty())
 	{
-		return InParent;
+		return kInvalidZone;
 	}
 
-	// first find the right zone.
-	FZoneNode *pZone = FindZoneRecursively(InParent->pRightChild, InW, InH);
-	if (!pZone)
+	// depth first with an explicit stack, same order as the recursive walk:
+	// the zone itself, then the right zone, then the left zone.
+	ZoneStack.clear();
+	ZoneStack.push_back(0);
+	while (!ZoneStack.empty())
 	{
-		pZone = FindZoneRecursively(InParent->pLeftChild, InW, InH);
+		const int32_t kIndex = ZoneStack.back();
+		ZoneStack.pop_back();
+
+		const FZoneNode &Zone = ZoneNodes[kIndex];
+		if (InW > Zone.W || InH > Zone.H)
+		{
+			continue;
+		}
+
+		if (!Zone.bOccupied)
+		{
+			return kIndex;
+		}
+
+		ZoneStack.push_back(Zone.LeftChild);
+		ZoneStack.push_back(Zone.RightChild);
 	}
 
-	return pZone;
+	return kInvalidZone;
 }
 
-void FImageMergeContext::Purge()
+FRectPacker *FImageMergeContext::CreateRectPacker(const FPackSettings &InSettings)
 {
-	ImageTileMetas.clear();
-	if (pMergedImage)
+	FRectPacker *pPacker = NULL;
+
+	switch (InSettings.Engine)
 	{
-		delete pMergedImage; pMergedImage = NULL;
+	case PACK_Guillotine:
+		pPacker = new FZoneTree(); break;
+	case PACK_MaxRects:
+		pPacker = new FMaxRectsPacker(InSettings.MaxRectsHeuristic); break;
+	case PACK_Skyline:
+		pPacker = new FSkylinePacker(InSettings.bSkylineWasteMap); break;
+	default:
+		pPacker = NULL; break;
 	}
+
+	if (pPacker)
+	{
+		pPacker->Init(InSettings.Width, InSettings.Height);
+	}
+	return pPacker;
 }
 
-bool FImageMergeContext::DoMerge(const std::vector<FImage*> &InImages)
+bool FImageMergeContext::InsertImage(FRectPacker *InPacker, FImage *InImage, uint32_t InHMargin, uint32_t InVMargin, bool InAllowRotation, FImageTileMeta &OutMeta)
 {
-	Purge();
-
-	if (InImages.size() <= 0)
+	if (!InPacker || !InImage)
 	{
 		return false;
 	}
 
-	// check the consistency of images's format.
-	assert(InImages[0]);
-	const int32_t kFormat = InImages[0]->Format();
-	bool bFormatSame = true;
-	for (size_t k = 1; k < InImages.size(); k++)
+	const uint32_t kTileWidth = InImage->TrimRect().W + InHMargin + InHMargin;
+	const uint32_t kTileHeight = InImage->TrimRect().H + InVMargin + InVMargin;
+
+	FPackRect TileRect;
+	if (InAllowRotation)
 	{
-		FImage *pImage = InImages[k];
-		assert(pImage);
-		if (pImage->Format() != kFormat)
+		if (!InPacker->InsertRotatable(kTileWidth, kTileHeight, TileRect))
 		{
-			bFormatSame = false;
-			break;
+			return false;
 		}
-	} // end for k
-	if (!bFormatSame)
+	}
+	else if (!InPacker->Insert(kTileWidth, kTileHeight, TileRect))
 	{
 		return false;
 	}
 
-	// allocate the zones
-	FZoneNode Zone(0, 0, Width, Height);
-	for (size_t k = 0; k < InImages.size(); k++)
+	// add the meta data
+	const bool bRotated = TileRect.W != kTileWidth;
+	if (bRotated)
 	{
-		FImage *pImage = InImages[k];
-		assert(pImage);
-
-		FImageTileMeta TileMeta;
-		if (InsertImage(&Zone, pImage, HMargin, VMargin, TileMeta))
-		{
-			ImageTileMetas.push_back(TileMeta);
-		}
-	} // end for k
-
-	// make a merged image & fill in.
-	pMergedImage = FImage::Create(Width, Height, kFormat);
-	if (!pMergedImage)
+		OutMeta = FImageTileMeta(InImage, TileRect.X + InVMargin, TileRect.Y + InHMargin, 0, true);
+	}
+	else
 	{
-		return false;
+		OutMeta = FImageTileMeta(InImage, TileRect.X + InHMargin, TileRect.Y + InVMargin);
 	}
+	return true;
+}
 
-	uint32_t PixelBytes = FImageIO::BytesPerPixel(kFormat);
-	for (size_t k = 0; k < ImageTileMetas.size(); k++)
+bool FImageMergeContext::FLayoutResult::IsBetterThan(const FLayoutResult &InOther) const
+{
+	// more images placed first, then fewer pages, then the tighter layout.
+	if (TileMetas.size() != InOther.TileMetas.size())
 	{
-		const FImageTileMeta &TileMeta = ImageTileMetas[k];
-		assert(TileMeta.pOriginImage);
+		return TileMetas.size() > InOther.TileMetas.size();
+	}
+	if (PageCount != InOther.PageCount)
+	{
+		return PageCount < InOther.PageCount;
+	}
+	if (PlacedArea != InOther.PlacedArea)
+	{
+		return PlacedArea > InOther.PlacedArea;
+	}
+	return BoundsArea < InOther.BoundsArea;
+}
 
-		CopyRectangleMemory(pMergedImage->Data(), TileMeta.X * PixelBytes, TileMeta.Y, pMergedImage->Width() * PixelBytes,
-			TileMeta.pOriginImage->Data(), TileMeta.pOriginImage->Width() * PixelBytes, TileMeta.pOriginImage->Height());
-	} // end for k
+static uint32_t SortKeyValue(const FImage *InImage, ESortKey InSortKey)
+{
+	const uint32_t kW = InImage->TrimRect().W;
+	const uint32_t kH = InImage->TrimRect().H;
 
-	return true;
+	switch (InSortKey)
+	{
+	case SORT_Area:
+		return kW * kH;
+	case SORT_MaxSide:
+		return kW > kH ? kW : kH;
+	case SORT_Perimeter:
+		return kW + kH;
+	case SORT_Height:
+		return kH;
+	case SORT_Width:
+		return kW;
+	default:
+		return 0;
+	}
 }
 
-uint32_t FImagePacker::PackImages(const char *InImageFilenames[], uint32_t InCount, uint32_t InWidth, uint32_t InHeight,
-						uint32_t InHMargin, uint32_t InVMargin, char *InBigImageFilename)
+void FImageMergeContext::SortImages(std::vector<FImage*> &InOutImages, ESortKey InSortKey)
 {
-	std::vector<FImage*> Images;
-
-	for (uint32_t k = 0; k < InCount; k++)
+	if (InSortKey == SORT_None)
 	{
-		FImage *pImage = FImage::LoadFromFile(InImageFilenames[k]);
-		if (!pImage)
+		return;
+	}
+
+	// stable, so equal images keep the order of the caller.
+	std::stable_sort(InOutImages.begin(), InOutImages.end(),
+		[InSortKey](const FImage *InA, const FImage *InB)
 		{
-			printf("Failed to load image file %s\n", InImageFilenames[k]);
-			continue;
-		}
+			return SortKeyValue(InA, InSortKey) > SortKeyValue(InB, InSortKey);
+		});
+}
 
-		Images.push_back(pImage);
-	} // end for k
+bool FImageMergeContext::LayoutImages(const std::vector<FImage*> &InImages, const FPackSettings &InSettings, FLayoutResult &OutResult)
+{
+	std::vector<FImage*> SortedImages(InImages);
+	SortImages(SortedImages, InSettings.SortKey);
 
-	FImageMergeContext Merger(InWidth, InHeight, InHMargin, InVMargin);
+	// first fit: every image goes to the first page it fits in, a new page
+	// is opened only when none of the open pages has room.
+	std::vector<FRectPacker*> Pages;
+	std::vector<uint32_t> BoundsW, BoundsH;
+	bool bSuccess = true;
 
-	if (Merger.DoMerge(Images))
+	OutResult = FLayoutResult();
+	for (size_t k = 0; k < SortedImages.size() && bSuccess; k++)
 	{
-		const FImage* pMergedImage = Merger.GetMergedImage();
-		const std::vector<FImageMergeContext::FImageTileMeta>& TileMetas = Merger.GetTileMeta();
+		FImage *pImage = SortedImages[k];
+		assert(pImage);
+
+		FImageTileMeta TileMeta;
+		bool bPlaced = false;
+		for (size_t Page = 0; Page < Pages.size() && !bPlaced; Page++)
+		{
+			if (InsertImage(Pages[Page], pImage, InSettings.HMargin, InSettings.VMargin, InSettings.bAllowRotation, TileMeta))
+			{
+				TileMeta.PageIndex = (uint32_t)Page;
+				bPlaced = true;
+			}
+		} // end for Page
 
-		if (pMergedImage)
+		if (!bPlaced && (InSettings.MaxPages == 0 || Pages.size() < InSettings.MaxPages))
 		{
-			bool bSuccess = FImageIO::WriteImage(InBigImageFilename, pMergedImage->Data(), pMergedImage->Width(), pMergedImage->Height(), pMergedImage->Format());
-			if (!bSuccess)
+			FRectPacker *pPacker = CreateRectPacker(InSettings);
+			if (!pPacker)
+			{
+				bSuccess = false;
+				break;
+			}
+
+			if (InsertImage(pPacker, pImage, InSettings.HMargin, InSettings.VMargin, InSettings.bAllowRotation, TileMeta))
 			{
-				printf("Failed to save merged image to file: %s\n", InBigImageFilename);
+				TileMeta.PageIndex = (uint32_t)Pages.size();
+				Pages.push_back(pPacker);
+				BoundsW.push_back(0);
+				BoundsH.push_back(0);
+				bPlaced = true;
 			}
 			else
 			{
-				// output the image tiles information
-				printf("Image Atlas Information:\n");
-				for (size_t k = 0; k < TileMetas.size(); k++)
-				{
-					const FImageMergeContext::FImageTileMeta &Meta = TileMetas[k];
-					printf("IMAGE: %s\n", Meta.pOriginImage->Filename().c_str());
-					printf("     { x:%ud, y:%ud, w:%ud, h:%ud }\n", Meta.X, Meta.Y, Meta.pOriginImage->Width(), Meta.pOriginImage->Height());
-				} // end for k
-			
-				return TileMetas.size();
+				// larger than a whole page
+				delete pPacker;
 			}
-		} // end if
+		}
+
+		if (bPlaced)
+		{
+			OutResult.TileMetas.push_back(TileMeta);
+			OutResult.PlacedArea += (uint64_t)pImage->TrimRect().W * pImage->TrimRect().H;
+			BoundsW[TileMeta.PageIndex] = std::max(BoundsW[TileMeta.PageIndex], TileMeta.X + TileMeta.PlacedWidth());
+			BoundsH[TileMeta.PageIndex] = std::max(BoundsH[TileMeta.PageIndex], TileMeta.Y + TileMeta.PlacedHeight());
+		}
+	} // end for k
+
+	OutResult.PageCount = (uint32_t)Pages.size();
+	for (size_t Page = 0; Page < Pages.size(); Page++)
+	{
+		OutResult.BoundsArea += (uint64_t)BoundsW[Page] * BoundsH[Page];
+		delete Pages[Page];
+	} // end for Page
+
+	return bSuccess;
+}
+
+bool FImageMergeContext::RaceLayouts(const std::vector<FImage*> &InImages, const FPackSettings &InSettings, FLayoutResult &OutResult) const
+{
+	// the candidates, the one of the settings goes first.
+	std::vector<FPackSettings> Candidates;
+	Candidates.push_back(InSettings);
+	for (int32_t SortKey = SORT_None; SortKey < SORT_MAX; SortKey++)
+	{
+		for (int32_t Engine = PACK_Guillotine; Engine < PACK_MAX; Engine++)
+		{
+			const int32_t kNumHeuristics = Engine == PACK_MaxRects ? MAXRECTS_MAX : 1;
+			for (int32_t Heuristic = 0; Heuristic < kNumHeuristics; Heuristic++)
+			{
+				FPackSettings Candidate(InSettings);
+				Candidate.SortKey = (ESortKey)SortKey;
+				Candidate.Engine = (EPackEngine)Engine;
+				Candidate.MaxRectsHeuristic = Engine == PACK_MaxRects ? (EMaxRectsHeuristic)Heuristic : InSettings.MaxRectsHeuristic;
+				Candidate.bSkylineWasteMap = true;
+				if (Candidate.SortKey == InSettings.SortKey && Candidate.Engine == InSettings.Engine
+					&& Candidate.MaxRectsHeuristic == InSettings.MaxRectsHeuristic && Candidate.bSkylineWasteMap == InSettings.bSkylineWasteMap)
+				{
+					continue; // already the first one
+				}
+				Candidates.push_back(Candidate);
+			} // end for Heuristic
+		} // end for Engine
+	} // end for SortKey
+
+	const std::chrono::steady_clock::time_point kDeadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(InSettings.RaceTimeBudgetMs);
+	std::vector<FLayoutResult> Results(Candidates.size());
+	std::vector<char> Finished(Candidates.size(), 0);
+
+	std::function<void(uint32_t)> RunCandidate = [&](uint32_t InIndex)
+	{
+		// the first candidate always runs, so there is a layout to return.
+		if (InIndex > 0 && InSettings.RaceTimeBudgetMs > 0 && std::chrono::steady_clock::now() >= kDeadline)
+		{
+			return;
+		}
+		Finished[InIndex] = LayoutImages(InImages, Candidates[InIndex], Results[InIndex]) ? 1 : 0;
+	};
+
+	if (pThreadPool)
+	{
+		pThreadPool->ParallelFor((uint32_t)Candidates.size(), RunCandidate);
+	}
+	else
+	{
+		for (uint32_t k = 0; k < (uint32_t)Candidates.size(); k++)
+		{
+			RunCandidate(k);
+		} // end for k
 	}
 
-	for (uint32_t k = 0; k < Images.size(); k++)
+	// pick the best, ties go to the earlier candidate so the result does not
+	// depend on the thread timing.
+	int32_t BestIndex = -1;
+	for (size_t k = 0; k < Candidates.size(); k++)
 	{
-		FImage *pImage = Images[k];
-		assert(pImage);
-		delete pImage;
+		if (Finished[k] && (BestIndex < 0 || Results[k].IsBetterThan(Results[BestIndex])))
+		{
+			BestIndex = (int32_t)k;
+		}
 	} // end for k
-	Images.clear();
 
-	return 0;
+	if (BestIndex < 0)
+	{
+		return false;
+	}
+
+	OutResult.TileMetas.swap(Results[BestIndex].TileMetas);
+	OutResult.PageCount = Results[BestIndex].PageCount;
+	OutResult.PlacedArea = Results[BestIndex].PlacedArea;
+	OutResult.BoundsArea = Results[BestIndex].BoundsArea;
+	return true;
+}
+
+void FImageMergeContext::Purge()
+{
+	ImageTileMetas.clear();
+	for (size_t k = 0; k < MergedImages.size(); k++)
+	{
+		delete MergedImages[k];
+	} // end for k
+	MergedImages.clear();
 }
 
-static void CopyRectangleMemory(uint8_t *pDst, uint32_t InDstX, uint32_t InDstY, uint32_t InDstLineBytes,
-	const uint8_t *pSrc, uint32_t InSrcWidth, uint32_t InSrcHeight)
+void FImageMergeContext::TrimImages(const std::vector<FImage*> &InImages)
 {
-	assert((InDstLineBytes - InDstX) >= InSrcWidth);
+	std::function<void(uint32_t)> TrimImage = [&](uint32_t InIndex)
+	{
+		FImage *pImage = InImages[InIndex];
+		FScopedDecodeThreadPool DecodePool(DecodeThreadPool());
+		FScopedDecode Decoded(pImage);
+		FPackRect Bounds;
+		if (Decoded.IsDecoded() && FImageTrim::FindOpaqueBounds(pImage->Data(), pImage->Width(), pImage->Height(), Settings.AlphaThreshold, Bounds))
+		{
+			pImage->SetTrimRect(Bounds);
+		}
+	};
 
-	uint8_t *pDstLine = &pDst[InDstY * InDstLineBytes + InDstX];
-	const uint8_t *pSrcLine = pSrc;
-	for (uint32_t k = 0; k < InSrcHeight; k++)
+	if (pThreadPool)
 	{
-		memcpy(pDstLine, pSrcLine, InSrcWidth);
-		pDstLine += InDstLineBytes;
-		pSrcLine += InSrcWidth;
-	} // end for k
+		pThreadPool->ParallelFor((uint32_t)InImages.size(), TrimImage);
+	}
+	else
+	{
+		for (uint32_t k = 0; k < (uint32_t)InImages.size(); k++)
+		{
+			TrimImage(k);
+		} // end for k
+	}
+}
+
+void FImageMergeContext::FindDuplicates(const std::vector<FImage*> &InImages, std::vector<FImage*> &OutUniqueImages, std::vector<FDuplicate> &OutDuplicates)
+{
+	OutUniqueImages.clear();
+	OutDuplicates.clear();
+
+	const bool bAnyFlip = Settings.bDetectFlippedDuplicates;
+	std::vector<uint64_t> Hashes(InImages.size());
+	std::vector<char> Decoded(InImages.size(), 0);
+	std::function<void(uint32_t)> HashImage = [&](uint32_t InIndex)
+	{
+		FScopedDecodeThreadPool DecodePool(DecodeThreadPool());
+		FScopedDecode ScopedDecode(InImages[InIndex]);
+		if (!ScopedDecode.IsDecoded())
+		{
+			return;
+		}
+
+		const FPixelRect kPixels = InImages[InIndex]->TrimPixels();
+		Hashes[InIndex] = bAnyFlip ? FImageCompare::HashAnyFlip(kPixels) : FImageCompare::Hash(kPixels);
+		Decoded[InIndex] = 1;
+	};
+
+	if (pThreadPool)
+	{
+		pThreadPool->ParallelFor((uint32_t)InImages.size(), HashImage);
+	}
+	else
+	{
+		for (uint32_t k = 0; k < (uint32_t)InImages.size(); k++)
+		{
+			HashImage(k);
+		} // end for k
+	}
+
+	// in the order of the caller, so the first of the same images is packed.
+	FScopedDecodeThreadPool DecodePool(DecodeThreadPool());
+	std::unordered_map<uint64_t, std::vector<FImage*> > UniqueOfHash;
+	for (size_t k = 0; k < InImages.size(); k++)
+	{
+		FImage *pImage = InImages[k];
+		if (!Decoded[k])
+		{
+			OutUniqueImages.push_back(pImage);
+			continue;
+		}
+
+		std::vector<FImage*> &SameHash = UniqueOfHash[Hashes[k]];
+		bool bDuplicate = false;
+		if (!SameHash.empty())
+		{
+			// lazy decoded images are decoded again only to confirm a hash match
+			FScopedDecode ScopedDecode(pImage);
+			const FPixelRect kPixels = pImage->TrimPixels();
+			for (size_t i = 0; i < SameHash.size() && !bDuplicate && ScopedDecode.IsDecoded(); i++)
+			{
+				FScopedDecode ScopedDecodeUnique(SameHash[i]);
+				if (!ScopedDecodeUnique.IsDecoded())
+				{
+					continue;
+				}
+
+				const FPixelRect kUniquePixels = SameHash[i]->TrimPixels();
+				const int32_t kTransformCount = bAnyFlip ? TRANSFORM_MAX : TRANSFORM_None + 1;
+				for (int32_t Transform = TRANSFORM_None; Transform < kTransformCount; Transform++)
+				{
+					if (FImageCompare::IsSame(kPixels, kUniquePixels, (EImageTransform)Transform))
+					{
+						FDuplicate Duplicate;
+						Duplicate.pImage = pImage;
+						Duplicate.pSameImage = SameHash[i];
+						Duplicate.Transform = (EImageTransform)Transform;
+						OutDuplicates.push_back(Duplicate);
+						bDuplicate = true;
+						break;
+					}
+				} // end for Transform
+			} // end for i
+		}
+
+		if (!bDuplicate)
+		{
+			SameHash.push_back(pImage);
+			OutUniqueImages.push_back(pImage);
+		}
+	} // end for k
+}
+
+bool FImageMergeContext::FitsOnePage(const std::vector<FImage*> &InImages, uint32_t InWidth, uint32_t InHeight) const
+{
+	FPackSettings PageSettings(Settings);
+	PageSettings.Width = InWidth;
+	PageSettings.Height = InHeight;
+	PageSettings.MaxPages = 1;
+
+	// only the first candidate, also with bRaceLayouts: the race keeps it when
+	// no other one does better, so the page it fits is one the race fits.
+	// racing every probe of the size search costs far too much.
+	FLayoutResult Layout;
+	if (LayoutImages(InImages, PageSettings, Layout) && Layout.TileMetas.size() == InImages.size())
+	{
+		return true;
+	}
+
+	// DoMerge retries a spilled unsorted layout in decreasing order, so does this.
+	if (PageSettings.SortKey == SORT_None)
+	{
+		PageSettings.SortKey = SORT_Area;
+		return LayoutImages(InImages, PageSettings, Layout) && Layout.TileMetas.size() == InImages.size();
+	}
+	return false;
+}
+
+// the allowed sides in [InMin, InMax], ascending
+static void CandidateSides(uint32_t InMin, uint32_t InMax, const FPackSettings &InSettings, std::vector<uint32_t> &OutSides)
+{
+	OutSides.clear();
+	if (InSettings.bPowerOfTwo)
+	{
+		const uint32_t kStart = InSettings.bMultipleOf4 ? 4 : 1;
+		for (uint64_t Side = kStart; Side <= InMax; Side <<= 1)
+		{
+			if (Side >= InMin)
+			{
+				OutSides.push_back((uint32_t)Side);
+			}
+		} // end for Side
+	}
+	else
+	{
+		const uint32_t kStep = InSettings.bMultipleOf4 ? 4 : 1;
+		const uint64_t kStart = ((uint64_t)(InMin > 0 ? InMin : 1) + kStep - 1) / kStep * kStep;
+		for (uint64_t Side = kStart; Side <= InMax; Side += kStep)
+		{
+			OutSides.push_back((uint32_t)Side);
+		} // end for Side
+	}
+}
+
+bool FImageMergeContext::FindAtlasSize(const std::vector<FImage*> &InImages, uint32_t &OutWidth, uint32_t &OutHeight)
+{
+	// lower bounds: a page is at least as large as the largest tile and the
+	// sum of all tiles, sizes below them are never packed.
+	uint32_t MinW = 0, MinH = 0;
+	uint32_t MinSide = ~(uint32_t)0;	// the shortest side of any tile
+	uint64_t TotalArea = 0;
+	for (size_t k = 0; k < InImages.size(); k++)
+	{
+		const uint64_t kTileW = (uint64_t)InImages[k]->TrimRect().W + Settings.HMargin * 2;
+		const uint64_t kTileH = (uint64_t)InImages[k]->TrimRect().H + Settings.VMargin * 2;
+		const bool bFits = kTileW <= Settings.MaxWidth && kTileH <= Settings.MaxHeight;
+		if (Settings.bAllowRotation)
+		{
+			// rotated, the margins swap with the sides
+			const bool bFitsRotated = kTileH <= Settings.MaxWidth && kTileW <= Settings.MaxHeight;
+			if (!bFits && !bFitsRotated)
+			{
+				return false;
+			}
+			MinW = std::max(MinW, (uint32_t)std::min(kTileW, kTileH));
+			MinH = std::max(MinH, (uint32_t)std::min(kTileW, kTileH));
+		}
+		else
+		{
+			if (!bFits)
+			{
+				return false;
+			}
+			MinW = std::max(MinW, (uint32_t)kTileW);
+			MinH = std::max(MinH, (uint32_t)kTileH);
+		}
+		MinSide = std::min(MinSide, (uint32_t)std::min(kTileW, kTileH));
+		TotalArea += kTileW * kTileH;
+	} // end for k
+
+	if (Settings.bSquare)
+	{
+		const uint32_t kSqrtArea = (uint32_t)std::ceil(std::sqrt((double)TotalArea));
+		MinW = MinH = std::max(std::max(MinW, MinH), kSqrtArea);
+	}
+
+	std::vector<uint32_t> Widths, Heights;
+	CandidateSides(MinW, Settings.bSquare ? std::min(Settings.MaxWidth, Settings.MaxHeight) : Settings.MaxWidth, Settings, Widths);
+	CandidateSides(MinH, Settings.MaxHeight, Settings, Heights);
+	if (Widths.empty() || Heights.empty())
+	{
+		return false;
+	}
+
+	// the sides of a square grow with its area, the smallest one is binary
+	// searched. here and below, larger pages are assumed to fit whenever a
+	// smaller one does.
+	if (Settings.bSquare)
+	{
+		if (!FitsOnePage(InImages, Widths.back(), Widths.back()))
+		{
+			return false;
+		}
+
+		size_t Low = 0, High = Widths.size() - 1;
+		while (Low < High)
+		{
+			const size_t kMid = (Low + High) / 2;
+			if (FitsOnePage(InImages, Widths[kMid], Widths[kMid]))
+			{
+				High = kMid;
+			}
+			else
+			{
+				Low = kMid + 1;
+			}
+		}
+
+		OutWidth = OutHeight = Widths[High];
+		return true;
+	}
+
+	// for a width the lowest height that fits, searched only up to the area
+	// of the best page found so far. a width that can not beat it costs one
+	// pack at most, it is left at 0. the widths are searched in batches of a
+	// fixed size in a fixed order, all of a batch against the best area from
+	// before it, so the size found is the same for any count of threads.
+	std::vector<uint32_t> BestHeights(Widths.size(), 0);
+	std::vector<char> Searched(Widths.size(), 0);
+	uint64_t BestArea = ~(uint64_t)0;
+
+	auto SearchWidth = [&](uint32_t InIndex, uint64_t InMaxArea)
+	{
+		const uint32_t kWidth = Widths[InIndex];
+		size_t Low = std::lower_bound(Heights.begin(), Heights.end(), (TotalArea + kWidth - 1) / kWidth) - Heights.begin();
+		size_t High = std::upper_bound(Heights.begin(), Heights.end(), InMaxArea / kWidth) - Heights.begin();
+		if (Low >= High || !FitsOnePage(InImages, kWidth, Heights[High - 1]))
+		{
+			return;
+		}
+
+		// binary search in [Low, High - 1]
+		High--;
+		while (Low < High)
+		{
+			const size_t kMid = (Low + High) / 2;
+			if (FitsOnePage(InImages, kWidth, Heights[kMid]))
+			{
+				High = kMid;
+			}
+			else
+			{
+				Low = kMid + 1;
+			}
+		}
+		BestHeights[InIndex] = Heights[High];
+	};
+
+	auto SearchWidths = [&](const std::vector<uint32_t> &InIndices)
+	{
+		const size_t kBatchSize = 8;
+		for (size_t Begin = 0; Begin < InIndices.size(); Begin += kBatchSize)
+		{
+			const size_t kEnd = std::min(Begin + kBatchSize, InIndices.size());
+			const uint64_t kMaxArea = BestArea;
+			std::function<void(uint32_t)> SearchOne = [&](uint32_t InK)
+			{
+				SearchWidth(InIndices[Begin + InK], kMaxArea);
+			};
+
+			if (pThreadPool)
+			{
+				pThreadPool->ParallelFor((uint32_t)(kEnd - Begin), SearchOne);
+			}
+			else
+			{
+				for (uint32_t k = 0; k < (uint32_t)(kEnd - Begin); k++)
+				{
+					SearchOne(k);
+				} // end for k
+			}
+
+			for (size_t k = Begin; k < kEnd; k++)
+			{
+				const uint32_t kIndex = InIndices[k];
+				Searched[kIndex] = 1;
+				if (BestHeights[kIndex] > 0)
+				{
+					BestArea = std::min(BestArea, (uint64_t)Widths[kIndex] * BestHeights[kIndex]);
+				}
+			} // end for k
+		} // end for Begin
+	};
+
+	// smallest area, then the squarer page, then the narrower one.
+	auto IsBetterWidth = [&](size_t InA, size_t InB) -> bool
+	{
+		const uint64_t kAreaA = (uint64_t)Widths[InA] * BestHeights[InA];
+		const uint64_t kAreaB = (uint64_t)Widths[InB] * BestHeights[InB];
+		if (kAreaA != kAreaB)
+		{
+			return kAreaA < kAreaB;
+		}
+		const uint32_t kSideA = std::max(Widths[InA], BestHeights[InA]);
+		const uint32_t kSideB = std::max(Widths[InB], BestHeights[InB]);
+		return kSideA != kSideB ? kSideA < kSideB : InA < InB;
+	};
+
+	// NPOT has thousands of widths. every Step-th one is searched first, at
+	// least the shortest tile side apart, then the step is halved around each
+	// of the best few until it is 1. the widths closest to a square page go
+	// first, their pages bound the search of the other ones.
+	size_t Step = 1;
+	if (!Settings.bPowerOfTwo)
+	{
+		const uint32_t kMaxCoarseWidths = 64;
+		const uint32_t kSideStep = Settings.bMultipleOf4 ? 4 : 1;
+		Step = std::max<size_t>((MinSide + kSideStep - 1) / kSideStep, (Widths.size() + kMaxCoarseWidths - 1) / kMaxCoarseWidths);
+	}
+
+	std::vector<uint32_t> Coarse;
+	for (size_t k = 0; k < Widths.size(); k += Step)
+	{
+		Coarse.push_back((uint32_t)k);
+	} // end for k
+	if (Coarse.back() != Widths.size() - 1)
+	{
+		Coarse.push_back((uint32_t)Widths.size() - 1);
+	}
+
+	const double kSquareSide = std::sqrt((double)TotalArea);
+	std::stable_sort(Coarse.begin(), Coarse.end(), [&](uint32_t InA, uint32_t InB)
+	{
+		return std::fabs(Widths[InA] - kSquareSide) < std::fabs(Widths[InB] - kSquareSide);
+	});
+	SearchWidths(Coarse);
+
+	std::vector<uint32_t> Seeds;
+	for (size_t k = 0; k < Coarse.size(); k++)
+	{
+		if (BestHeights[Coarse[k]] > 0)
+		{
+			Seeds.push_back(Coarse[k]);
+		}
+	} // end for k
+	if (Seeds.empty())
+	{
+		return false;
+	}
+
+	const size_t kNumRefined = 4;
+	std::sort(Seeds.begin(), Seeds.end(), IsBetterWidth);
+	Seeds.resize(std::min(Seeds.size(), kNumRefined));
+
+	size_t Best = Seeds[0];
+	for (size_t k = 0; k < Seeds.size(); k++)
+	{
+		size_t Current = Seeds[k];
+		size_t SeedStep = Step;
+		while (SeedStep > 1)
+		{
+			SeedStep = (SeedStep + 1) / 2;
+
+			std::vector<uint32_t> Around;
+			if (Current >= SeedStep && !Searched[Current - SeedStep])
+			{
+				Around.push_back((uint32_t)(Current - SeedStep));
+			}
+			if (Current + SeedStep < Widths.size() && !Searched[Current + SeedStep])
+			{
+				Around.push_back((uint32_t)(Current + SeedStep));
+			}
+			SearchWidths(Around);
+
+			for (size_t j = 0; j < Around.size(); j++)
+			{
+				if (BestHeights[Around[j]] > 0 && IsBetterWidth(Around[j], Current))
+				{
+					Current = Around[j];
+				}
+			} // end for j
+		}
+
+		if (IsBetterWidth(Current, Best))
+		{
+			Best = Current;
+		}
+	} // end for k
+
+	OutWidth = Widths[Best];
+	OutHeight = BestHeights[Best];
+	return true;
+}
+
+bool FImageMergeContext::DoMerge(const std::vector<FImage*> &InImages)
+{
+	Purge();
+
+	if (InImages.size() <= 0)
+	{
+		return false;
+	}
+
+	// check the consistency of images's format.
+	assert(InImages[0]);
+	const int32_t kFormat = InImages[0]->Format();
+	bool bFormatSame = true;
+	for (size_t k = 1; k < InImages.size(); k++)
+	{
+		FImage *pImage = InImages[k];
+		assert(pImage);
+		if (pImage->Format() != kFormat)
+		{
+			bFormatSame = false;
+			break;
+		}
+	} // end for k
+	if (!bFormatSame)
+	{
+		return false;
+	}
+
+	// trim the transparent borders
+	if (Settings.bTrimAlpha && kFormat == PIXEL_RGBA)
+	{
+		TrimImages(InImages);
+	}
+
+	// the same images are packed once
+	std::vector<FImage*> UniqueImages;
+	std::vector<FDuplicate> Duplicates;
+	if (Settings.bDetectDuplicates)
+	{
+		FindDuplicates(InImages, UniqueImages, Duplicates);
+	}
+	else
+	{
+		UniqueImages = InImages;
+	}
+
+	// find the page size
+	if (Settings.bAutoSize)
+	{
+		uint32_t Width = 0, Height = 0;
+		if (FindAtlasSize(UniqueImages, Width, Height))
+		{
+			printf("Atlas size: %u x %u\n", Width, Height);
+		}
+		else
+		{
+			Width = Settings.MaxWidth;
+			Height = Settings.MaxHeight;
+			printf("No atlas size up to %u x %u holds all images, more pages are used\n", Width, Height);
+		}
+		Settings.Width = Width;
+		Settings.Height = Height;
+	}
+
+	// allocate the zones
+	FLayoutResult Layout;
+	bool bLayoutDone = false;
+	if (Settings.bRaceLayouts)
+	{
+		bLayoutDone = RaceLayouts(UniqueImages, Settings, Layout);
+	}
+	else
+	{
+		bLayoutDone = LayoutImages(UniqueImages, Settings, Layout);
+
+		// spilled over to more pages, first-fit-decreasing usually needs fewer.
+		if (bLayoutDone && Layout.PageCount > 1 && Settings.SortKey == SORT_None)
+		{
+			FPackSettings Decreasing(Settings);
+			Decreasing.SortKey = SORT_Area;
+
+			FLayoutResult DecreasingLayout;
+			if (LayoutImages(UniqueImages, Decreasing, DecreasingLayout) && DecreasingLayout.IsBetterThan(Layout))
+			{
+				Layout.TileMetas.swap(DecreasingLayout.TileMetas);
+				Layout.PageCount = DecreasingLayout.PageCount;
+			}
+		}
+	}
+	if (!bLayoutDone)
+	{
+		return false;
+	}
+	ImageTileMetas.swap(Layout.TileMetas);
+
+	// the duplicates share the tile of their packed image
+	if (!Duplicates.empty())
+	{
+		std::unordered_map<const FImage*, size_t> TileOfImage;
+		for (size_t k = 0; k < ImageTileMetas.size(); k++)
+		{
+			TileOfImage[ImageTileMetas[k].pOriginImage] = k;
+		} // end for k
+
+		for (size_t k = 0; k < Duplicates.size(); k++)
+		{
+			std::unordered_map<const FImage*, size_t>::const_iterator It = TileOfImage.find(Duplicates[k].pSameImage);
+			if (It == TileOfImage.end())
+			{
+				continue;
+			}
+
+			FImageTileMeta TileMeta = ImageTileMetas[It->second];
+			TileMeta.pOriginImage = Duplicates[k].pImage;
+			TileMeta.bDuplicate = true;
+			TileMeta.Transform = Duplicates[k].Transform;
+			ImageTileMetas.push_back(TileMeta);
+		} // end for k
+	}
+
+	// report the images that are not packed
+	if (ImageTileMetas.size() < InImages.size())
+	{
+		std::vector<const FImage*> PackedImages;
+		for (size_t k = 0; k < ImageTileMetas.size(); k++)
+		{
+			PackedImages.push_back(ImageTileMetas[k].pOriginImage);
+		} // end for k
+		std::sort(PackedImages.begin(), PackedImages.end());
+
+		for (size_t k = 0; k < InImages.size(); k++)
+		{
+			if (!std::binary_search(PackedImages.begin(), PackedImages.end(), (const FImage*)InImages[k]))
+			{
+				printf("Failed to pack image %s (%u x %u): no room in %u page(s) of %u x %u\n", InImages[k]->Filename().c_str(),
+					InImages[k]->TrimRect().W, InImages[k]->TrimRect().H, Layout.PageCount, Settings.Width, Settings.Height);
+			}
+		} // end for k
+	}
+
+	// make the merged images & fill in.
+	return ComposePages(kFormat);
+}
+
+bool FImageMergeContext::ComposePages(int32_t InFormat)
+{
+	uint32_t PageCount = 0;
+	for (size_t k = 0; k < ImageTileMetas.size(); k++)
+	{
+		PageCount = std::max(PageCount, ImageTileMetas[k].PageIndex + 1);
+	} // end for k
+
+	PageFormat = InFormat;
+	MergedImages.resize(PageCount, NULL);
+	if (Settings.bLazyDecode)
+	{
+		return PageCount > 0; // page by page in ComposePage
+	}
+
+	for (uint32_t Page = 0; Page < PageCount; Page++)
+	{
+		MergedImages[Page] = FImage::Create(Settings.Width, Settings.Height, InFormat);
+		if (!MergedImages[Page])
+		{
+			return false;
+		}
+	} // end for Page
+
+	// the duplicates have no pixels of their own
+	std::vector<uint32_t> Tiles;
+	for (size_t k = 0; k < ImageTileMetas.size(); k++)
+	{
+		if (!ImageTileMetas[k].bDuplicate)
+		{
+			Tiles.push_back((uint32_t)k);
+		}
+	} // end for k
+
+	return PageCount > 0 && ComposeTiles(Tiles);
+}
+
+bool FImageMergeContext::ComposePage(uint32_t InPageIndex)
+{
+	if (InPageIndex >= MergedImages.size())
+	{
+		return false;
+	}
+
+	if (!MergedImages[InPageIndex])
+	{
+		MergedImages[InPageIndex] = FImage::Create(Settings.Width, Settings.Height, PageFormat);
+		if (!MergedImages[InPageIndex])
+		{
+			return false;
+		}
+	}
+
+	std::vector<uint32_t> Tiles;
+	for (size_t k = 0; k < ImageTileMetas.size(); k++)
+	{
+		if (!ImageTileMetas[k].bDuplicate && ImageTileMetas[k].PageIndex == InPageIndex)
+		{
+			Tiles.push_back((uint32_t)k);
+		}
+	} // end for k
+
+	return ComposeTiles(Tiles);
+}
+
+void FImageMergeContext::ReleasePage(uint32_t InPageIndex)
+{
+	if (InPageIndex < MergedImages.size())
+	{
+		delete MergedImages[InPageIndex]; MergedImages[InPageIndex] = NULL;
+	}
+}
+
+bool FImageMergeContext::ComposeTiles(const std::vector<uint32_t> &InTiles)
+{
+	// the tiles do not overlap, so they are blitted in parallel, also the ones
+	// of the same page. a lazy image lives only while its tile is blitted.
+	const uint32_t PixelBytes = FImageIO::BytesPerPixel(PageFormat);
+	std::atomic<bool> bAllDecoded(true);
+	std::function<void(uint32_t)> ComposeTile = [&](uint32_t InIndex)
+	{
+		const FImageTileMeta &TileMeta = ImageTileMetas[InTiles[InIndex]];
+		assert(TileMeta.pOriginImage);
+		FScopedDecodeThreadPool DecodePool(DecodeThreadPool());
+
+		// an upright, untrimmed lazy image is decoded straight into its place
+		// in the page, it needs no pixels of its own.
+		const FImage *pLazy = TileMeta.pOriginImage;
+		const FPackRect &kLazyTrim = pLazy->TrimRect();
+		if (!pLazy->IsDecoded() && !TileMeta.bRotated && !pLazy->Filename().empty()
+			&& kLazyTrim.W == pLazy->Width() && kLazyTrim.H == pLazy->Height())
+		{
+			FImage *pPage = MergedImages[TileMeta.PageIndex];
+			const uint32_t kPageLineBytes = pPage->Width() * PixelBytes;
+			uint8_t *pDst = &pPage->Data()[TileMeta.Y * kPageLineBytes + TileMeta.X * PixelBytes];
+			if (!FImageIO::ReadImageInto(pLazy->Filename().c_str(), pDst, kPageLineBytes, pLazy->Width(), pLazy->Height(), PageFormat))
+			{
+				printf("Failed to decode image %s\n", FImageIO::LastError());
+				bAllDecoded = false;
+			}
+			return;
+		}
+
+		FScopedDecode Decoded(TileMeta.pOriginImage);
+		if (!Decoded.IsDecoded())
+		{
+			bAllDecoded = false;
+			return;
+		}
+
+		FImage *pMergedImage = MergedImages[TileMeta.PageIndex];
+		const FImage *pOrigin = TileMeta.pOriginImage;
+		const FPackRect &Trim = pOrigin->TrimRect();
+		const uint32_t kSrcLineBytes = pOrigin->Width() * PixelBytes;
+		const uint8_t *pSrc = &pOrigin->Data()[Trim.Y * kSrcLineBytes + Trim.X * PixelBytes];
+		if (TileMeta.bRotated)
+		{
+			CopyRectangleRotated(pMergedImage->Data(), TileMeta.X, TileMeta.Y, pMergedImage->Width() * PixelBytes,
+				pSrc, Trim.W, Trim.H, kSrcLineBytes, PixelBytes);
+		}
+		else
+		{
+			CopyRectangleMemory(pMergedImage->Data(), TileMeta.X * PixelBytes, TileMeta.Y, pMergedImage->Width() * PixelBytes,
+				pSrc, Trim.W * PixelBytes, Trim.H, kSrcLineBytes);
+		}
+	};
+
+	if (pThreadPool)
+	{
+		pThreadPool->ParallelFor((uint32_t)InTiles.size(), ComposeTile);
+	}
+	else
+	{
+		for (uint32_t k = 0; k < (uint32_t)InTiles.size(); k++)
+		{
+			ComposeTile(k);
+		} // end for k
+	}
+
+	return bAllDecoded;
+}
+
+// file name of a page: page 0 is InFilename, page N is <name>_N.<ext>
+static std::string PageFilename(const char *InFilename, uint32_t InPageIndex)
+{
+	std::string Filename(InFilename);
+	if (InPageIndex == 0)
+	{
+		return Filename;
+	}
+
+	char Suffix[16];
+	snprintf(Suffix, sizeof(Suffix), "_%u", InPageIndex);
+
+	const size_t kDot = Filename.find_last_of('.');
+	const size_t kSlash = Filename.find_last_of("/\\");
+	if (kDot == std::string::npos || (kSlash != std::string::npos && kDot < kSlash))
+	{
+		return Filename + Suffix;
+	}
+	return Filename.substr(0, kDot) + Suffix + Filename.substr(kDot);
+}
+
+uint32_t FImagePacker::PackImages(const char *InImageFilenames[], uint32_t InCount, uint32_t InWidth, uint32_t InHeight,
+						uint32_t InHMargin, uint32_t InVMargin, char *InBigImageFilename)
+{
+	FPackSettings Settings;
+	Settings.Width = InWidth;
+	Settings.Height = InHeight;
+	Settings.HMargin = InHMargin;
+	Settings.VMargin = InVMargin;
+
+	return PackImages(InImageFilenames, InCount, Settings, InBigImageFilename);
+}
+
+uint32_t FImagePacker::PackImages(const char *InImageFilenames[], uint32_t InCount, const FPackSettings &InSettings, const char *InBigImageFilename)
+{
+	// the decode pool is set per task, so packs on other threads keep theirs.
+	FThreadPool *pThreadPool = new FThreadPool(InSettings.NumThreads);
+	FThreadPool *pDecodeThreadPool = InSettings.bParallelJpeg ? pThreadPool : NULL;
+
+	// decode the files in parallel, each one into its own slot. the failures
+	// are reported & the images are kept in the order of the file list, so
+	// the result is the same for any thread count.
+	std::vector<FImage*> Loaded(InCount, NULL);
+	std::vector<std::string> LoadErrors(InCount);
+	const uint32_t kReadQueueDepth = 256;	// 128 files in flight
+	// a lazy probe maps the file & reads its header only, reading the whole
+	// file ahead would read it twice, the decode at compose reads it again.
+	FFileBatchReader Reader(InSettings.bBatchedReads && !InSettings.bLazyDecode ? kReadQueueDepth : 0);
+	if (Reader.IsBatched())
+	{
+		// this thread keeps the opens & reads of many files in flight, each
+		// file is decoded on the pool as soon as it is read. the reads wait
+		// while a few files per worker are read but not decoded yet, so the
+		// file bytes held in memory stay bounded when the decodes are slower.
+		const uint32_t kMaxPendingDecodes = pThreadPool->NumThreads() * 2;
+		std::mutex DoneMutex;
+		std::condition_variable DoneCond;
+		uint32_t DoneCount = 0;
+		uint32_t QueuedCount = 0;
+		Reader.ReadFiles(InImageFilenames, InCount, [&](uint32_t InIndex, uint8_t *InFileBytes, uint32_t InFileSize)
+		{
+			{
+				std::unique_lock<std::mutex> Lock(DoneMutex);
+				while (QueuedCount - DoneCount >= kMaxPendingDecodes)
+				{
+					DoneCond.wait(Lock);
+				}
+				QueuedCount++;
+			}
+
+			pThreadPool->AddTask([&, InIndex, InFileBytes, InFileSize]()
+			{
+				FScopedDecodeThreadPool DecodePool(pDecodeThreadPool);
+				const char *kFilename = InImageFilenames[InIndex];
+				if (!InFileBytes)
+				{
+					LoadErrors[InIndex] = std::string(kFilename) + ": Unable to open file";
+				}
+				else
+				{
+					Loaded[InIndex] = InSettings.bLazyDecode ? FImage::ProbeFile(kFilename, InFileBytes, InFileSize) : FImage::LoadFromFile(kFilename, InFileBytes, InFileSize);
+					if (!Loaded[InIndex])
+					{
+						LoadErrors[InIndex] = FImageIO::LastError();
+					}
+					delete[] InFileBytes;
+				}
+
+				std::lock_guard<std::mutex> Lock(DoneMutex);
+				DoneCount++;
+				DoneCond.notify_all();
+			});
+		});
+
+		std::unique_lock<std::mutex> Lock(DoneMutex);
+		while (DoneCount < InCount)
+		{
+			DoneCond.wait(Lock);
+		}
+	}
+	else
+	{
+		std::function<void(uint32_t)> LoadImage = [&](uint32_t InIndex)
+		{
+			FScopedDecodeThreadPool DecodePool(pDecodeThreadPool);
+			Loaded[InIndex] = InSettings.bLazyDecode ? FImage::ProbeFile(InImageFilenames[InIndex]) : FImage::LoadFromFile(InImageFilenames[InIndex]);
+			if (!Loaded[InIndex])
+			{
+				LoadErrors[InIndex] = FImageIO::LastError();
+			}
+		};
+		pThreadPool->ParallelFor(InCount, LoadImage);
+	}
+
+	std::vector<FImage*> Images;
+	for (uint32_t k = 0; k < InCount; k++)
+	{
+		if (!Loaded[k])
+		{
+			printf("Failed to load image file %s\n", LoadErrors[k].c_str());
+			continue;
+		}
+
+		Images.push_back(Loaded[k]);
+	} // end for k
+
+	uint32_t PackedCount = 0;
+	FImageMergeContext Merger(InSettings, pThreadPool);
+
+	if (Merger.DoMerge(Images))
+	{
+		const uint32_t kPageCount = Merger.GetPageCount();
+		const std::vector<FImageMergeContext::FImageTileMeta>& TileMetas = Merger.GetTileMeta();
+
+		std::vector<std::string> PageFilenames(kPageCount);
+		std::vector<char> PageSaved(kPageCount, 0);
+		FImageWriteSettings WriteSettings;
+		WriteSettings.PngLevel = (int32_t)InSettings.PngLevel;
+		WriteSettings.bPngOptimize = InSettings.bPngOptimize;
+		WriteSettings.pThreadPool = pThreadPool;	// a big page is also split over the threads
+		std::function<void(uint32_t)> SavePage = [&](uint32_t InPage)
+		{
+			const FImage* pMergedImage = Merger.GetMergedImage(InPage);
+			PageFilenames[InPage] = PageFilename(InBigImageFilename, InPage);
+			PageSaved[InPage] = FImageIO::WriteImage(PageFilenames[InPage].c_str(), pMergedImage->Data(), pMergedImage->Width(), pMergedImage->Height(), pMergedImage->Format(), WriteSettings) ? 1 : 0;
+		};
+		if (InSettings.bLazyDecode)
+		{
+			// one page at a time: composed, saved & freed, so the pack holds
+			// one page and the images being blitted into it.
+			for (uint32_t Page = 0; Page < kPageCount; Page++)
+			{
+				if (Merger.ComposePage(Page))
+				{
+					SavePage(Page);
+				}
+				else
+				{
+					PageFilenames[Page] = PageFilename(InBigImageFilename, Page);
+				}
+				Merger.ReleasePage(Page);
+			} // end for Page
+		}
+		else
+		{
+			// encode the pages in parallel
+			pThreadPool->ParallelFor(kPageCount, SavePage);
+		}
+
+		bool bSuccess = true;
+		for (uint32_t Page = 0; Page < kPageCount; Page++)
+		{
+			if (!PageSaved[Page])
+			{
+				printf("Failed to save merged image to file: %s\n", PageFilenames[Page].c_str());
+				bSuccess = false;
+			}
+		} // end for Page
+
+		if (bSuccess)
+		{
+			// output the image tiles information
+			printf("Image Atlas Information:\n");
+			for (uint32_t Page = 0; Page < kPageCount; Page++)
+			{
+				printf("PAGE %u: %s\n", Page, PageFilenames[Page].c_str());
+			} // end for Page
+			for (size_t k = 0; k < TileMetas.size(); k++)
+			{
+				const FImageMergeContext::FImageTileMeta &Meta = TileMetas[k];
+				printf("IMAGE: %s\n", Meta.pOriginImage->Filename().c_str());
+				const FPackRect &Trim = Meta.pOriginImage->TrimRect();
+				printf("     { page:%u, x:%u, y:%u, w:%u, h:%u, rotated:%s, offset_x:%u, offset_y:%u, source_w:%u, source_h:%u, transform:%s }\n",
+					Meta.PageIndex, Meta.X, Meta.Y, Trim.W, Trim.H, Meta.bRotated ? "true" : "false",
+					Trim.X, Trim.Y, Meta.pOriginImage->Width(), Meta.pOriginImage->Height(), FImageCompare::TransformName(Meta.Transform));
+			} // end for k
+
+			PackedCount = (uint32_t)TileMetas.size();
+		}
+	}
+
+	delete pThreadPool; pThreadPool = NULL;
+	// the workers freed their decode buffers as they exited, this thread
+	// took part in the ParallelFor loads
+	FImageIO::TrimScratch();
+
+	for (uint32_t k = 0; k < Images.size(); k++)
+	{
+		FImage *pImage = Images[k];
+		assert(pImage);
+		delete pImage;
+	} // end for k
+	Images.clear();
+
+	return PackedCount;
+}
+
+static void CopyRectangleMemory(uint8_t *pDst, uint32_t InDstX, uint32_t InDstY, uint32_t InDstLineBytes,
+	const uint8_t *pSrc, uint32_t InSrcWidth, uint32_t InSrcHeight, uint32_t InSrcLineBytes)
+{
+	assert((InDstLineBytes - InDstX) >= InSrcWidth);
+
+	uint8_t *pDstLine = &pDst[InDstY * InDstLineBytes + InDstX];
+	const uint8_t *pSrcLine = pSrc;
+	for (uint32_t k = 0; k < InSrcHeight; k++)
+	{
+		memcpy(pDstLine, pSrcLine, InSrcWidth);
+		pDstLine += InDstLineBytes;
+		pSrcLine += InSrcLineBytes;
+	} // end for k
+}
+
+// 3 bytes pixel, copied as one value
+struct FPixel24
+{
+	uint8_t	Bytes[3];
+};
+
+// the source is walked in kBlockSize x kBlockSize blocks: the source rows of a
+// block and the destination rows it lands on stay in cache together, instead
+// of every source row touching a new destination line per pixel.
+template <typename TPixel>
+static void CopyRectangleRotatedBlocked(uint8_t *pDst, uint32_t InDstX, uint32_t InDstY, uint32_t InDstLineBytes,
+	const uint8_t *pSrc, uint32_t InSrcWidth, uint32_t InSrcHeight, uint32_t InSrcLineBytes)
+{
+	const uint32_t kBlockSize = 32;
+
+	for (uint32_t BlockY = 0; BlockY < InSrcHeight; BlockY += kBlockSize)
+	{
+		const uint32_t kEndY = std::min(BlockY + kBlockSize, InSrcHeight);
+		for (uint32_t BlockX = 0; BlockX < InSrcWidth; BlockX += kBlockSize)
+		{
+			const uint32_t kEndX = std::min(BlockX + kBlockSize, InSrcWidth);
+
+			// source column x is destination row x, walk the destination rows
+			// so the writes are sequential.
+			for (uint32_t x = BlockX; x < kEndX; x++)
+			{
+				TPixel *pDstLine = (TPixel*)&pDst[(size_t)(InDstY + x) * InDstLineBytes] + InDstX;
+				for (uint32_t y = BlockY; y < kEndY; y++)
+				{
+					pDstLine[InSrcHeight - 1 - y] = ((const TPixel*)&pSrc[(size_t)y * InSrcLineBytes])[x];
+				} // end for y
+			} // end for x
+		} // end for BlockX
+	} // end for BlockY
+}
+
+// copy the image rotated 90 degrees clockwise, InDstX is in pixels.
+// source pixel (x, y) goes to (InDstX + InSrcHeight - 1 - y, InDstY + x).
+static void CopyRectangleRotated(uint8_t *pDst, uint32_t InDstX, uint32_t InDstY, uint32_t InDstLineBytes,
+	const uint8_t *pSrc, uint32_t InSrcWidth, uint32_t InSrcHeight, uint32_t InSrcLineBytes, uint32_t InPixelBytes)
+{
+	assert(InDstLineBytes / InPixelBytes - InDstX >= InSrcHeight);
+
+	switch (InPixelBytes)
+	{
+	case 4:
+		CopyRectangleRotatedBlocked<uint32_t>(pDst, InDstX, InDstY, InDstLineBytes, pSrc, InSrcWidth, InSrcHeight, InSrcLineBytes); break;
+	case 3:
+		CopyRectangleRotatedBlocked<FPixel24>(pDst, InDstX, InDstY, InDstLineBytes, pSrc, InSrcWidth, InSrcHeight, InSrcLineBytes); break;
+	case 2:
+		CopyRectangleRotatedBlocked<uint16_t>(pDst, InDstX, InDstY, InDstLineBytes, pSrc, InSrcWidth, InSrcHeight, InSrcLineBytes); break;
+	case 1:
+		CopyRectangleRotatedBlocked<uint8_t>(pDst, InDstX, InDstY, InDstLineBytes, pSrc, InSrcWidth, InSrcHeight, InSrcLineBytes); break;
+	default:
+		assert(0); break;
+	}
 }
\ No newline at end of file
@@ -14,12 +14,145 @@
 //       |                                         |
 //       *-----------------------------------------*
 //
+//		Other engines:
+//		MaxRects	see MaxRectsPacker.h
+//		Skyline		see SkylinePacker.h
+//
 
 #pragma once
 
 #include <cstdint>
 #include <string>
 
+#include "MaxRectsPacker.h"
+
+
+// packing algorithm
+enum EPackEngine
+{
+	PACK_Guillotine = 0,	// the right/left zone split above
+	PACK_MaxRects,
+	PACK_Skyline,			// fast bottom-left for many near-uniform images
+	PACK_MAX
+};
+
+// order to insert the images, all are descending
+enum ESortKey
+{
+	SORT_None = 0,		// keep the order of the caller
+	SORT_Area,
+	SORT_MaxSide,
+	SORT_Perimeter,
+	SORT_Height,
+	SORT_Width,
+	SORT_MAX
+};
+
+// packing settings
+struct FPackSettings
+{
+	FPackSettings()
+		: Width(512)
+		, Height(512)
+		, HMargin(0)
+		, VMargin(0)
+		, Engine(PACK_Guillotine)
+		, MaxRectsHeuristic(MAXRECTS_BestShortSideFit)
+		, bSkylineWasteMap(true)
+		, SortKey(SORT_None)
+		, bRaceLayouts(false)
+		, RaceTimeBudgetMs(0)
+		, NumThreads(0)
+		, MaxPages(0)
+		, bAutoSize(false)
+		, MaxWidth(4096)
+		, MaxHeight(4096)
+		, bPowerOfTwo(false)
+		, bSquare(false)
+		, bMultipleOf4(false)
+		, bAllowRotation(false)
+		, bTrimAlpha(false)
+		, AlphaThreshold(0)
+		, bDetectDuplicates(false)
+		, bDetectFlippedDuplicates(false)
+		, bLazyDecode(false)
+		, bBatchedReads(true)
+		, bParallelJpeg(true)
+		, PngLevel(6)
+		, bPngOptimize(false)
+	{}
+
+	uint32_t			Width;		// size of the merged image
+	uint32_t			Height;
+	uint32_t			HMargin;	// horizontal margin for image
+	uint32_t			VMargin;	// vertical margin for image
+	EPackEngine			Engine;
+	EMaxRectsHeuristic	MaxRectsHeuristic;	// only for PACK_MaxRects
+	bool				bSkylineWasteMap;	// only for PACK_Skyline, reuse the gaps under the skyline
+	ESortKey			SortKey;	// with more than one page, SORT_Area gives first-fit-decreasing
+
+	// sort-and-race: try every sort key with every engine & heuristic on the
+	// thread pool and keep the best layout. Engine, MaxRectsHeuristic and
+	// SortKey above are the first candidate.
+	bool				bRaceLayouts;
+	uint32_t			RaceTimeBudgetMs;	// candidates not started in time are skipped, 0 is no limit
+	uint32_t			NumThreads;			// workers for decoding & packing, 0 is one per hardware thread
+
+	// images that do not fit go to the next pages, page N > 0 is saved as
+	// <name>_N.<ext>. images larger than a page are reported and skipped.
+	uint32_t			MaxPages;			// 0 is no limit
+
+	// auto size: Width & Height are replaced by the smallest page that holds
+	// all images, searched up to MaxWidth x MaxHeight. when none does, the
+	// page is MaxWidth x MaxHeight and the rest spills to more pages.
+	// NPOT widths are tried coarse first, then around the best ones, so the
+	// page may be slightly larger than the smallest one.
+	bool				bAutoSize;
+	uint32_t			MaxWidth;
+	uint32_t			MaxHeight;
+	bool				bPowerOfTwo;	// only for bAutoSize, else any size (NPOT)
+	bool				bSquare;		// only for bAutoSize
+	bool				bMultipleOf4;	// only for bAutoSize, block compressed formats need it
+
+	// an image may be stored rotated 90 degrees clockwise when the engine
+	// places it better so, the margins rotate with it.
+	bool				bAllowRotation;
+
+	// pack only the box of the pixels whose alpha is larger than AlphaThreshold,
+	// the offset in & size of the source image are listed to restore the frame.
+	// only for RGBA images.
+	bool				bTrimAlpha;
+	uint8_t				AlphaThreshold;
+
+	// an image equal to an earlier one is packed once, its tile points to the
+	// same rectangle. with bDetectFlippedDuplicates also the mirrored and
+	// 180 degrees rotated copies, the tile lists the transform.
+	bool				bDetectDuplicates;
+	bool				bDetectFlippedDuplicates;	// only for bDetectDuplicates
+
+	// read only the image headers for the layout, decode each image when it
+	// is blitted and free it right after. trim & duplicate detection decode
+	// the images once more before the layout, one at a time. the pages are
+	// composed & saved one after the other, each is freed once written.
+	bool				bLazyDecode;
+
+	// read the files through io_uring on Linux: many opens & reads are in
+	// flight at once, the decodes run on the pool as the files arrive.
+	// without io_uring every worker reads & decodes its own files.
+	// ignored with bLazyDecode: the probes map the files and touch only the
+	// header pages, each file is read whole once, when it is blitted.
+	bool				bBatchedReads;
+
+	// a big jpeg with restart markers is decoded on several threads of the
+	// pool, a run of its restart intervals each. the others decode on one.
+	bool				bParallelJpeg;
+
+	// deflate level of the pages saved as png, 0 stored .. 9 smallest.
+	// bPngOptimize compresses each page with every filter strategy on the
+	// thread pool and keeps the smallest, several times slower.
+	uint32_t			PngLevel;
+	bool				bPngOptimize;
+};
 
 // Image packer
 class FImagePacker
@@ -35,4 +168,14 @@ public:
 	//		InVMargin			vertical margin for image
 	// return how many images are packed.
 	static uint32_t PackImages(const char *InImageFilenames[], uint32_t InCount, uint32_t InWidth, uint32_t InHeight, uint32_t InHMargin, uint32_t InVMargin, char *InBigImageFilename);
+
+	// \brief
+	//		pack a group images with the specified engine.
+	// \params
+	//		InImageFilenames    a array of images's file name
+	//		InCount				count of array
+	//		InSettings			size, margins and packing engine
+	//		InBigImageFilename	file of the first page
+	// return how many images are packed, over all pages.
+	static uint32_t PackImages(const char *InImageFilenames[], uint32_t InCount, const FPackSettings &InSettings, const char *InBigImageFilename);
 };
@@ -0,0 +1,161 @@
+// \brief
+//		Alpha trim
+//
+//
+
+#include <cassert>
+
+#if defined(_M_X64) || defined(__SSE2__) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define TRIM_SSE2 1
+#include <emmintrin.h>
+#else
+#define TRIM_SSE2 0
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+#include "ImageTrim.h"
+
+
+#if TRIM_SSE2
+// bit 4 * k + 3 is set when the alpha of pixel k is larger than the threshold
+static inline uint32_t OpaqueMask4(const uint8_t *InPixels, __m128i InThreshold)
+{
+	const __m128i kPixels = _mm_loadu_si128((const __m128i*)InPixels);
+	// saturated alpha - threshold is 0 for the transparent pixels, only the
+	// alpha bytes are kept from the mask.
+	const __m128i kOver = _mm_subs_epu8(kPixels, InThreshold);
+	const __m128i kTransparent = _mm_cmpeq_epi8(kOver, _mm_setzero_si128());
+	return ~(uint32_t)_mm_movemask_epi8(kTransparent) & 0x8888;
+}
+
+static inline uint32_t LowestBit(uint32_t InMask)
+{
+#ifdef _MSC_VER
+	unsigned long Index;
+	_BitScanForward(&Index, InMask);
+	return Index;
+#else
+	return __builtin_ctz(InMask);
+#endif
+}
+
+static inline uint32_t HighestBit(uint32_t InMask)
+{
+#ifdef _MSC_VER
+	unsigned long Index;
+	_BitScanReverse(&Index, InMask);
+	return Index;
+#else
+	return 31 - __builtin_clz(InMask);
+#endif
+}
+#endif
+
+// first pixel in [InBegin, InEnd) of the row that is opaque, InEnd if none
+static uint32_t FindFirstOpaque(const uint8_t *InRow, uint32_t InBegin, uint32_t InEnd, uint8_t InAlphaThreshold)
+{
+	uint32_t x = InBegin;
+#if TRIM_SSE2
+	const __m128i kThreshold = _mm_set1_epi32((int32_t)((uint32_t)InAlphaThreshold << 24));
+	for (; x + 4 <= InEnd; x += 4)
+	{
+		const uint32_t kMask = OpaqueMask4(&InRow[x * 4], kThreshold);
+		if (kMask)
+		{
+			return x + LowestBit(kMask) / 4;
+		}
+	} // end for x
+#endif
+	for (; x < InEnd; x++)
+	{
+		if (InRow[x * 4 + 3] > InAlphaThreshold)
+		{
+			return x;
+		}
+	} // end for x
+	return InEnd;
+}
+
+// last pixel in [InBegin, InEnd) of the row that is opaque, InBegin - 1 if none
+static int64_t FindLastOpaque(const uint8_t *InRow, uint32_t InBegin, uint32_t InEnd, uint8_t InAlphaThreshold)
+{
+	uint32_t x = InEnd;
+#if TRIM_SSE2
+	const __m128i kThreshold = _mm_set1_epi32((int32_t)((uint32_t)InAlphaThreshold << 24));
+	for (; x >= InBegin + 4; x -= 4)
+	{
+		const uint32_t kMask = OpaqueMask4(&InRow[(x - 4) * 4], kThreshold);
+		if (kMask)
+		{
+			return x - 4 + HighestBit(kMask) / 4;
+		}
+	} // end for x
+#endif
+	for (; x > InBegin; x--)
+	{
+		if (InRow[(x - 1) * 4 + 3] > InAlphaThreshold)
+		{
+			return x - 1;
+		}
+	} // end for x
+	return (int64_t)InBegin - 1;
+}
+
+bool FImageTrim::FindOpaqueBounds(const uint8_t *InRGBA, uint32_t InWidth, uint32_t InHeight, uint8_t InAlphaThreshold, FPackRect &OutBounds)
+{
+	if (!InRGBA || InWidth == 0 || InHeight == 0)
+	{
+		return false;
+	}
+
+	const size_t kLineBytes = (size_t)InWidth * 4;
+
+	// the top row with an opaque pixel, its first & last opaque pixels start the box
+	uint32_t Top = 0;
+	uint32_t Left = InWidth;
+	for (; Top < InHeight; Top++)
+	{
+		Left = FindFirstOpaque(&InRGBA[Top * kLineBytes], 0, InWidth, InAlphaThreshold);
+		if (Left < InWidth)
+		{
+			break;
+		}
+	} // end for Top
+
+	if (Top == InHeight)
+	{
+		OutBounds = FPackRect(0, 0, 1, 1);
+		return true;
+	}
+
+	uint32_t Right = (uint32_t)FindLastOpaque(&InRGBA[Top * kLineBytes], Left, InWidth, InAlphaThreshold) + 1;
+
+	uint32_t Bottom = InHeight;
+	while (Bottom > Top + 1 && FindFirstOpaque(&InRGBA[(Bottom - 1) * kLineBytes], 0, InWidth, InAlphaThreshold) == InWidth)
+	{
+		Bottom--;
+	}
+
+	// the other rows only need to look outside of the box found so far
+	for (uint32_t y = Top + 1; y < Bottom; y++)
+	{
+		const uint8_t *pRow = &InRGBA[y * kLineBytes];
+		if (Left > 0)
+		{
+			const uint32_t kFirst = FindFirstOpaque(pRow, 0, Left, InAlphaThreshold);
+			Left = kFirst < Left ? kFirst : Left;
+		}
+		if (Right < InWidth)
+		{
+			const int64_t kLast = FindLastOpaque(pRow, Right, InWidth, InAlphaThreshold);
+			Right = kLast >= Right ? (uint32_t)kLast + 1 : Right;
+		}
+	} // end for y
+
+	assert(Left < Right && Top < Bottom);
+	OutBounds = FPackRect(Left, Top, Right - Left, Bottom - Top);
+	return true;
+}
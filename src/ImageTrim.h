@@ -0,0 +1,25 @@
+// \brief
+//		Alpha trim
+//		Finds the part of a RGBA image that is not transparent, so only that
+//		part needs to be packed. The rows are scanned 4 pixels at a time with
+//		SSE2 when it is available.
+//
+
+#pragma once
+
+#include <cstdint>
+
+#include "RectPacker.h"
+
+
+class FImageTrim
+{
+public:
+	// \brief
+	//		bounding box of the pixels whose alpha is larger than InAlphaThreshold.
+	//		a fully transparent image gives the 1 x 1 box at the origin.
+	// \params
+	//		InRGBA				InWidth x InHeight RGBA pixels, rows are packed
+	// return false if the image is empty.
+	static bool FindOpaqueBounds(const uint8_t *InRGBA, uint32_t InWidth, uint32_t InHeight, uint8_t InAlphaThreshold, FPackRect &OutBounds);
+};
@@ -0,0 +1,334 @@
+// \brief
+//		MaxRects packer
+//
+//
+
+#include <cstddef>
+#include <cassert>
+#include <climits>
+
+#include "MaxRectsPacker.h"
+
+
+static inline uint32_t AbsDiff(uint32_t InA, uint32_t InB)
+{
+	return InA > InB ? InA - InB : InB - InA;
+}
+
+// length of the common part of the segments [InStart1, InEnd1) and [InStart2, InEnd2)
+static inline uint32_t CommonIntervalLength(uint32_t InStart1, uint32_t InEnd1, uint32_t InStart2, uint32_t InEnd2)
+{
+	if (InEnd1 < InStart2 || InEnd2 < InStart1)
+	{
+		return 0;
+	}
+
+	const uint32_t kStart = InStart1 > InStart2 ? InStart1 : InStart2;
+	const uint32_t kEnd = InEnd1 < InEnd2 ? InEnd1 : InEnd2;
+	return kEnd - kStart;
+}
+
+FMaxRectsPacker::FMaxRectsPacker(EMaxRectsHeuristic InHeuristic)
+	: Heuristic(InHeuristic)
+	, BinWidth(0)
+	, BinHeight(0)
+	, UsedArea(0)
+{
+}
+
+void FMaxRectsPacker::Init(uint32_t InWidth, uint32_t InHeight)
+{
+	BinWidth = InWidth;
+	BinHeight = InHeight;
+	UsedArea = 0;
+
+	FreeRects.clear();
+	NewFreeRects.clear();
+	UsedRects.clear();
+	FreeRects.push_back(FPackRect(0, 0, InWidth, InHeight));
+}
+
+bool FMaxRectsPacker::Insert(uint32_t InW, uint32_t InH, FPackRect &OutRect)
+{
+	if (InW == 0 || InH == 0)
+	{
+		return false;
+	}
+
+	if (!FindPosition(InW, InH, false, OutRect))
+	{
+		return false;
+	}
+
+	PlaceRect(OutRect);
+	return true;
+}
+
+bool FMaxRectsPacker::InsertRotatable(uint32_t InW, uint32_t InH, FPackRect &OutRect)
+{
+	if (InW == 0 || InH == 0)
+	{
+		return false;
+	}
+
+	// both orientations are scored in the same pass
+	if (!FindPosition(InW, InH, InW != InH, OutRect))
+	{
+		return false;
+	}
+
+	PlaceRect(OutRect);
+	return true;
+}
+
+float FMaxRectsPacker::Occupancy() const
+{
+	const uint64_t kBinArea = (uint64_t)BinWidth * BinHeight;
+	return kBinArea > 0 ? (float)((double)UsedArea / kBinArea) : 0.f;
+}
+
+bool FMaxRectsPacker::FindPosition(uint32_t InW, uint32_t InH, bool InAllowRotation, FPackRect &OutRect) const
+{
+	int64_t BestScore1 = LLONG_MAX;
+	int64_t BestScore2 = LLONG_MAX;
+	bool bFound = false;
+
+	for (size_t k = 0; k < FreeRects.size(); k++)
+	{
+		const FPackRect &Free = FreeRects[k];
+		int64_t Score1, Score2;
+		if (InW <= Free.W && InH <= Free.H)
+		{
+			ScorePosition(Free, InW, InH, Score1, Score2);
+			if (Score1 < BestScore1 || (Score1 == BestScore1 && Score2 < BestScore2))
+			{
+				BestScore1 = Score1;
+				BestScore2 = Score2;
+				OutRect = FPackRect(Free.X, Free.Y, InW, InH);
+				bFound = true;
+			}
+		}
+
+		// the rotated one only wins with a strictly better score
+		if (InAllowRotation && InH <= Free.W && InW <= Free.H)
+		{
+			ScorePosition(Free, InH, InW, Score1, Score2);
+			if (Score1 < BestScore1 || (Score1 == BestScore1 && Score2 < BestScore2))
+			{
+				BestScore1 = Score1;
+				BestScore2 = Score2;
+				OutRect = FPackRect(Free.X, Free.Y, InH, InW);
+				bFound = true;
+			}
+		}
+	} // end for k
+
+	return bFound;
+}
+
+void FMaxRectsPacker::ScorePosition(const FPackRect &InFree, uint32_t InW, uint32_t InH, int64_t &OutScore1, int64_t &OutScore2) const
+{
+	const uint32_t kLeftoverHoriz = AbsDiff(InFree.W, InW);
+	const uint32_t kLeftoverVert = AbsDiff(InFree.H, InH);
+	const uint32_t kShortSide = kLeftoverHoriz < kLeftoverVert ? kLeftoverHoriz : kLeftoverVert;
+	const uint32_t kLongSide = kLeftoverHoriz > kLeftoverVert ? kLeftoverHoriz : kLeftoverVert;
+
+	switch (Heuristic)
+	{
+	case MAXRECTS_BestLongSideFit:
+		OutScore1 = kLongSide;
+		OutScore2 = kShortSide;
+		break;
+	case MAXRECTS_BestAreaFit:
+		OutScore1 = (int64_t)InFree.W * InFree.H - (int64_t)InW * InH;
+		OutScore2 = kShortSide;
+		break;
+	case MAXRECTS_BottomLeft:
+		OutScore1 = (int64_t)InFree.Y + InH;
+		OutScore2 = InFree.X;
+		break;
+	case MAXRECTS_ContactPoint:
+		// more contact is better, the scores are minimized.
+		OutScore1 = -ContactPointScore(InFree.X, InFree.Y, InW, InH);
+		OutScore2 = 0;
+		break;
+	case MAXRECTS_BestShortSideFit:
+	default:
+		OutScore1 = kShortSide;
+		OutScore2 = kLongSide;
+		break;
+	}
+}
+
+int64_t FMaxRectsPacker::ContactPointScore(uint32_t InX, uint32_t InY, uint32_t InW, uint32_t InH) const
+{
+	int64_t Score = 0;
+
+	// the bin borders count as contact
+	if (InX == 0 || InX + InW == BinWidth)
+	{
+		Score += InH;
+	}
+	if (InY == 0 || InY + InH == BinHeight)
+	{
+		Score += InW;
+	}
+
+	for (size_t k = 0; k < UsedRects.size(); k++)
+	{
+		const FPackRect &Used = UsedRects[k];
+		if (Used.X == InX + InW || Used.X + Used.W == InX)
+		{
+			Score += CommonIntervalLength(Used.Y, Used.Y + Used.H, InY, InY + InH);
+		}
+		if (Used.Y == InY + InH || Used.Y + Used.H == InY)
+		{
+			Score += CommonIntervalLength(Used.X, Used.X + Used.W, InX, InX + InW);
+		}
+	} // end for k
+
+	return Score;
+}
+
+void FMaxRectsPacker::PlaceRect(const FPackRect &InRect)
+{
+	// split every free rectangle the new one overlaps.
+	NewFreeRects.clear();
+	for (size_t k = 0; k < FreeRects.size();)
+	{
+		if (SplitFreeRect(FreeRects[k], InRect))
+		{
+			// the order of free rectangles is irrelevant, swap with the last one.
+			FreeRects[k] = FreeRects.back();
+			FreeRects.pop_back();
+		}
+		else
+		{
+			k++;
+		}
+	} // end for k
+
+	PruneFreeList();
+
+	UsedArea += (uint64_t)InRect.W * InRect.H;
+	if (Heuristic == MAXRECTS_ContactPoint)
+	{
+		UsedRects.push_back(InRect);
+	}
+}
+
+bool FMaxRectsPacker::SplitFreeRect(const FPackRect &InFree, const FPackRect &InUsed)
+{
+	if (!InUsed.Intersects(InFree))
+	{
+		return false;
+	}
+
+	const uint32_t kFreeRight = InFree.X + InFree.W;
+	const uint32_t kFreeBottom = InFree.Y + InFree.H;
+	const uint32_t kUsedRight = InUsed.X + InUsed.W;
+	const uint32_t kUsedBottom = InUsed.Y + InUsed.H;
+
+	// the pieces above & below the used rectangle
+	if (InUsed.Y > InFree.Y)
+	{
+		InsertNewFreeRect(FPackRect(InFree.X, InFree.Y, InFree.W, InUsed.Y - InFree.Y));
+	}
+	if (kUsedBottom < kFreeBottom)
+	{
+		InsertNewFreeRect(FPackRect(InFree.X, kUsedBottom, InFree.W, kFreeBottom - kUsedBottom));
+	}
+
+	// the pieces at the left & right side of the used rectangle
+	if (InUsed.X > InFree.X)
+	{
+		InsertNewFreeRect(FPackRect(InFree.X, InFree.Y, InUsed.X - InFree.X, InFree.H));
+	}
+	if (kUsedRight < kFreeRight)
+	{
+		InsertNewFreeRect(FPackRect(kUsedRight, InFree.Y, kFreeRight - kUsedRight, InFree.H));
+	}
+
+	return true;
+}
+
+void FMaxRectsPacker::InsertNewFreeRect(const FPackRect &InRect)
+{
+	assert(InRect.W > 0 && InRect.H > 0);
+
+	for (size_t k = 0; k < NewFreeRects.size();)
+	{
+		if (InRect.IsContainedIn(NewFreeRects[k]))
+		{
+			return;
+		}
+
+		if (NewFreeRects[k].IsContainedIn(InRect))
+		{
+			NewFreeRects[k] = NewFreeRects.back();
+			NewFreeRects.pop_back();
+		}
+		else
+		{
+			k++;
+		}
+	} // end for k
+
+	NewFreeRects.push_back(InRect);
+}
+
+void FMaxRectsPacker::PruneFreeList()
+{
+	// the old free rectangles were already pruned against each other, and none
+	// of them can lie inside a new piece (a piece is part of an old rectangle),
+	// so only the new pieces are tested against the old ones.
+	// this keeps the cost at O(pieces * free) instead of O(free * free).
+	if (NewFreeRects.empty())
+	{
+		return;
+	}
+
+	// an old rectangle that holds a piece must overlap the bounds of all pieces,
+	// most old rectangles are rejected by this single test.
+	uint32_t MinX = NewFreeRects[0].X, MinY = NewFreeRects[0].Y;
+	uint32_t MaxX = MinX + NewFreeRects[0].W, MaxY = MinY + NewFreeRects[0].H;
+	for (size_t j = 1; j < NewFreeRects.size(); j++)
+	{
+		const FPackRect &Piece = NewFreeRects[j];
+		MinX = Piece.X < MinX ? Piece.X : MinX;
+		MinY = Piece.Y < MinY ? Piece.Y : MinY;
+		MaxX = Piece.X + Piece.W > MaxX ? Piece.X + Piece.W : MaxX;
+		MaxY = Piece.Y + Piece.H > MaxY ? Piece.Y + Piece.H : MaxY;
+	} // end for j
+	const FPackRect kPieceBounds(MinX, MinY, MaxX - MinX, MaxY - MinY);
+
+	for (size_t i = 0; i < FreeRects.size(); i++)
+	{
+		const FPackRect &Old = FreeRects[i];
+		if (!Old.Intersects(kPieceBounds))
+		{
+			continue;
+		}
+
+		for (size_t j = 0; j < NewFreeRects.size();)
+		{
+			if (NewFreeRects[j].IsContainedIn(Old))
+			{
+				NewFreeRects[j] = NewFreeRects.back();
+				NewFreeRects.pop_back();
+			}
+			else
+			{
+				j++;
+			}
+		} // end for j
+
+		if (NewFreeRects.empty())
+		{
+			break;
+		}
+	} // end for i
+
+	FreeRects.insert(FreeRects.end(), NewFreeRects.begin(), NewFreeRects.end());
+	NewFreeRects.clear();
+}
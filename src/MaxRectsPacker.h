@@ -0,0 +1,65 @@
+// \brief
+//		MaxRects packer
+// Algorithm:
+//		ref: Jukka Jylanki, "A Thousand Ways to Pack the Bin"
+//		Keep a list of maximal free rectangles, they may overlap each other.
+//      When a rectangle is placed, every free rectangle it intersects is
+//      split into up to 4 maximal pieces, then the pieces that are contained
+//      in another free rectangle are pruned.
+//       *------------------*----------------------*
+//       |   placed         |   right free         |
+//       |                  |                      |
+//       *------------------*                      |
+//       |   bottom free    .                      |
+//       |  (overlaps the right free rectangle)    |
+//       *-----------------------------------------*
+//
+
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "RectPacker.h"
+
+
+// how to choose the free rectangle for a new image
+enum EMaxRectsHeuristic
+{
+	MAXRECTS_BestShortSideFit = 0,	// minimize the shorter leftover side
+	MAXRECTS_BestLongSideFit,		// minimize the longer leftover side
+	MAXRECTS_BestAreaFit,			// minimize the leftover area
+	MAXRECTS_BottomLeft,			// tetris style, lowest then leftmost
+	MAXRECTS_ContactPoint,			// maximize the edges touching others
+	MAXRECTS_MAX
+};
+
+class FMaxRectsPacker : public FRectPacker
+{
+public:
+	FMaxRectsPacker(EMaxRectsHeuristic InHeuristic = MAXRECTS_BestShortSideFit);
+
+	virtual void Init(uint32_t InWidth, uint32_t InHeight);
+	virtual bool Insert(uint32_t InW, uint32_t InH, FPackRect &OutRect);
+	virtual bool InsertRotatable(uint32_t InW, uint32_t InH, FPackRect &OutRect);
+	virtual float Occupancy() const;
+
+protected:
+	bool FindPosition(uint32_t InW, uint32_t InH, bool InAllowRotation, FPackRect &OutRect) const;
+	void ScorePosition(const FPackRect &InFree, uint32_t InW, uint32_t InH, int64_t &OutScore1, int64_t &OutScore2) const;
+	int64_t ContactPointScore(uint32_t InX, uint32_t InY, uint32_t InW, uint32_t InH) const;
+
+	void PlaceRect(const FPackRect &InRect);
+	bool SplitFreeRect(const FPackRect &InFree, const FPackRect &InUsed);
+	void InsertNewFreeRect(const FPackRect &InRect);
+	void PruneFreeList();
+
+private:
+	EMaxRectsHeuristic		Heuristic;
+	uint32_t				BinWidth;
+	uint32_t				BinHeight;
+	uint64_t				UsedArea;
+	std::vector<FPackRect>	FreeRects;
+	std::vector<FPackRect>	NewFreeRects;	// pieces produced by the last split
+	std::vector<FPackRect>	UsedRects;		// only needed by contact point
+};
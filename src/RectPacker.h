@@ -0,0 +1,69 @@
+// \brief
+//		Rectangle packer interface.
+//		Every packing engine places W x H rectangles into a fixed bin and
+//		reports the position, so the merge context does not care which
+//		algorithm produced the layout.
+//
+
+#pragma once
+
+#include <cstdint>
+
+
+// a placed rectangle in the bin
+struct FPackRect
+{
+	FPackRect()
+		: X(0), Y(0), W(0), H(0)
+	{}
+
+	FPackRect(uint32_t InX, uint32_t InY, uint32_t InW, uint32_t InH)
+		: X(InX), Y(InY), W(InW), H(InH)
+	{}
+
+	bool Intersects(const FPackRect &InOther) const
+	{
+		return X < InOther.X + InOther.W && X + W > InOther.X
+			&& Y < InOther.Y + InOther.H && Y + H > InOther.Y;
+	}
+
+	bool IsContainedIn(const FPackRect &InOther) const
+	{
+		return X >= InOther.X && Y >= InOther.Y
+			&& X + W <= InOther.X + InOther.W
+			&& Y + H <= InOther.Y + InOther.H;
+	}
+
+	uint32_t X;
+	uint32_t Y;
+	uint32_t W;
+	uint32_t H;
+};
+
+// packer interface
+class FRectPacker
+{
+public:
+	virtual ~FRectPacker() {}
+
+	// \brief
+	//		reset the packer to an empty bin of InWidth x InHeight.
+	virtual void Init(uint32_t InWidth, uint32_t InHeight) = 0;
+
+	// \brief
+	//		place a InW x InH rectangle. return false if it does not fit.
+	virtual bool Insert(uint32_t InW, uint32_t InH, FPackRect &OutRect) = 0;
+
+	// \brief
+	//		place a InW x InH or a InH x InW rectangle, whichever the packer
+	//		prefers. OutRect.W != InW tells it is rotated.
+	//		by default the rotated one is only tried when the other does not fit.
+	virtual bool InsertRotatable(uint32_t InW, uint32_t InH, FPackRect &OutRect)
+	{
+		return Insert(InW, InH, OutRect) || (InW != InH && Insert(InH, InW, OutRect));
+	}
+
+	// \brief
+	//		ratio of used area to bin area, in [0, 1].
+	virtual float Occupancy() const = 0;
+};
@@ -39,12 +39,19 @@
 #include "stb_image_aug.h"
 #include "image_helper.h"
 #include "image_DXT.h"
+#include "image_png.h"
+#include "image_mmap.h"
 
 #include <stdlib.h>
 #include <string.h>
 
-/*	error reporting	*/
-char *result_string_pointer = "SOIL initialized";
+/*	error reporting, per thread so images can be loaded on several threads	*/
+#ifdef _MSC_VER
+	#define SOIL_THREAD_LOCAL	__declspec(thread)
+#else
+	#define SOIL_THREAD_LOCAL	__thread
+#endif
+static SOIL_THREAD_LOCAL char *result_string_pointer = "SOIL initialized";
 
 #if SOIL_INCLUDE_OGL_APIS
 
@@ -1438,8 +1445,19 @@ unsigned char*
 		int force_channels
 	)
 {
-	unsigned char *result = stbi_load( filename,
-			width, height, channels, force_channels );
+	mapped_image_file file;
+	unsigned char *result;
+	/*	decode from the mapped pages, else through stdio	*/
+	if( map_image_file( filename, &file ) )
+	{
+		result = stbi_load_from_memory( file.data, file.size,
+				width, height, channels, force_channels );
+		unmap_image_file( &file );
+	} else
+	{
+		result = stbi_load( filename,
+				width, height, channels, force_channels );
+	}
 	if( result == NULL )
 	{
 		result_string_pointer = stbi_failure_reason();
@@ -1450,6 +1468,64 @@ unsigned char*
 	return result;
 }
 
+int
+	SOIL_load_image_info
+	(
+		const char *filename,
+		int *width, int *height, int *channels
+	)
+{
+	mapped_image_file file;
+	int result;
+	if( map_image_file( filename, &file ) )
+	{
+		result = stbi_info_from_memory( file.data, file.size,
+				width, height, channels );
+		unmap_image_file( &file );
+	} else
+	{
+		result = stbi_info( filename, width, height, channels );
+	}
+	if( result == 0 )
+	{
+		result_string_pointer = stbi_failure_reason();
+	} else
+	{
+		result_string_pointer = "Image info loaded";
+	}
+	return result;
+}
+
+int
+	SOIL_load_image_into
+	(
+		const char *filename,
+		unsigned char *dest, int dest_stride,
+		int width, int height, int channels
+	)
+{
+	mapped_image_file file;
+	int result;
+	if( map_image_file( filename, &file ) )
+	{
+		result = stbi_load_into_from_memory( file.data, file.size,
+				dest, dest_stride, width, height, channels );
+		unmap_image_file( &file );
+	} else
+	{
+		result = stbi_load_into( filename, dest, dest_stride,
+				width, height, channels );
+	}
+	if( result == 0 )
+	{
+		result_string_pointer = stbi_failure_reason();
+	} else
+	{
+		result_string_pointer = "Image loaded";
+	}
+	return result;
+}
+
 unsigned char*
 	SOIL_load_image_from_memory
 	(
@@ -1473,7 +1549,46 @@ unsigned char*
 	return result;
 }
 
-extern int save_image_as_PNG(const char *filename, int width, int height, int channels, const unsigned char *const data);
+int
+	SOIL_load_image_info_from_memory
+	(
+		const unsigned char *const buffer,
+		int buffer_length,
+		int *width, int *height, int *channels
+	)
+{
+	int result = stbi_info_from_memory( buffer, buffer_length,
+			width, height, channels );
+	if( result == 0 )
+	{
+		result_string_pointer = stbi_failure_reason();
+	} else
+	{
+		result_string_pointer = "Image info loaded from memory";
+	}
+	return result;
+}
+
+int
+	SOIL_load_image_into_from_memory
+	(
+		const unsigned char *const buffer,
+		int buffer_length,
+		unsigned char *dest, int dest_stride,
+		int width, int height, int channels
+	)
+{
+	int result = stbi_load_into_from_memory( buffer, buffer_length,
+			dest, dest_stride, width, height, channels );
+	if( result == 0 )
+	{
+		result_string_pointer = stbi_failure_reason();
+	} else
+	{
+		result_string_pointer = "Image loaded from memory";
+	}
+	return result;
+}
 
 int
 	SOIL_save_image
@@ -1504,6 +1619,11 @@ int
 		save_result = stbi_write_tga( filename,
 				width, height, channels, (void*)data );
 	} else
+	if( image_type == SOIL_SAVE_TYPE_TGA_RLE )
+	{
+		save_result = stbi_write_tga_rle( filename,
+				width, height, channels, (void*)data );
+	} else
 	if( image_type == SOIL_SAVE_TYPE_DDS )
 	{
 		save_result = save_image_as_DDS( filename,
@@ -1536,6 +1656,34 @@ void
 	free( (void*)img_data );
 }
 
+void
+	SOIL_trim_scratch
+	(
+		size_t max_keep
+	)
+{
+	stbi_scratch_trim( max_keep );
+}
+
+size_t
+	SOIL_scratch_size
+	(
+		void
+	)
+{
+	return stbi_scratch_size();
+}
+
+void
+	SOIL_set_jpeg_parallel_for
+	(
+		void (*parallel_for)( void *context, int count, void (*job)( void *arg, int index ), void *arg ),
+		void *context
+	)
+{
+	stbi_jpeg_parallel_for( parallel_for, context );
+}
+
 const char*
 	SOIL_last_result
 	(
@@ -40,6 +40,8 @@
 #ifndef HEADER_SIMPLE_OPENGL_IMAGE_LIBRARY
 #define HEADER_SIMPLE_OPENGL_IMAGE_LIBRARY
 
+#include <stddef.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -111,7 +113,8 @@ enum
 /**
 	The types of images that may be saved.
 	(TGA supports uncompressed RGB / RGBA)
-	(BMP supports uncompressed RGB)
+	(TGA_RLE supports run-length encoded RGB / RGBA)
+	(BMP supports uncompressed RGB / RGBA, saved as 32 bit)
 	(DDS supports DXT1 and DXT5)
 **/
 enum
@@ -119,7 +122,8 @@ enum
 	SOIL_SAVE_TYPE_TGA = 0,
 	SOIL_SAVE_TYPE_BMP = 1,
 	SOIL_SAVE_TYPE_DDS = 2,
-	SOIL_SAVE_TYPE_PNG = 3
+	SOIL_SAVE_TYPE_PNG = 3,
+	SOIL_SAVE_TYPE_TGA_RLE = 4
 };
 
 /**
@@ -369,6 +373,8 @@ int
 	the resulting image has force_channels, but *channels may be
 	different (if the original image had a different channel
 	count).
+	The file is memory mapped for the decode where the platform
+	allows it, else read through stdio.
 	\return 0 if failed, otherwise returns 1
 **/
 unsigned char*
@@ -397,6 +403,61 @@ unsigned char*
 		int force_channels
 	);
 
+/**
+	Reads the size & channel count of an image from disk without
+	decoding the pixels. *channels is the same as SOIL_load_image
+	would return with SOIL_LOAD_AUTO.
+	Only JPEG & PNG headers are parsed.
+	\return 0 if failed, otherwise returns 1
+**/
+int
+	SOIL_load_image_info
+	(
+		const char *filename,
+		int *width, int *height, int *channels
+	);
+
+/**
+	Loads an image from disk into existing memory, e.g. a part of a
+	larger image. The image must be width x height, its rows are
+	written dest_stride bytes apart with channels (1..4) each pixel.
+	JPEG & PNG are decoded straight into dest, other types through a
+	temporary buffer.
+	\return 0 if failed, otherwise returns 1
+**/
+int
+	SOIL_load_image_into
+	(
+		const char *filename,
+		unsigned char *dest, int dest_stride,
+		int width, int height, int channels
+	);
+
+/**
+	SOIL_load_image_info on a file already read into memory.
+	\return 0 if failed, otherwise returns 1
+**/
+int
+	SOIL_load_image_info_from_memory
+	(
+		const unsigned char *const buffer,
+		int buffer_length,
+		int *width, int *height, int *channels
+	);
+
+/**
+	SOIL_load_image_into on a file already read into memory.
+	\return 0 if failed, otherwise returns 1
+**/
+int
+	SOIL_load_image_into_from_memory
+	(
+		const unsigned char *const buffer,
+		int buffer_length,
+		unsigned char *dest, int dest_stride,
+		int width, int height, int channels
+	);
+
 /**
 	Saves an image from an array of unsigned chars (RGBA) to disk
 	\return 0 if failed, otherwise returns 1
@@ -421,10 +482,49 @@ void
 		unsigned char *img_data
 	);
 
+/**
+	The loaders keep their temporary buffers (the compressed & inflated
+	PNG data, the JPEG planes, the image SOIL_load_image_into copies from)
+	per thread from one image to the next, at the size of the largest
+	image so far. Frees those of the calling thread that are larger than
+	max_keep bytes, 0 frees all of them. A thread that loaded images
+	should call this with 0 before it exits.
+**/
+void
+	SOIL_trim_scratch
+	(
+		size_t max_keep
+	);
+
+/**
+	The bytes the temporary buffers of the calling thread hold.
+**/
+size_t
+	SOIL_scratch_size
+	(
+		void
+	);
+
+/**
+	Decodes big JPEGs with restart markers on several threads, a run of
+	restart intervals per job. parallel_for runs job( arg, 0 ) ..
+	job( arg, count - 1 ), possibly at the same time, and returns when all
+	of them are done, like png_save_settings::parallel_for. NULL, the
+	default, decodes on the calling thread; so are JPEGs without restart
+	markers and those read through a FILE. Per thread, it applies to the
+	images the calling thread loads.
+**/
+void
+	SOIL_set_jpeg_parallel_for
+	(
+		void (*parallel_for)( void *context, int count, void (*job)( void *arg, int index ), void *arg ),
+		void *context
+	);
+
 /**
 	This function resturn a pointer to a string describing the last thing
 	that happened inside SOIL.  It can be used to determine why an image
-	failed to load.
+	failed to load.  Each thread has its own last result.
 **/
 const char*
 	SOIL_last_result
@@ -0,0 +1,66 @@
+// \brief
+//		CRC-32 (PNG chunks) & Adler-32 (zlib streams) for the PNG reader &
+//		writer. The CRC folds 64 bytes per step with carry-less multiplies
+//		when the CPU has PCLMULQDQ, else it is table driven 8 bytes per step.
+//		The Adler-32 sums 16 bytes per step with SSE2 and reduces modulo
+//		65521 once per 5552 bytes.
+//
+
+#ifndef HEADER_IMAGE_CHECKSUM
+#define HEADER_IMAGE_CHECKSUM
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+	CRC-32 of data, continued from crc (start with 0).
+**/
+unsigned int
+	checksum_crc32
+	(
+		unsigned int crc,
+		const unsigned char *data, size_t size
+	);
+
+/**
+	The CRC-32 of 2 joined pieces from the ones of the pieces,
+	size2 is the length of the second piece.
+**/
+unsigned int
+	checksum_crc32_combine
+	(
+		unsigned int crc1,
+		unsigned int crc2,
+		size_t size2
+	);
+
+/**
+	Adler-32 of data, continued from adler (start with 1).
+**/
+unsigned int
+	checksum_adler32
+	(
+		unsigned int adler,
+		const unsigned char *data, size_t size
+	);
+
+/**
+	The Adler-32 of 2 joined pieces from the ones of the pieces,
+	size2 is the length of the second piece.
+**/
+unsigned int
+	checksum_adler32_combine
+	(
+		unsigned int adler1,
+		unsigned int adler2,
+		size_t size2
+	);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* HEADER_IMAGE_CHECKSUM	*/
@@ -0,0 +1,969 @@
+// \brief
+//		deflate compressor.
+//
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "image_checksum.h"
+#include "image_deflate.h"
+
+#define WINDOW_SIZE		32768
+#define WINDOW_MASK		(WINDOW_SIZE - 1)
+#define HASH_BITS		15
+#define HASH_SIZE		(1 << HASH_BITS)
+#define MIN_MATCH		3
+#define MAX_MATCH		258
+#define TOO_FAR			4096	/*	a 3 byte match further away costs more than the literals	*/
+#define NO_POS			0xFFFFFFFFu
+
+#define BLOCK_SYMBOLS	16384	/*	symbols collected before a block is written	*/
+#define STORED_MAX		65535
+
+#define NUM_LITLEN		288		/*	286 are used, 2 complete the fixed code	*/
+#define NUM_DIST		30
+#define NUM_CODELEN		19
+#define MAX_BITS		15
+#define MAX_CODELEN_BITS	7
+
+/*	the search effort per level, like zlib's	*/
+typedef struct
+{
+	int good_length;	/*	search less when the previous match is this long	*/
+	int lazy_length;	/*	look for a better match only below this length, 0 is greedy	*/
+	int nice_length;	/*	stop searching at a match this long	*/
+	int max_chain;		/*	positions tried per search	*/
+} level_config;
+
+static const level_config level_configs[10] =
+{
+	{ 0, 0, 0, 0 },			/*	0 stored	*/
+	{ 4, 0, 8, 4 },
+	{ 4, 0, 16, 8 },
+	{ 4, 0, 32, 32 },
+	{ 4, 4, 16, 16 },
+	{ 8, 16, 32, 32 },
+	{ 8, 16, 128, 128 },
+	{ 8, 32, 128, 256 },
+	{ 32, 128, 258, 1024 },
+	{ 32, 258, 258, 4096 }
+};
+
+static const int length_base[29] =
+{
+	3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+	35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+static const int length_extra[29] =
+{
+	0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+	3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+static const int dist_base[30] =
+{
+	1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+	257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577
+};
+static const int dist_extra[30] =
+{
+	0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+	7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+/*	the order the code length code lengths are stored in	*/
+static const unsigned char codelen_order[NUM_CODELEN] =
+{
+	16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+};
+
+typedef struct
+{
+	deflate_output *out;
+	const unsigned char *data;
+	const level_config *config;
+	size_t base;					/*	positions below are relative to this	*/
+	size_t end;
+
+	unsigned int head[HASH_SIZE];	/*	newest position of each hash	*/
+	unsigned int prev[WINDOW_SIZE];	/*	the previous position with the same hash	*/
+
+	/*	symbols of the current block	*/
+	unsigned short sym_length[BLOCK_SYMBOLS];	/*	literal byte, or match length	*/
+	unsigned short sym_dist[BLOCK_SYMBOLS];		/*	0 for a literal	*/
+	int sym_count;
+	size_t block_start;				/*	the bytes the block covers	*/
+	size_t block_end;
+
+	int litlen_freq[NUM_LITLEN];
+	int dist_freq[NUM_DIST];
+} deflate_state;
+
+typedef struct
+{
+	int freq;
+	int symbol;
+} symbol_freq;
+
+/*	output	*/
+
+void
+	deflate_output_init
+	(
+		deflate_output *out,
+		size_t reserve
+	)
+{
+	out->size = 0;
+	out->bits = 0;
+	out->bit_count = 0;
+	out->capacity = reserve > 64 ? reserve : 64;
+	out->data = (unsigned char*)malloc( out->capacity );
+	out->failed = (out->data == NULL);
+	if( out->failed )
+	{
+		out->capacity = 0;
+	}
+}
+
+void
+	deflate_output_free
+	(
+		deflate_output *out
+	)
+{
+	free( out->data );
+	out->data = NULL;
+	out->size = out->capacity = 0;
+}
+
+static int reserve_output( deflate_output *out, size_t count )
+{
+	size_t capacity;
+	unsigned char *data;
+	if( out->failed )
+	{
+		return 0;
+	}
+	if( out->size + count <= out->capacity )
+	{
+		return 1;
+	}
+
+	capacity = out->capacity * 2;
+	if( capacity < out->size + count )
+	{
+		capacity = out->size + count;
+	}
+	data = (unsigned char*)realloc( out->data, capacity );
+	if( data == NULL )
+	{
+		out->failed = 1;
+		return 0;
+	}
+	out->data = data;
+	out->capacity = capacity;
+	return 1;
+}
+
+void
+	deflate_output_write
+	(
+		deflate_output *out,
+		const unsigned char *data, size_t size
+	)
+{
+	if( size > 0 && reserve_output( out, size ) )
+	{
+		memcpy( out->data + out->size, data, size );
+		out->size += size;
+	}
+}
+
+static void put_byte( deflate_output *out, unsigned int value )
+{
+	if( reserve_output( out, 1 ) )
+	{
+		out->data[out->size++] = (unsigned char)value;
+	}
+}
+
+/*	count is at most 16	*/
+static void put_bits( deflate_output *out, unsigned int value, int count )
+{
+	out->bits |= value << out->bit_count;
+	out->bit_count += count;
+	while( out->bit_count >= 8 )
+	{
+		put_byte( out, out->bits & 255 );
+		out->bits >>= 8;
+		out->bit_count -= 8;
+	}
+}
+
+static void align_output( deflate_output *out )
+{
+	if( out->bit_count > 0 )
+	{
+		put_byte( out, out->bits & 255 );
+	}
+	out->bits = 0;
+	out->bit_count = 0;
+}
+
+/*	Huffman codes	*/
+
+static int compare_symbol_freq( const void *a, const void *b )
+{
+	const symbol_freq *x = (const symbol_freq*)a;
+	const symbol_freq *y = (const symbol_freq*)b;
+	if( x->freq != y->freq )
+	{
+		return x->freq < y->freq ? -1 : 1;
+	}
+	return x->symbol - y->symbol;
+}
+
+/*
+	code lengths of the used symbols, none longer than max_bits.
+	A. Moffat & J. Katajainen's in-place algorithm gives the optimal
+	lengths, the ones that are too long are then cut down and the
+	Kraft sum repaired by lengthening shorter codes.
+*/
+static void build_code_lengths( const int *freq, int num_symbols, int max_bits, unsigned char *lengths )
+{
+	symbol_freq sorted[NUM_LITLEN];
+	int depth[NUM_LITLEN];
+	int num_codes[NUM_LITLEN + 1];
+	int n = 0, i, j, root, leaf, next, avbl, used, dpth;
+	unsigned int total;
+
+	memset( lengths, 0, num_symbols );
+	for( i = 0; i < num_symbols; ++i )
+	{
+		if( freq[i] > 0 )
+		{
+			sorted[n].freq = freq[i];
+			sorted[n].symbol = i;
+			++n;
+		}
+	}
+	if( n == 0 )
+	{
+		return;
+	}
+	if( n == 1 )
+	{
+		lengths[sorted[0].symbol] = 1;
+		return;
+	}
+	qsort( sorted, n, sizeof(symbol_freq), compare_symbol_freq );
+
+	for( i = 0; i < n; ++i )
+	{
+		depth[i] = sorted[i].freq;
+	}
+	depth[0] += depth[1];
+	root = 0;
+	leaf = 2;
+	for( next = 1; next < n - 1; ++next )
+	{
+		if( leaf >= n || depth[root] < depth[leaf] )
+		{
+			depth[next] = depth[root];
+			depth[root++] = next;
+		} else
+		{
+			depth[next] = depth[leaf++];
+		}
+		if( leaf >= n || (root < next && depth[root] < depth[leaf]) )
+		{
+			depth[next] += depth[root];
+			depth[root++] = next;
+		} else
+		{
+			depth[next] += depth[leaf++];
+		}
+	}
+	depth[n - 2] = 0;
+	for( next = n - 3; next >= 0; --next )
+	{
+		depth[next] = depth[depth[next]] + 1;
+	}
+	avbl = 1;
+	used = dpth = 0;
+	root = n - 2;
+	next = n - 1;
+	while( avbl > 0 )
+	{
+		while( root >= 0 && depth[root] == dpth )
+		{
+			++used;
+			--root;
+		}
+		while( avbl > used )
+		{
+			depth[next--] = dpth;
+			--avbl;
+		}
+		avbl = 2 * used;
+		++dpth;
+		used = 0;
+	}
+
+	/*	count the lengths, limit them	*/
+	memset( num_codes, 0, sizeof(num_codes) );
+	for( i = 0; i < n; ++i )
+	{
+		num_codes[depth[i] < max_bits ? depth[i] : max_bits]++;
+	}
+	total = 0;
+	for( i = max_bits; i > 0; --i )
+	{
+		total += (unsigned int)num_codes[i] << (max_bits - i);
+	}
+	while( total != (1u << max_bits) )
+	{
+		num_codes[max_bits]--;
+		for( i = max_bits - 1; i > 0; --i )
+		{
+			if( num_codes[i] )
+			{
+				num_codes[i]--;
+				num_codes[i + 1] += 2;
+				break;
+			}
+		}
+		total--;
+	}
+
+	/*	the most frequent symbols get the shortest codes	*/
+	j = n;
+	for( i = 1; i <= max_bits; ++i )
+	{
+		int k;
+		for( k = num_codes[i]; k > 0; --k )
+		{
+			lengths[sorted[--j].symbol] = (unsigned char)i;
+		}
+	}
+}
+
+/*	canonical codes, bit reversed for the LSB first output	*/
+static void build_codes( const unsigned char *lengths, int num_symbols, unsigned short *codes )
+{
+	int bl_count[MAX_BITS + 1];
+	int next_code[MAX_BITS + 1];
+	int i, code = 0;
+
+	memset( bl_count, 0, sizeof(bl_count) );
+	for( i = 0; i < num_symbols; ++i )
+	{
+		bl_count[lengths[i]]++;
+	}
+	bl_count[0] = 0;
+	for( i = 1; i <= MAX_BITS; ++i )
+	{
+		code = (code + bl_count[i - 1]) << 1;
+		next_code[i] = code;
+	}
+	for( i = 0; i < num_symbols; ++i )
+	{
+		int len = lengths[i], value, reversed = 0, k;
+		if( len == 0 )
+		{
+			codes[i] = 0;
+			continue;
+		}
+		value = next_code[len]++;
+		for( k = 0; k < len; ++k )
+		{
+			reversed = (reversed << 1) | ((value >> k) & 1);
+		}
+		codes[i] = (unsigned short)reversed;
+	}
+}
+
+static void fixed_lengths( unsigned char *litlen_lengths, unsigned char *dist_lengths )
+{
+	int i;
+	for( i = 0; i <= 143; ++i )	litlen_lengths[i] = 8;
+	for( ; i <= 255; ++i )		litlen_lengths[i] = 9;
+	for( ; i <= 279; ++i )		litlen_lengths[i] = 7;
+	for( ; i <= 287; ++i )		litlen_lengths[i] = 8;
+	for( i = 0; i < NUM_DIST; ++i )	dist_lengths[i] = 5;
+}
+
+/*	symbols	*/
+
+static int length_code( int length )
+{
+	int x = length - 3, n = 0;
+	if( length == MAX_MATCH )
+	{
+		return 28;
+	}
+	if( x < 8 )
+	{
+		return x;
+	}
+	while( (x >> (n + 1)) != 0 )
+	{
+		++n;
+	}
+	return 4 * (n - 1) + ((x >> (n - 2)) & 3);
+}
+
+static int dist_code( int dist )
+{
+	int x = dist - 1, n = 0;
+	if( x < 4 )
+	{
+		return x;
+	}
+	while( (x >> (n + 1)) != 0 )
+	{
+		++n;
+	}
+	return 2 * n + ((x >> (n - 1)) & 1);
+}
+
+/*	a dynamic block stores its code lengths run length coded	*/
+typedef struct
+{
+	unsigned char symbol[NUM_LITLEN + NUM_DIST];
+	unsigned char extra[NUM_LITLEN + NUM_DIST];
+	int count;
+} codelen_runs;
+
+static void add_run( codelen_runs *runs, int symbol, int extra )
+{
+	runs->symbol[runs->count] = (unsigned char)symbol;
+	runs->extra[runs->count] = (unsigned char)extra;
+	runs->count++;
+}
+
+static void encode_code_lengths( const unsigned char *lengths, int count, codelen_runs *runs )
+{
+	int i = 0;
+	runs->count = 0;
+	while( i < count )
+	{
+		int value = lengths[i], run = 1;
+		while( i + run < count && lengths[i + run] == value )
+		{
+			++run;
+		}
+		i += run;
+
+		if( value == 0 )
+		{
+			while( run >= 11 )
+			{
+				int n = run < 138 ? run : 138;
+				add_run( runs, 18, n - 11 );
+				run -= n;
+			}
+			if( run >= 3 )
+			{
+				add_run( runs, 17, run - 3 );
+				run = 0;
+			}
+		} else
+		{
+			add_run( runs, value, 0 );
+			--run;
+			while( run >= 3 )
+			{
+				int n = run < 6 ? run : 6;
+				add_run( runs, 16, n - 3 );
+				run -= n;
+			}
+		}
+		while( run-- > 0 )
+		{
+			add_run( runs, value, 0 );
+		}
+	}
+}
+
+static size_t symbols_cost( const deflate_state *s, const unsigned char *litlen_lengths, const unsigned char *dist_lengths )
+{
+	size_t bits = 0;
+	int i;
+	for( i = 0; i < 286; ++i )
+	{
+		bits += (size_t)s->litlen_freq[i] * (litlen_lengths[i] + (i > 256 ? length_extra[i - 257] : 0));
+	}
+	for( i = 0; i < NUM_DIST; ++i )
+	{
+		bits += (size_t)s->dist_freq[i] * (dist_lengths[i] + dist_extra[i]);
+	}
+	return bits;
+}
+
+static void write_symbols( deflate_state *s, const unsigned char *litlen_lengths, const unsigned short *litlen_codes,
+							const unsigned char *dist_lengths, const unsigned short *dist_codes )
+{
+	deflate_output *out = s->out;
+	int i;
+	for( i = 0; i < s->sym_count; ++i )
+	{
+		int dist = s->sym_dist[i];
+		if( dist == 0 )
+		{
+			int literal = s->sym_length[i];
+			put_bits( out, litlen_codes[literal], litlen_lengths[literal] );
+		} else
+		{
+			int length = s->sym_length[i];
+			int lc = length_code( length ), dc = dist_code( dist );
+			put_bits( out, litlen_codes[257 + lc], litlen_lengths[257 + lc] );
+			if( length_extra[lc] )
+			{
+				put_bits( out, length - length_base[lc], length_extra[lc] );
+			}
+			put_bits( out, dist_codes[dc], dist_lengths[dc] );
+			if( dist_extra[dc] )
+			{
+				put_bits( out, dist - dist_base[dc], dist_extra[dc] );
+			}
+		}
+	}
+	put_bits( out, litlen_codes[256], litlen_lengths[256] );
+}
+
+static void write_stored( deflate_output *out, const unsigned char *data, size_t size, int is_final )
+{
+	do
+	{
+		size_t n = size < STORED_MAX ? size : STORED_MAX;
+		put_bits( out, (is_final && n == size) ? 1 : 0, 1 );
+		put_bits( out, 0, 2 );
+		align_output( out );
+		put_byte( out, n & 255 );
+		put_byte( out, (n >> 8) & 255 );
+		put_byte( out, ~n & 255 );
+		put_byte( out, (~n >> 8) & 255 );
+		deflate_output_write( out, data, n );
+		data += n;
+		size -= n;
+	} while( size > 0 );
+}
+
+/*	writes the collected symbols as the smallest of the 3 block types	*/
+static void flush_block( deflate_state *s, int is_final )
+{
+	unsigned char litlen_lengths[NUM_LITLEN], dist_lengths[NUM_DIST];
+	unsigned char fixed_litlen[NUM_LITLEN], fixed_dist[NUM_DIST];
+	unsigned char all_lengths[NUM_LITLEN + NUM_DIST];
+	unsigned char codelen_lengths[NUM_CODELEN];
+	unsigned short litlen_codes[NUM_LITLEN], dist_codes[NUM_DIST], codelen_codes[NUM_CODELEN];
+	int codelen_freq[NUM_CODELEN];
+	codelen_runs runs;
+	int num_litlen, num_dist, num_codelen, i, used;
+	size_t dynamic_bits, fixed_bits, stored_bits, stored_size;
+	deflate_output *out = s->out;
+
+	s->litlen_freq[256]++;
+
+	/*	a code of a single symbol is incomplete, give it a partner	*/
+	for( i = 0, used = 0; i < NUM_DIST; ++i )
+	{
+		used += s->dist_freq[i] > 0;
+	}
+	if( used < 2 )
+	{
+		if( s->dist_freq[0] == 0 ) s->dist_freq[0] = 1; else s->dist_freq[1] = 1;
+		if( used == 0 ) s->dist_freq[1] = 1;
+	}
+	for( i = 0, used = 0; i < 286; ++i )
+	{
+		used += s->litlen_freq[i] > 0;
+	}
+	if( used < 2 )
+	{
+		s->litlen_freq[s->litlen_freq[0] ? 1 : 0] = 1;
+	}
+
+	build_code_lengths( s->litlen_freq, 286, MAX_BITS, litlen_lengths );
+	litlen_lengths[286] = litlen_lengths[287] = 0;
+	build_code_lengths( s->dist_freq, NUM_DIST, MAX_BITS, dist_lengths );
+
+	for( num_litlen = 286; num_litlen > 257 && litlen_lengths[num_litlen - 1] == 0; --num_litlen );
+	for( num_dist = NUM_DIST; num_dist > 1 && dist_lengths[num_dist - 1] == 0; --num_dist );
+	memcpy( all_lengths, litlen_lengths, num_litlen );
+	memcpy( all_lengths + num_litlen, dist_lengths, num_dist );
+	encode_code_lengths( all_lengths, num_litlen + num_dist, &runs );
+
+	memset( codelen_freq, 0, sizeof(codelen_freq) );
+	for( i = 0; i < runs.count; ++i )
+	{
+		codelen_freq[runs.symbol[i]]++;
+	}
+	build_code_lengths( codelen_freq, NUM_CODELEN, MAX_CODELEN_BITS, codelen_lengths );
+	for( num_codelen = NUM_CODELEN; num_codelen > 4 && codelen_lengths[codelen_order[num_codelen - 1]] == 0; --num_codelen );
+
+	/*	sizes of the 3 choices	*/
+	dynamic_bits = 3 + 5 + 5 + 4 + 3 * num_codelen + symbols_cost( s, litlen_lengths, dist_lengths );
+	for( i = 0; i < runs.count; ++i )
+	{
+		int symbol = runs.symbol[i];
+		dynamic_bits += codelen_lengths[symbol] + (symbol == 16 ? 2 : symbol == 17 ? 3 : symbol == 18 ? 7 : 0);
+	}
+	fixed_lengths( fixed_litlen, fixed_dist );
+	fixed_bits = 3 + symbols_cost( s, fixed_litlen, fixed_dist );
+	stored_size = s->block_end - s->block_start;
+	stored_bits = (stored_size / STORED_MAX + 1) * (3 + 7 + 32) + stored_size * 8;
+
+	if( stored_bits <= dynamic_bits && stored_bits <= fixed_bits )
+	{
+		write_stored( out, s->data + s->block_start, stored_size, is_final );
+	} else
+	if( fixed_bits <= dynamic_bits )
+	{
+		put_bits( out, is_final, 1 );
+		put_bits( out, 1, 2 );
+		build_codes( fixed_litlen, NUM_LITLEN, litlen_codes );
+		build_codes( fixed_dist, NUM_DIST, dist_codes );
+		write_symbols( s, fixed_litlen, litlen_codes, fixed_dist, dist_codes );
+	} else
+	{
+		put_bits( out, is_final, 1 );
+		put_bits( out, 2, 2 );
+		put_bits( out, num_litlen - 257, 5 );
+		put_bits( out, num_dist - 1, 5 );
+		put_bits( out, num_codelen - 4, 4 );
+		for( i = 0; i < num_codelen; ++i )
+		{
+			put_bits( out, codelen_lengths[codelen_order[i]], 3 );
+		}
+		build_codes( codelen_lengths, NUM_CODELEN, codelen_codes );
+		for( i = 0; i < runs.count; ++i )
+		{
+			int symbol = runs.symbol[i];
+			put_bits( out, codelen_codes[symbol], codelen_lengths[symbol] );
+			if( symbol >= 16 )
+			{
+				put_bits( out, runs.extra[i], symbol == 16 ? 2 : symbol == 17 ? 3 : 7 );
+			}
+		}
+		build_codes( litlen_lengths, NUM_LITLEN, litlen_codes );
+		build_codes( dist_lengths, NUM_DIST, dist_codes );
+		write_symbols( s, litlen_lengths, litlen_codes, dist_lengths, dist_codes );
+	}
+
+	s->sym_count = 0;
+	s->block_start = s->block_end;
+	memset( s->litlen_freq, 0, sizeof(s->litlen_freq) );
+	memset( s->dist_freq, 0, sizeof(s->dist_freq) );
+}
+
+static void emit_literal( deflate_state *s, size_t pos )
+{
+	int literal = s->data[pos];
+	s->sym_length[s->sym_count] = (unsigned short)literal;
+	s->sym_dist[s->sym_count] = 0;
+	s->sym_count++;
+	s->litlen_freq[literal]++;
+	s->block_end = pos + 1;
+	if( s->sym_count == BLOCK_SYMBOLS )
+	{
+		flush_block( s, 0 );
+	}
+}
+
+static void emit_match( deflate_state *s, size_t pos, int length, int dist )
+{
+	s->sym_length[s->sym_count] = (unsigned short)length;
+	s->sym_dist[s->sym_count] = (unsigned short)dist;
+	s->sym_count++;
+	s->litlen_freq[257 + length_code( length )]++;
+	s->dist_freq[dist_code( dist )]++;
+	s->block_end = pos + length;
+	if( s->sym_count == BLOCK_SYMBOLS )
+	{
+		flush_block( s, 0 );
+	}
+}
+
+/*	LZ77	*/
+
+static unsigned int hash3( const unsigned char *p )
+{
+	unsigned int v = p[0] | ((unsigned int)p[1] << 8) | ((unsigned int)p[2] << 16);
+	return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+static void insert_position( deflate_state *s, size_t pos )
+{
+	if( pos + MIN_MATCH <= s->end )
+	{
+		unsigned int h = hash3( s->data + pos );
+		unsigned int rel = (unsigned int)(pos - s->base);
+		s->prev[rel & WINDOW_MASK] = s->head[h];
+		s->head[h] = rel;
+	}
+}
+
+/*	the longest earlier match of the bytes at pos, 0 if none	*/
+static int longest_match( deflate_state *s, size_t pos, int max_chain, int prev_length, int *out_dist )
+{
+	const unsigned char *data = s->data;
+	const unsigned char *scan = data + pos;
+	unsigned int rel = (unsigned int)(pos - s->base);
+	unsigned int candidate;
+	int max_length = (int)(s->end - pos < MAX_MATCH ? s->end - pos : MAX_MATCH);
+	int best_length = prev_length, best_dist = 0;
+
+	if( max_length < MIN_MATCH )
+	{
+		return 0;
+	}
+	if( best_length >= max_length )
+	{
+		return 0;
+	}
+
+	candidate = s->head[hash3( scan )];
+	while( candidate != NO_POS && max_chain-- > 0 )
+	{
+		const unsigned char *match;
+		unsigned int next;
+		int length;
+		if( candidate >= rel || rel - candidate > WINDOW_SIZE )
+		{
+			break;
+		}
+
+		match = data + s->base + candidate;
+		if( match[best_length] == scan[best_length] && match[0] == scan[0] && match[1] == scan[1] )
+		{
+			for( length = 2; length < max_length && match[length] == scan[length]; ++length );
+			if( length > best_length )
+			{
+				best_length = length;
+				best_dist = (int)(rel - candidate);
+				if( length >= s->config->nice_length || length == max_length )
+				{
+					break;
+				}
+			}
+		}
+
+		next = s->prev[candidate & WINDOW_MASK];
+		if( next >= candidate )
+		{
+			break;	/*	the slot was reused by a newer position	*/
+		}
+		candidate = next;
+	}
+
+	if( best_dist == 0 || (best_length == MIN_MATCH && best_dist > TOO_FAR) )
+	{
+		return 0;
+	}
+	*out_dist = best_dist;
+	return best_length;
+}
+
+static void compress_greedy( deflate_state *s, size_t start )
+{
+	size_t pos = start;
+	while( pos < s->end )
+	{
+		int dist = 0;
+		int length = longest_match( s, pos, s->config->max_chain, MIN_MATCH - 1, &dist );
+		insert_position( s, pos );
+		if( length >= MIN_MATCH )
+		{
+			size_t k;
+			emit_match( s, pos, length, dist );
+			for( k = 1; k < (size_t)length; ++k )
+			{
+				insert_position( s, pos + k );
+			}
+			pos += length;
+		} else
+		{
+			emit_literal( s, pos );
+			++pos;
+		}
+	}
+}
+
+/*	a match is taken only when the next position has no longer one	*/
+static void compress_lazy( deflate_state *s, size_t start )
+{
+	size_t pos = start;
+	int prev_length = 0, prev_dist = 0, have_prev = 0;
+	while( pos < s->end )
+	{
+		int dist = 0, length = 0;
+		if( !have_prev || prev_length < s->config->lazy_length )
+		{
+			int max_chain = s->config->max_chain;
+			if( have_prev && prev_length >= s->config->good_length )
+			{
+				max_chain >>= 2;
+			}
+			length = longest_match( s, pos, max_chain, have_prev && prev_length >= MIN_MATCH ? prev_length : MIN_MATCH - 1, &dist );
+		}
+		insert_position( s, pos );
+
+		if( have_prev && prev_length >= MIN_MATCH && length <= prev_length )
+		{
+			/*	the match started at the previous position	*/
+			size_t match_end = pos - 1 + prev_length, k;
+			emit_match( s, pos - 1, prev_length, prev_dist );
+			for( k = pos + 1; k < match_end; ++k )
+			{
+				insert_position( s, k );
+			}
+			pos = match_end;
+			have_prev = 0;
+			prev_length = 0;
+			continue;
+		}
+
+		if( have_prev )
+		{
+			emit_literal( s, pos - 1 );
+		}
+		prev_length = length;
+		prev_dist = dist;
+		have_prev = 1;
+		++pos;
+	}
+
+	if( have_prev )
+	{
+		if( prev_length >= MIN_MATCH )
+		{
+			emit_match( s, pos - 1, prev_length, prev_dist );
+		} else
+		{
+			emit_literal( s, pos - 1 );
+		}
+	}
+}
+
+int
+	deflate_compress_segment
+	(
+		deflate_output *out,
+		const unsigned char *data,
+		size_t window_start, size_t start, size_t end,
+		int level, int is_last
+	)
+{
+	deflate_state *s;
+	size_t pos;
+
+	if( (out == NULL) || (out->failed) || (start > end) || (window_start > start) )
+	{
+		return 0;
+	}
+	if( level < 0 ) level = 0;
+	if( level > 9 ) level = 9;
+
+	if( level == 0 )
+	{
+		if( end > start || is_last )
+		{
+			write_stored( out, data + start, end - start, is_last );
+		}
+	} else
+	{
+		s = (deflate_state*)malloc( sizeof(deflate_state) );
+		if( s == NULL )
+		{
+			out->failed = 1;
+			return 0;
+		}
+		s->out = out;
+		s->data = data;
+		s->config = &level_configs[level];
+		s->end = end;
+		s->base = start - window_start > WINDOW_SIZE ? start - WINDOW_SIZE : window_start;
+		s->sym_count = 0;
+		s->block_start = s->block_end = start;
+		memset( s->head, 0xFF, sizeof(s->head) );
+		memset( s->litlen_freq, 0, sizeof(s->litlen_freq) );
+		memset( s->dist_freq, 0, sizeof(s->dist_freq) );
+
+		/*	the history	*/
+		for( pos = s->base; pos < start; ++pos )
+		{
+			insert_position( s, pos );
+		}
+
+		if( s->config->lazy_length > 0 )
+		{
+			compress_lazy( s, start );
+		} else
+		{
+			compress_greedy( s, start );
+		}
+
+		if( s->sym_count > 0 || is_last )
+		{
+			flush_block( s, is_last );
+		}
+		free( s );
+	}
+
+	if( !is_last )
+	{
+		/*	sync flush: an empty stored block ends byte aligned	*/
+		put_bits( out, 0, 3 );
+		align_output( out );
+		put_byte( out, 0 );
+		put_byte( out, 0 );
+		put_byte( out, 0xFF );
+		put_byte( out, 0xFF );
+	} else
+	{
+		align_output( out );
+	}
+	return !out->failed;
+}
+
+void
+	deflate_zlib_header
+	(
+		deflate_output *out,
+		int level
+	)
+{
+	/*	32K window, deflate; the level hint, then the check bits	*/
+	unsigned int cmf = 0x78;
+	unsigned int flevel = level <= 1 ? 0 : level <= 5 ? 1 : level == 6 ? 2 : 3;
+	unsigned int flg = flevel << 6;
+	flg += 31 - (cmf * 256 + flg) % 31;
+	put_byte( out, cmf );
+	put_byte( out, flg );
+}
+
+int
+	deflate_zlib_compress
+	(
+		deflate_output *out,
+		const unsigned char *data, size_t size,
+		int level
+	)
+{
+	unsigned int adler;
+	unsigned char trailer[4];
+	deflate_zlib_header( out, level );
+	if( !deflate_compress_segment( out, data, 0, 0, size, level, 1 ) )
+	{
+		return 0;
+	}
+	adler = checksum_adler32( 1, data, size );
+	trailer[0] = (unsigned char)(adler >> 24);
+	trailer[1] = (unsigned char)(adler >> 16);
+	trailer[2] = (unsigned char)(adler >> 8);
+	trailer[3] = (unsigned char)adler;
+	deflate_output_write( out, trailer, 4 );
+	return !out->failed;
+}
@@ -0,0 +1,99 @@
+// \brief
+//		deflate (RFC 1951) & zlib (RFC 1950) compressor for the PNG writer.
+//		LZ77 over hash chains, lazy matching on the higher levels, every block
+//		is written stored, with the fixed or with its own Huffman codes,
+//		whichever is the smallest.
+//
+
+#ifndef HEADER_IMAGE_DEFLATE
+#define HEADER_IMAGE_DEFLATE
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+	The compressed bytes. Bits are packed LSB first, the way deflate
+	wants them.
+**/
+typedef struct
+{
+	unsigned char *data;
+	size_t size;
+	size_t capacity;
+	unsigned int bits;		/*	pending bits, less than 8	*/
+	int bit_count;
+	int failed;				/*	out of memory	*/
+} deflate_output;
+
+void
+	deflate_output_init
+	(
+		deflate_output *out,
+		size_t reserve
+	);
+
+void
+	deflate_output_free
+	(
+		deflate_output *out
+	);
+
+/**
+	Appends bytes, e.g. a checksum after the compressed data.
+**/
+void
+	deflate_output_write
+	(
+		deflate_output *out,
+		const unsigned char *data, size_t size
+	);
+
+/**
+	Compresses data[start, end) into deflate blocks.
+	The matches may refer back to data[window_start, start), so segments
+	compressed one by one join into a single stream; pass
+	window_start == start for a segment without history.
+	The last segment ends the stream, the others end with an empty stored
+	block, so their output is byte aligned and can simply be concatenated.
+	level: 0 stores the data, 1 is the fastest .. 9 the smallest.
+	\return 0 if failed, otherwise returns 1
+**/
+int
+	deflate_compress_segment
+	(
+		deflate_output *out,
+		const unsigned char *data,
+		size_t window_start, size_t start, size_t end,
+		int level, int is_last
+	);
+
+/**
+	Writes the 2 byte zlib header for the level.
+**/
+void
+	deflate_zlib_header
+	(
+		deflate_output *out,
+		int level
+	);
+
+/**
+	Compresses data as one zlib stream: header, deflate data, Adler-32.
+	\return 0 if failed, otherwise returns 1
+**/
+int
+	deflate_zlib_compress
+	(
+		deflate_output *out,
+		const unsigned char *data, size_t size,
+		int level
+	);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* HEADER_IMAGE_DEFLATE	*/
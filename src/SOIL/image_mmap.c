@@ -0,0 +1,116 @@
+// \brief
+//		read-only file mapping.
+//
+
+#include <limits.h>
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#define MMAP_SUPPORTED 1
+#elif defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#define MMAP_SUPPORTED 1
+#else
+#define MMAP_SUPPORTED 0
+#endif
+
+#include "image_mmap.h"
+
+int
+	map_image_file
+	(
+		const char *filename,
+		mapped_image_file *file
+	)
+{
+#if defined(_WIN32)
+	HANDLE handle, mapping;
+	LARGE_INTEGER size;
+	void *view = NULL;
+#elif MMAP_SUPPORTED
+	struct stat info;
+	void *view = NULL;
+	int fd;
+#endif
+
+	file->data = NULL;
+	file->size = 0;
+	if( filename == NULL )
+	{
+		return 0;
+	}
+
+#if defined(_WIN32)
+	/*	the view keeps the file open, the handles can go right away	*/
+	handle = CreateFileA( filename, GENERIC_READ, FILE_SHARE_READ, NULL,
+		OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL );
+	if( handle == INVALID_HANDLE_VALUE )
+	{
+		return 0;
+	}
+	if( GetFileSizeEx( handle, &size ) && size.QuadPart > 0 && size.QuadPart <= INT_MAX )
+	{
+		mapping = CreateFileMappingA( handle, NULL, PAGE_READONLY, 0, 0, NULL );
+		if( mapping != NULL )
+		{
+			view = MapViewOfFile( mapping, FILE_MAP_READ, 0, 0, 0 );
+			CloseHandle( mapping );
+		}
+	}
+	CloseHandle( handle );
+	if( view == NULL )
+	{
+		return 0;
+	}
+	file->data = (const unsigned char*)view;
+	file->size = (int)size.QuadPart;
+	return 1;
+#elif MMAP_SUPPORTED
+	fd = open( filename, O_RDONLY );
+	if( fd < 0 )
+	{
+		return 0;
+	}
+	if( fstat( fd, &info ) == 0 && S_ISREG( info.st_mode ) &&
+		info.st_size > 0 && info.st_size <= INT_MAX )
+	{
+		view = mmap( NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+		view = view == MAP_FAILED ? NULL : view;
+	}
+	close( fd );
+	if( view == NULL )
+	{
+		return 0;
+	}
+	/*	read ahead & drop the pages behind	*/
+	madvise( view, (size_t)info.st_size, MADV_SEQUENTIAL );
+	madvise( view, (size_t)info.st_size, MADV_WILLNEED );
+	file->data = (const unsigned char*)view;
+	file->size = (int)info.st_size;
+	return 1;
+#else
+	return 0;
+#endif
+}
+
+void
+	unmap_image_file
+	(
+		mapped_image_file *file
+	)
+{
+	if( file->data != NULL )
+	{
+#if defined(_WIN32)
+		UnmapViewOfFile( (LPCVOID)file->data );
+#elif MMAP_SUPPORTED
+		munmap( (void*)file->data, (size_t)file->size );
+#endif
+	}
+	file->data = NULL;
+	file->size = 0;
+}
@@ -0,0 +1,43 @@
+// \brief
+//		read-only file mapping for the image decoders.
+//		The decoders read the pages of the file in place, no read() calls
+//		and no copy into a stdio buffer. Unmap right after the decode.
+//
+
+#ifndef HEADER_IMAGE_MMAP
+#define HEADER_IMAGE_MMAP
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct
+{
+	const unsigned char *data;
+	int size;				/*	the decoders take an int length	*/
+} mapped_image_file;
+
+/**
+	Maps the whole file, with a hint that it is read once, front to back.
+	Fails for missing & empty files, files of 2 GB or more, and where
+	mapping is not supported; read the file the usual way then.
+	\return 0 if failed, otherwise returns 1
+**/
+int
+	map_image_file
+	(
+		const char *filename,
+		mapped_image_file *file
+	);
+
+void
+	unmap_image_file
+	(
+		mapped_image_file *file
+	);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* HEADER_IMAGE_MMAP	*/
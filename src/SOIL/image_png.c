@@ -7,8 +7,487 @@
 #include <string.h>
 #include <stdio.h>
 
-#include "svpng.inc"
+#if defined(_M_X64) || defined(__SSE2__) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define PNG_SSE2 1
+#include <emmintrin.h>
+#else
+#define PNG_SSE2 0
+#endif
 
+#include "image_checksum.h"
+#include "image_png.h"
+#include "image_deflate.h"
+
+#define IDAT_MAX_SIZE	(1 << 30)	/*	a chunk is at most 2^31 - 1 bytes	*/
+#define SEGMENT_SIZE	(256 * 1024)	/*	default bytes per deflate segment	*/
+#define SEGMENT_MAX		(IDAT_MAX_SIZE / 2)	/*	so a compressed segment fits in an IDAT	*/
+#define DEFLATE_WINDOW	32768
+
+static void put_u32( unsigned char *p, unsigned int value )
+{
+	p[0] = (unsigned char)(value >> 24);
+	p[1] = (unsigned char)(value >> 16);
+	p[2] = (unsigned char)(value >> 8);
+	p[3] = (unsigned char)value;
+}
+
+/*	length, type, data, CRC; the data goes out in a single write	*/
+static int write_chunk( FILE *fout, const char *type, const unsigned char *data, size_t size )
+{
+	unsigned char header[8], footer[4];
+	unsigned int crc;
+
+	put_u32( header, (unsigned int)size );
+	memcpy( header + 4, type, 4 );
+	crc = checksum_crc32( 0, header + 4, 4 );
+	crc = checksum_crc32( crc, data, size );
+	put_u32( footer, crc );
+
+	return (fwrite( header, 1, 8, fout ) == 8) &&
+		(size == 0 || fwrite( data, 1, size, fout ) == size) &&
+		(fwrite( footer, 1, 4, fout ) == 4);
+}
+
+/*	one deflate segment of the filtered rows	*/
+typedef struct
+{
+	deflate_output out;
+	unsigned int adler;		/*	of the filtered bytes	*/
+	unsigned int crc;		/*	of the compressed bytes	*/
+} png_segment;
+
+/*	IDAT chunks of whole segments, the CRC of each is combined from theirs	*/
+static int write_idat_chunks( FILE *fout, const png_segment *segments, int count )
+{
+	unsigned char header[8], footer[4];
+	unsigned int crc;
+	size_t size;
+	int first, last, k;
+
+	for( first = 0; first < count; first = last )
+	{
+		size = segments[first].out.size;
+		for( last = first + 1; last < count && size + segments[last].out.size <= IDAT_MAX_SIZE; ++last )
+		{
+			size += segments[last].out.size;
+		}
+
+		put_u32( header, (unsigned int)size );
+		memcpy( header + 4, "IDAT", 4 );
+		crc = checksum_crc32( 0, header + 4, 4 );
+		if( fwrite( header, 1, 8, fout ) != 8 )
+		{
+			return 0;
+		}
+		for( k = first; k < last; ++k )
+		{
+			size = segments[k].out.size;
+			if( size > 0 && fwrite( segments[k].out.data, 1, size, fout ) != size )
+			{
+				return 0;
+			}
+			crc = checksum_crc32_combine( crc, segments[k].crc, size );
+		}
+		put_u32( footer, crc );
+		if( fwrite( footer, 1, 4, fout ) != 4 )
+		{
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/*	row filters: out[i] = row[i] - predictor. the row above the first one
+	is all zero, then Up is None and Paeth is Sub.	*/
+
+static int paeth_predictor( int a, int b, int c )
+{
+	int p = a + b - c;
+	int pa = abs( p - a );
+	int pb = abs( p - b );
+	int pc = abs( p - c );
+	if( pa <= pb && pa <= pc ) return a;
+	if( pb <= pc ) return b;
+	return c;
+}
+
+#if PNG_SSE2
+static __m128i abs_epi16( __m128i x )
+{
+	return _mm_max_epi16( x, _mm_sub_epi16( _mm_setzero_si128(), x ) );
+}
+
+/*	paeth_predictor of 8 16 bit lanes	*/
+static __m128i paeth_epi16( __m128i a, __m128i b, __m128i c )
+{
+	__m128i pa = abs_epi16( _mm_sub_epi16( b, c ) );
+	__m128i pb = abs_epi16( _mm_sub_epi16( a, c ) );
+	__m128i pc = abs_epi16( _mm_sub_epi16( _mm_add_epi16( a, b ), _mm_add_epi16( c, c ) ) );
+	__m128i not_a = _mm_or_si128( _mm_cmpgt_epi16( pa, pb ), _mm_cmpgt_epi16( pa, pc ) );
+	__m128i not_b = _mm_cmpgt_epi16( pb, pc );
+	__m128i b_or_c = _mm_or_si128( _mm_andnot_si128( not_b, b ), _mm_and_si128( not_b, c ) );
+	return _mm_or_si128( _mm_andnot_si128( not_a, a ), _mm_and_si128( not_a, b_or_c ) );
+}
+#endif
+
+static void filter_sub( unsigned char *out, const unsigned char *row, int row_bytes, int bpp )
+{
+	int i;
+	for( i = 0; i < bpp; ++i ) out[i] = row[i];
+#if PNG_SSE2
+	for( ; i + 16 <= row_bytes; i += 16 )
+	{
+		__m128i x = _mm_loadu_si128( (const __m128i*)(row + i) );
+		__m128i a = _mm_loadu_si128( (const __m128i*)(row + i - bpp) );
+		_mm_storeu_si128( (__m128i*)(out + i), _mm_sub_epi8( x, a ) );
+	}
+#endif
+	for( ; i < row_bytes; ++i ) out[i] = (unsigned char)(row[i] - row[i - bpp]);
+}
+
+static void filter_up( unsigned char *out, const unsigned char *row, const unsigned char *prior, int row_bytes )
+{
+	int i = 0;
+#if PNG_SSE2
+	for( ; i + 16 <= row_bytes; i += 16 )
+	{
+		__m128i x = _mm_loadu_si128( (const __m128i*)(row + i) );
+		__m128i b = _mm_loadu_si128( (const __m128i*)(prior + i) );
+		_mm_storeu_si128( (__m128i*)(out + i), _mm_sub_epi8( x, b ) );
+	}
+#endif
+	for( ; i < row_bytes; ++i ) out[i] = (unsigned char)(row[i] - prior[i]);
+}
+
+static void filter_average( unsigned char *out, const unsigned char *row, const unsigned char *prior, int row_bytes, int bpp )
+{
+	int i;
+	for( i = 0; i < bpp; ++i ) out[i] = (unsigned char)(row[i] - (prior[i] >> 1));
+#if PNG_SSE2
+	for( ; i + 16 <= row_bytes; i += 16 )
+	{
+		__m128i x = _mm_loadu_si128( (const __m128i*)(row + i) );
+		__m128i a = _mm_loadu_si128( (const __m128i*)(row + i - bpp) );
+		__m128i b = _mm_loadu_si128( (const __m128i*)(prior + i) );
+		/*	avg_epu8 rounds up, (a + b) >> 1 rounds down	*/
+		__m128i odd = _mm_and_si128( _mm_xor_si128( a, b ), _mm_set1_epi8( 1 ) );
+		__m128i avg = _mm_sub_epi8( _mm_avg_epu8( a, b ), odd );
+		_mm_storeu_si128( (__m128i*)(out + i), _mm_sub_epi8( x, avg ) );
+	}
+#endif
+	for( ; i < row_bytes; ++i ) out[i] = (unsigned char)(row[i] - ((row[i - bpp] + prior[i]) >> 1));
+}
+
+static void filter_paeth( unsigned char *out, const unsigned char *row, const unsigned char *prior, int row_bytes, int bpp )
+{
+	int i;
+	for( i = 0; i < bpp; ++i ) out[i] = (unsigned char)(row[i] - prior[i]);
+#if PNG_SSE2
+	for( ; i + 16 <= row_bytes; i += 16 )
+	{
+		__m128i zero = _mm_setzero_si128();
+		__m128i x = _mm_loadu_si128( (const __m128i*)(row + i) );
+		__m128i a = _mm_loadu_si128( (const __m128i*)(row + i - bpp) );
+		__m128i b = _mm_loadu_si128( (const __m128i*)(prior + i) );
+		__m128i c = _mm_loadu_si128( (const __m128i*)(prior + i - bpp) );
+		__m128i lo = paeth_epi16( _mm_unpacklo_epi8( a, zero ), _mm_unpacklo_epi8( b, zero ), _mm_unpacklo_epi8( c, zero ) );
+		__m128i hi = paeth_epi16( _mm_unpackhi_epi8( a, zero ), _mm_unpackhi_epi8( b, zero ), _mm_unpackhi_epi8( c, zero ) );
+		_mm_storeu_si128( (__m128i*)(out + i), _mm_sub_epi8( x, _mm_packus_epi16( lo, hi ) ) );
+	}
+#endif
+	for( ; i < row_bytes; ++i ) out[i] = (unsigned char)(row[i] - paeth_predictor( row[i - bpp], prior[i], prior[i - bpp] ));
+}
+
+static void filter_row( int filter, unsigned char *out, const unsigned char *row, const unsigned char *prior, int row_bytes, int bpp )
+{
+	switch( filter )
+	{
+	case PNG_FILTER_SUB:		filter_sub( out, row, row_bytes, bpp ); break;
+	case PNG_FILTER_UP:			filter_up( out, row, prior, row_bytes ); break;
+	case PNG_FILTER_AVERAGE:	filter_average( out, row, prior, row_bytes, bpp ); break;
+	case PNG_FILTER_PAETH:		filter_paeth( out, row, prior, row_bytes, bpp ); break;
+	case PNG_FILTER_NONE:
+	default:					memcpy( out, row, row_bytes ); break;
+	}
+}
+
+/*	sum of the filtered bytes taken as signed, smaller usually deflates better	*/
+static unsigned int filter_cost( const unsigned char *filtered, int size )
+{
+	unsigned int cost = 0;
+	int i = 0;
+#if PNG_SSE2
+	__m128i zero = _mm_setzero_si128();
+	__m128i sum = zero;
+	for( ; i + 16 <= size; i += 16 )
+	{
+		__m128i x = _mm_loadu_si128( (const __m128i*)(filtered + i) );
+		__m128i magnitude = _mm_min_epu8( x, _mm_sub_epi8( zero, x ) );
+		sum = _mm_add_epi64( sum, _mm_sad_epu8( magnitude, zero ) );
+	}
+	cost = (unsigned int)_mm_cvtsi128_si32( sum ) + (unsigned int)_mm_cvtsi128_si32( _mm_srli_si128( sum, 8 ) );
+#endif
+	for( ; i < size; ++i )
+	{
+		cost += filtered[i] < 128 ? filtered[i] : 256 - filtered[i];
+	}
+	return cost;
+}
+
+/*	the filter with the smallest cost, libpng's heuristic. candidates holds
+	4 rows for Sub .. Paeth	*/
+static void filter_row_adaptive( unsigned char *out, const unsigned char *row, const unsigned char *prior, int row_bytes, int bpp, unsigned char *candidates )
+{
+	const unsigned char *best = row;
+	unsigned int best_cost = filter_cost( row, row_bytes );
+	unsigned int cost;
+	int filter, best_filter = PNG_FILTER_NONE;
+
+	for( filter = PNG_FILTER_SUB; filter <= PNG_FILTER_PAETH && best_cost > 0; ++filter )
+	{
+		unsigned char *candidate = candidates + (size_t)row_bytes * (filter - PNG_FILTER_SUB);
+		filter_row( filter, candidate, row, prior, row_bytes, bpp );
+		cost = filter_cost( candidate, row_bytes );
+		if( cost < best_cost )
+		{
+			best = candidate;
+			best_cost = cost;
+			best_filter = filter;
+		}
+	}
+	out[0] = (unsigned char)best_filter;
+	memcpy( out + 1, best, row_bytes );
+}
+
+/*	jobs for settings->parallel_for	*/
+
+typedef struct
+{
+	const unsigned char *data;
+	unsigned char *filtered;
+	const unsigned char *zero_row;		/*	above the first row	*/
+	unsigned char *candidates;			/*	4 rows per job, PNG_FILTER_ADAPTIVE only	*/
+	size_t row_bytes;
+	int height, channels, filter;
+	int rows_per_job;
+} png_filter_job;
+
+static void filter_rows_job( void *arg, int index )
+{
+	const png_filter_job *job = (const png_filter_job*)arg;
+	unsigned char *candidates = job->candidates + job->row_bytes * 4 * index;
+	unsigned char *out;
+	const unsigned char *row, *prior;
+	int y = job->rows_per_job * index;
+	int end = job->height - y > job->rows_per_job ? y + job->rows_per_job : job->height;
+
+	for( ; y < end; ++y )
+	{
+		out = job->filtered + (job->row_bytes + 1) * y;
+		row = job->data + job->row_bytes * y;
+		prior = y > 0 ? row - job->row_bytes : job->zero_row;
+		if( job->filter == PNG_FILTER_ADAPTIVE )
+		{
+			filter_row_adaptive( out, row, prior, (int)job->row_bytes, job->channels, candidates );
+		} else
+		{
+			out[0] = (unsigned char)job->filter;
+			filter_row( job->filter, out + 1, row, prior, (int)job->row_bytes, job->channels );
+		}
+	}
+}
+
+typedef struct
+{
+	const unsigned char *filtered;
+	size_t size;
+	size_t segment_size;
+	int count, level;
+	png_segment *segments;
+} png_compress_job;
+
+/*	a segment looks back into the 32 KB before it, so the segments join
+	into one deflate stream; all but the last end with a sync flush	*/
+static void compress_segment_job( void *arg, int index )
+{
+	const png_compress_job *job = (const png_compress_job*)arg;
+	png_segment *segment = job->segments + index;
+	size_t start = job->segment_size * index;
+	size_t end = job->size - start > job->segment_size ? start + job->segment_size : job->size;
+	int is_last = (index == job->count - 1);
+
+	deflate_output_init( &segment->out, (end - start) / 2 + 64 );
+	if( index == 0 )
+	{
+		deflate_zlib_header( &segment->out, job->level );
+	}
+	deflate_compress_segment( &segment->out, job->filtered,
+		start > DEFLATE_WINDOW ? start - DEFLATE_WINDOW : 0, start, end, job->level, is_last );
+	segment->adler = checksum_adler32( 1, job->filtered + start, end - start );
+	if( !is_last )
+	{
+		/*	the last one gets the Adler-32 of the stream first	*/
+		segment->crc = checksum_crc32( 0, segment->out.data, segment->out.size );
+	}
+}
+
+static void run_jobs( const png_save_settings *settings, int count, void (*job)( void *arg, int index ), void *arg )
+{
+	int i;
+	if( settings->parallel_for != NULL && count > 1 )
+	{
+		settings->parallel_for( settings->parallel_context, count, job, arg );
+	} else
+	{
+		for( i = 0; i < count; ++i )
+		{
+			job( arg, i );
+		}
+	}
+}
+
+/*	the zlib stream of an image, in segments	*/
+typedef struct
+{
+	png_segment *segments;
+	int count;
+	size_t size;		/*	compressed bytes	*/
+	int failed;
+} png_stream;
+
+static void free_stream( png_stream *stream )
+{
+	int k;
+	for( k = 0; k < stream->count; ++k )
+	{
+		deflate_output_free( &stream->segments[k].out );
+	}
+	free( stream->segments );
+	stream->segments = NULL;
+	stream->count = 0;
+}
+
+/*	filters the rows with filter (a PNG_FILTER_* up to PNG_FILTER_ADAPTIVE)
+	and compresses them	*/
+static void encode_stream( png_stream *stream, const png_save_settings *settings, int filter, const unsigned char *data, int width, int height, int channels )
+{
+	png_filter_job filter_job;
+	png_compress_job compress_job;
+	png_segment *last;
+	unsigned char trailer[4];
+	unsigned char *filtered;
+	size_t row_bytes, filtered_size, segment_size;
+	unsigned int adler;
+	int k, filter_jobs;
+
+	stream->segments = NULL;
+	stream->count = 0;
+	stream->size = 0;
+	stream->failed = 1;
+
+	/*	without parallel_for the stream is a single segment, unless it
+		would not fit in one IDAT	*/
+	segment_size = SEGMENT_MAX;
+	if (settings->parallel_for != NULL)
+	{
+		segment_size = settings->segment_size > 0 ? settings->segment_size : SEGMENT_SIZE;
+		segment_size = segment_size < SEGMENT_MAX ? segment_size : SEGMENT_MAX;
+	}
+
+	/*	filter the rows, the zero row above the first one follows them	*/
+	row_bytes = (size_t)width * channels;
+	filtered_size = (row_bytes + 1) * height;
+	filter_job.rows_per_job = (int)(segment_size / (row_bytes + 1));
+	filter_job.rows_per_job = filter_job.rows_per_job > 0 ? filter_job.rows_per_job : 1;
+	filter_jobs = (height + filter_job.rows_per_job - 1) / filter_job.rows_per_job;
+
+	filtered = (unsigned char*)malloc( filtered_size + row_bytes );
+	filter_job.candidates = NULL;
+	if (filter == PNG_FILTER_ADAPTIVE)
+	{
+		filter_job.candidates = (unsigned char*)malloc( row_bytes * 4 * filter_jobs );
+	}
+	if ((NULL == filtered) || (filter == PNG_FILTER_ADAPTIVE && NULL == filter_job.candidates))
+	{
+		free( filtered );
+		free( filter_job.candidates );
+		return;
+	}
+	memset( filtered + filtered_size, 0, row_bytes );
+	filter_job.data = data;
+	filter_job.filtered = filtered;
+	filter_job.zero_row = filtered + filtered_size;
+	filter_job.row_bytes = row_bytes;
+	filter_job.height = height;
+	filter_job.channels = channels;
+	filter_job.filter = filter;
+	run_jobs( settings, filter_jobs, filter_rows_job, &filter_job );
+	free( filter_job.candidates );
+
+	/*	compress them	*/
+	stream->count = (int)((filtered_size + segment_size - 1) / segment_size);
+	stream->segments = (png_segment*)calloc( stream->count, sizeof(png_segment) );
+	if (NULL == stream->segments)
+	{
+		stream->count = 0;
+		free( filtered );
+		return;
+	}
+	compress_job.filtered = filtered;
+	compress_job.size = filtered_size;
+	compress_job.segment_size = segment_size;
+	compress_job.count = stream->count;
+	compress_job.level = settings->level;
+	compress_job.segments = stream->segments;
+	run_jobs( settings, stream->count, compress_segment_job, &compress_job );
+	free( filtered );
+
+	/*	the Adler-32 of the whole stream closes the last segment	*/
+	adler = stream->segments[0].adler;
+	for( k = 1; k < stream->count; ++k )
+	{
+		adler = checksum_adler32_combine( adler, stream->segments[k].adler,
+			k < stream->count - 1 ? segment_size : filtered_size - segment_size * k );
+	}
+	last = stream->segments + stream->count - 1;
+	put_u32( trailer, adler );
+	deflate_output_write( &last->out, trailer, 4 );
+	last->crc = checksum_crc32( 0, last->out.data, last->out.size );
+
+	stream->failed = 0;
+	for( k = 0; k < stream->count; ++k )
+	{
+		stream->failed |= stream->segments[k].out.failed;
+		stream->size += stream->segments[k].out.size;
+	}
+}
+
+typedef struct
+{
+	const png_save_settings *settings;
+	const unsigned char *data;
+	int width, height, channels;
+	png_stream streams[PNG_FILTER_ADAPTIVE + 1];
+} png_optimize_job;
+
+static void optimize_job( void *arg, int index )
+{
+	png_optimize_job *job = (png_optimize_job*)arg;
+	encode_stream( job->streams + index, job->settings, index, job->data, job->width, job->height, job->channels );
+}
+
+void
+png_default_save_settings
+(
+	png_save_settings *settings
+)
+{
+	settings->level = 6;
+	settings->filter = PNG_FILTER_ADAPTIVE;
+	settings->parallel_for = NULL;
+	settings->parallel_context = NULL;
+	settings->segment_size = 0;
+}
 
 int
 save_image_as_PNG
@@ -17,10 +496,28 @@ save_image_as_PNG
 	int width, int height, int channels,
 	const unsigned char *const data
 )
+{
+	return save_image_as_PNG_ex( filename, width, height, channels, data, NULL );
+}
+
+int
+save_image_as_PNG_ex
+(
+	const char *filename,
+	int width, int height, int channels,
+	const unsigned char *const data,
+	const png_save_settings *settings
+)
 {
 	/*	variables	*/
+	static const unsigned char signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n' };
+	png_save_settings defaults;
+	png_optimize_job optimize;
+	png_stream stream;
+	unsigned char ihdr[13];
 	FILE *fout;
-	
+	int k, best, result;
+
 	/*	error check	*/
 	if ((NULL == filename) ||
 		(width < 1) || (height < 1) ||
@@ -29,15 +526,76 @@ save_image_as_PNG
 	{
 		return 0;
 	}
+	if (NULL == settings)
+	{
+		png_default_save_settings( &defaults );
+		settings = &defaults;
+	}
+
+	/*	filter & compress	*/
+	if (settings->filter == PNG_FILTER_OPTIMIZE)
+	{
+		/*	every strategy, at the same time if parallel_for can	*/
+		optimize.settings = settings;
+		optimize.data = data;
+		optimize.width = width;
+		optimize.height = height;
+		optimize.channels = channels;
+		run_jobs( settings, PNG_FILTER_ADAPTIVE + 1, optimize_job, &optimize );
+
+		best = -1;
+		for( k = 0; k <= PNG_FILTER_ADAPTIVE; ++k )
+		{
+			if (!optimize.streams[k].failed &&
+				(best < 0 || optimize.streams[k].size < optimize.streams[best].size))
+			{
+				best = k;
+			}
+		}
+		for( k = 0; k <= PNG_FILTER_ADAPTIVE; ++k )
+		{
+			if (k != best)
+			{
+				free_stream( optimize.streams + k );
+			}
+		}
+		if (best < 0)
+		{
+			return 0;
+		}
+		stream = optimize.streams[best];
+	} else
+	{
+		encode_stream( &stream, settings,
+			(settings->filter >= 0 && settings->filter < PNG_FILTER_OPTIMIZE) ? settings->filter : PNG_FILTER_NONE,
+			data, width, height, channels );
+		if (stream.failed)
+		{
+			free_stream( &stream );
+			return 0;
+		}
+	}
 
 	/*	write it out	*/
+	put_u32( ihdr, width );
+	put_u32( ihdr + 4, height );
+	ihdr[8] = 8;						/*	bit depth	*/
+	ihdr[9] = channels == 4 ? 6 : 2;	/*	true color with/without alpha	*/
+	ihdr[10] = 0;						/*	deflate	*/
+	ihdr[11] = 0;						/*	adaptive filtering	*/
+	ihdr[12] = 0;						/*	no interlace	*/
+
 	fout = fopen(filename, "wb");
+	result = 0;
 	if (fout)
 	{
-		svpng(fout, width, height, data, channels == 4);
+		result = fwrite( signature, 1, 8, fout ) == 8 &&
+			write_chunk( fout, "IHDR", ihdr, 13 ) &&
+			write_idat_chunks( fout, stream.segments, stream.count ) &&
+			write_chunk( fout, "IEND", NULL, 0 );
 		fclose(fout);
-		return 1;
 	}
 
-	return 0;
+	free_stream( &stream );
+	return result;
 }
@@ -0,0 +1,89 @@
+// \brief
+//		save png image.
+//		the rows are filtered, then deflate compressed (image_deflate).
+//		By default each row gets the filter whose output has the smallest
+//		sum of magnitudes (libpng's heuristic); PNG_FILTER_OPTIMIZE
+//		compresses the whole image with every strategy and keeps the
+//		smallest file.
+//		Given a parallel_for, big images are compressed pigz-style: the
+//		filtered rows are cut into segments that are deflated at the same
+//		time, each primed with the 32 KB before it, and joined with sync
+//		flushes into one zlib stream.
+//
+
+#ifndef HEADER_IMAGE_PNG
+#define HEADER_IMAGE_PNG
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*	PNG row filter types	*/
+enum
+{
+	PNG_FILTER_NONE = 0,
+	PNG_FILTER_SUB,
+	PNG_FILTER_UP,
+	PNG_FILTER_AVERAGE,
+	PNG_FILTER_PAETH,
+
+	/*	strategies, not types	*/
+	PNG_FILTER_ADAPTIVE,	/*	per row, the default	*/
+	PNG_FILTER_OPTIMIZE,	/*	the smallest of the 6 above, 6 times slower	*/
+	PNG_FILTER_MAX
+};
+
+typedef struct
+{
+	int level;		/*	0 stored .. 9 smallest	*/
+	int filter;		/*	PNG_FILTER_*	*/
+
+	/*	optional, runs job( arg, 0 ) .. job( arg, count - 1 ), at the same
+		time if it can, and returns when all are done.	*/
+	void (*parallel_for)( void *context, int count, void (*job)( void *arg, int index ), void *arg );
+	void *parallel_context;
+	size_t segment_size;	/*	filtered bytes per segment with parallel_for, 0 is 256 KB	*/
+} png_save_settings;
+
+/**
+	The settings save_image_as_PNG uses.
+**/
+void
+png_default_save_settings
+(
+	png_save_settings *settings
+);
+
+/**
+	Saves an image from an array of unsigned chars (RGB or RGBA) to disk
+	with the default settings.
+	\return 0 if failed, otherwise returns 1
+**/
+int
+save_image_as_PNG
+(
+	const char *filename,
+	int width, int height, int channels,
+	const unsigned char *const data
+);
+
+/**
+	Like save_image_as_PNG, settings may be NULL for the defaults.
+	\return 0 if failed, otherwise returns 1
+**/
+int
+save_image_as_PNG_ex
+(
+	const char *filename,
+	int width, int height, int channels,
+	const unsigned char *const data,
+	const png_save_settings *settings
+);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* HEADER_IMAGE_PNG	*/
@@ -13,10 +13,10 @@
       HDR (radiance rgbE format)
       writes BMP,TGA (define STBI_NO_WRITE to remove code)
       decoded from memory or through stdio FILE (define STBI_NO_STDIO to remove code)
-      supports installable dequantizing-IDCT, YCbCr-to-RGB conversion (define STBI_SIMD)
+      SSE2 (AVX2 chosen at run time) dequantizing-IDCT, upsampling & YCbCr-to-RGB, installable replacements
 
    TODO:
-      stbi_info_*
+      stbi_info_* for BMP, TGA, PSD, HDR, DDS
 
    history:
       1.16   major bugfix - convert_format converted one too many pixels
@@ -106,6 +106,8 @@ typedef unsigned char validate_uint32[sizeof(uint32)==4];
 #include "stbi_DDS_aug.h"
 #endif
 
+#include "image_checksum.h"
+
 //	I (JLD) want full messages for SOIL
 #define STBI_FAILURE_USERMSG 1
 
@@ -114,17 +116,56 @@ typedef unsigned char validate_uint32[sizeof(uint32)==4];
 // Generic API that works on all image types
 //
 
-// this is not threadsafe
-static char *failure_reason;
+#ifdef _MSC_VER
+   #define STBI_THREAD_LOCAL  __declspec(thread)
+#else
+   #define STBI_THREAD_LOCAL  __thread
+#endif
+
+// the temporary buffers of a decode, reused by the next decode on the thread
+enum
+{
+   SCRATCH_idata,                      // png: the IDAT chunks joined
+   SCRATCH_inflate,                    // png: the filtered rows
+   SCRATCH_image,                      // the image load_into copies from
+   SCRATCH_palette,                    // png: the palette expanded
+   SCRATCH_plane,                      // jpeg: one per component
+   SCRATCH_line = SCRATCH_plane + 4,   // jpeg: one per component
+   SCRATCH_count = SCRATCH_line + 4
+};
+
+typedef struct
+{
+   uint8 *data;
+   size_t size;
+} stbi_scratch;
+
+// everything a decode changes or reads besides its own arguments lives
+// here, one per thread, so images can be decoded on several threads at once
+typedef struct
+{
+   char *failure_reason;
+   char  failure_buffer[32];   // for reasons that are built at run time
+
+   float h2l_gamma_i, h2l_scale_i;
+   float l2h_gamma, l2h_scale;
+
+   stbi_scratch scratch[SCRATCH_count];
+
+   stbi_parallel_for jpeg_parallel_for;   // for the jpegs of this thread
+   void *jpeg_parallel_context;
+} stbi_context;
+
+static STBI_THREAD_LOCAL stbi_context stbi_ctx = { NULL, "", 1.0f/2.2f, 1.0f, 2.2f, 1.0f, { { NULL, 0 } }, NULL, NULL };
 
 char *stbi_failure_reason(void)
 {
-   return failure_reason;
+   return stbi_ctx.failure_reason;
 }
 
 static int e(char *str)
 {
-   failure_reason = str;
+   stbi_ctx.failure_reason = str;
    return 0;
 }
 
@@ -144,6 +185,54 @@ void stbi_image_free(void *retval_from_stbi_load)
    free(retval_from_stbi_load);
 }
 
+// the scratch buffer of the calling thread, grown to at least size bytes.
+// like realloc it keeps the contents, unlike it the buffer is never freed
+// by the decoders. a thread decodes one image at a time, so each buffer
+// has one user.
+static uint8 *scratch_get(int slot, size_t size)
+{
+   stbi_scratch *b = &stbi_ctx.scratch[slot];
+   if (size > b->size) {
+      uint8 *p = (uint8 *) realloc(b->data, size);
+      if (p == NULL) return NULL;
+      b->data = p;
+      b->size = size;
+   }
+   return b->data;
+}
+
+// free a buffer of a decode that may be a scratch buffer
+static void scratch_free(void *p)
+{
+   int i;
+   for (i=0; i < SCRATCH_count; ++i)
+      if (p == stbi_ctx.scratch[i].data && p != NULL)
+         return;
+   free(p);
+}
+
+void stbi_scratch_trim(size_t max_keep)
+{
+   int i;
+   for (i=0; i < SCRATCH_count; ++i) {
+      stbi_scratch *b = &stbi_ctx.scratch[i];
+      if (b->size > max_keep || max_keep == 0) {
+         free(b->data);
+         b->data = NULL;
+         b->size = 0;
+      }
+   }
+}
+
+size_t stbi_scratch_size(void)
+{
+   size_t size = 0;
+   int i;
+   for (i=0; i < SCRATCH_count; ++i)
+      size += stbi_ctx.scratch[i].size;
+   return size;
+}
+
 #define MAX_LOADERS  32
 stbi_loader *loaders[MAX_LOADERS];
 static int max_loaders = 0;
@@ -320,22 +409,45 @@ extern int      stbi_is_hdr_from_file(FILE *f)
 
 #endif
 
-// @TODO: get image dimensions & components without fully decoding
+// get image dimensions & components without fully decoding, only the
+// headers of JPEG & PNG are parsed so far
 #ifndef STBI_NO_STDIO
-extern int      stbi_info            (char const *filename,           int *x, int *y, int *comp);
-extern int      stbi_info_from_file  (FILE *f,                  int *x, int *y, int *comp);
+int stbi_info(char const *filename, int *x, int *y, int *comp)
+{
+   FILE *f = fopen(filename, "rb");
+   int result;
+   if (!f) return e("can't fopen", "Unable to open file");
+   result = stbi_info_from_file(f, x, y, comp);
+   fclose(f);
+   return result;
+}
+
+int stbi_info_from_file(FILE *f, int *x, int *y, int *comp)
+{
+   if (stbi_jpeg_info_from_file(f, x, y, comp))
+      return 1;
+   if (stbi_png_info_from_file(f, x, y, comp))
+      return 1;
+   return e("unknown image type", "Image header not of a known type, or corrupt");
+}
 #endif
-extern int      stbi_info_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp);
 
-#ifndef STBI_NO_HDR
-static float h2l_gamma_i=1.0f/2.2f, h2l_scale_i=1.0f;
-static float l2h_gamma=2.2f, l2h_scale=1.0f;
+int stbi_info_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp)
+{
+   if (stbi_jpeg_info_from_memory(buffer, len, x, y, comp))
+      return 1;
+   if (stbi_png_info_from_memory(buffer, len, x, y, comp))
+      return 1;
+   return e("unknown image type", "Image header not of a known type, or corrupt");
+}
 
-void   stbi_hdr_to_ldr_gamma(float gamma) { h2l_gamma_i = 1/gamma; }
-void   stbi_hdr_to_ldr_scale(float scale) { h2l_scale_i = 1/scale; }
+#ifndef STBI_NO_HDR
+// these apply to the images decoded on the calling thread
+void   stbi_hdr_to_ldr_gamma(float gamma) { stbi_ctx.h2l_gamma_i = 1/gamma; }
+void   stbi_hdr_to_ldr_scale(float scale) { stbi_ctx.h2l_scale_i = 1/scale; }
 
-void   stbi_ldr_to_hdr_gamma(float gamma) { l2h_gamma = gamma; }
-void   stbi_ldr_to_hdr_scale(float scale) { l2h_scale = scale; }
+void   stbi_ldr_to_hdr_gamma(float gamma) { stbi_ctx.l2h_gamma = gamma; }
+void   stbi_ldr_to_hdr_scale(float scale) { stbi_ctx.l2h_scale = scale; }
 #endif
 
 
@@ -360,17 +472,24 @@ typedef struct
    FILE  *img_file;
    #endif
    uint8 *img_buffer, *img_buffer_end;
+
+   // when set, the decoders that can write the pixels straight to this
+   // dest_x * dest_y region, rows dest_stride bytes apart
+   uint8 *dest;
+   uint32 dest_x, dest_y, dest_stride;
 } stbi;
 
 #ifndef STBI_NO_STDIO
 static void start_file(stbi *s, FILE *f)
 {
    s->img_file = f;
+   s->dest = NULL;
 }
 #endif
 
 static void start_mem(stbi *s, uint8 const *buffer, int len)
 {
+   s->dest = NULL;
 #ifndef STBI_NO_STDIO
    s->img_file = NULL;
 #endif
@@ -412,6 +531,11 @@ static void skip(stbi *s, int n)
       fseek(s->img_file, n, SEEK_CUR);
    else
 #endif
+   // stay inside, the buffer may be a file mapped read-only; a corrupt
+   // negative length does not seek back
+   if (n > s->img_buffer_end - s->img_buffer)
+      s->img_buffer = s->img_buffer_end;
+   else if (n > 0)
       s->img_buffer += n;
 }
 
@@ -447,6 +571,12 @@ static void getn(stbi *s, stbi_uc *buffer, int n)
       return;
    }
 #endif
+   // past the end reads zeros, like get8
+   if (n > s->img_buffer_end - s->img_buffer) {
+      int avail = (int) (s->img_buffer_end - s->img_buffer);
+      memset(buffer + avail, 0, n - avail);
+      n = avail;
+   }
    memcpy(buffer, s->img_buffer, n);
    s->img_buffer += n;
 }
@@ -459,7 +589,8 @@ static void getn(stbi *s, stbi_uc *buffer, int n)
 //    and it never has alpha, so very few cases ). png can automatically
 //    interleave an alpha=255 channel, but falls back to this for other cases
 //
-//  assume data buffer is malloced, so malloc a new one and free that one
+//  assume data buffer is malloced or a scratch buffer, so malloc a new one
+//  and free that one
 //  only failure mode is malloc failing
 
 static uint8 compute_y(int r, int g, int b)
@@ -467,9 +598,36 @@ static uint8 compute_y(int r, int g, int b)
    return (uint8) (((r*77) + (g*150) +  (29*b)) >> 8);
 }
 
+// convert one row of x pixels with img_n components to req_comp components
+static void convert_pixels(unsigned char *dest, int req_comp, unsigned char *src, int img_n, uint x)
+{
+   int i;
+   #define COMBO(a,b)  ((a)*8+(b))
+   #define CASE(a,b)   case COMBO(a,b): for(i=x-1; i >= 0; --i, src += a, dest += b)
+   // convert source image with img_n components to one with req_comp components;
+   // avoid switch per pixel, so use switch per scanline and massive macros
+   switch(COMBO(img_n, req_comp)) {
+      CASE(1,2) dest[0]=src[0], dest[1]=255; break;
+      CASE(1,3) dest[0]=dest[1]=dest[2]=src[0]; break;
+      CASE(1,4) dest[0]=dest[1]=dest[2]=src[0], dest[3]=255; break;
+      CASE(2,1) dest[0]=src[0]; break;
+      CASE(2,3) dest[0]=dest[1]=dest[2]=src[0]; break;
+      CASE(2,4) dest[0]=dest[1]=dest[2]=src[0], dest[3]=src[1]; break;
+      CASE(3,4) dest[0]=src[0],dest[1]=src[1],dest[2]=src[2],dest[3]=255; break;
+      CASE(3,1) dest[0]=compute_y(src[0],src[1],src[2]); break;
+      CASE(3,2) dest[0]=compute_y(src[0],src[1],src[2]), dest[1] = 255; break;
+      CASE(4,1) dest[0]=compute_y(src[0],src[1],src[2]); break;
+      CASE(4,2) dest[0]=compute_y(src[0],src[1],src[2]), dest[1] = src[3]; break;
+      CASE(4,3) dest[0]=src[0],dest[1]=src[1],dest[2]=src[2]; break;
+      default: assert(0);
+   }
+   #undef CASE
+   #undef COMBO
+}
+
 static unsigned char *convert_format(unsigned char *data, int img_n, int req_comp, uint x, uint y)
 {
-   int i,j;
+   int j;
    unsigned char *good;
 
    if (req_comp == img_n) return data;
@@ -477,40 +635,56 @@ static unsigned char *convert_format(unsigned char *data, int img_n, int req_com
 
    good = (unsigned char *) malloc(req_comp * x * y);
    if (good == NULL) {
-      free(data);
+      scratch_free(data);
       return epuc("outofmem", "Out of memory");
    }
 
-   for (j=0; j < (int) y; ++j) {
-      unsigned char *src  = data + j * x * img_n   ;
-      unsigned char *dest = good + j * x * req_comp;
-
-      #define COMBO(a,b)  ((a)*8+(b))
-      #define CASE(a,b)   case COMBO(a,b): for(i=x-1; i >= 0; --i, src += a, dest += b)
-      // convert source image with img_n components to one with req_comp components;
-      // avoid switch per pixel, so use switch per scanline and massive macros
-      switch(COMBO(img_n, req_comp)) {
-         CASE(1,2) dest[0]=src[0], dest[1]=255; break;
-         CASE(1,3) dest[0]=dest[1]=dest[2]=src[0]; break;
-         CASE(1,4) dest[0]=dest[1]=dest[2]=src[0], dest[3]=255; break;
-         CASE(2,1) dest[0]=src[0]; break;
-         CASE(2,3) dest[0]=dest[1]=dest[2]=src[0]; break;
-         CASE(2,4) dest[0]=dest[1]=dest[2]=src[0], dest[3]=src[1]; break;
-         CASE(3,4) dest[0]=src[0],dest[1]=src[1],dest[2]=src[2],dest[3]=255; break;
-         CASE(3,1) dest[0]=compute_y(src[0],src[1],src[2]); break;
-         CASE(3,2) dest[0]=compute_y(src[0],src[1],src[2]), dest[1] = 255; break;
-         CASE(4,1) dest[0]=compute_y(src[0],src[1],src[2]); break;
-         CASE(4,2) dest[0]=compute_y(src[0],src[1],src[2]), dest[1] = src[3]; break;
-         CASE(4,3) dest[0]=src[0],dest[1]=src[1],dest[2]=src[2]; break;
-         default: assert(0);
-      }
-      #undef CASE
-   }
+   for (j=0; j < (int) y; ++j)
+      convert_pixels(good + j * x * req_comp, req_comp, data + j * x * img_n, img_n, x);
 
-   free(data);
+   scratch_free(data);
    return good;
 }
 
+static void set_dest(stbi *s, stbi_uc *dest, int dest_stride, int x, int y)
+{
+   s->dest = dest;
+   s->dest_stride = dest_stride;
+   s->dest_x = x;
+   s->dest_y = y;
+}
+
+static int check_dest_size(stbi *s)
+{
+   if (s->img_x != s->dest_x || s->img_y != s->dest_y)
+      return e("size mismatch", "Image size differs from the destination");
+   return 1;
+}
+
+// copy a decoded image to the destination rows, converting the components
+// on the way if needed. data stays with the caller.
+static int copy_to_dest(stbi *s, unsigned char *data, int img_n, int req_comp)
+{
+   uint32 j;
+   if (!check_dest_size(s)) return 0;
+   for (j=0; j < s->img_y; ++j) {
+      uint8 *dest = s->dest + s->dest_stride*j;
+      uint8 *src = data + img_n*s->img_x*j;
+      if (req_comp && req_comp != img_n)
+         convert_pixels(dest, req_comp, src, img_n, s->img_x);
+      else
+         memcpy(dest, src, img_n*s->img_x);
+   }
+   return 1;
+}
+
+// the pixels a loader returns. when load_into decodes they are only
+// copied to the destination, then they are a scratch buffer.
+static uint8 *image_alloc(stbi *s, size_t size)
+{
+   return s->dest ? scratch_get(SCRATCH_image, size) : (uint8 *) malloc(size);
+}
+
 #ifndef STBI_NO_HDR
 static float   *ldr_to_hdr(stbi_uc *data, int x, int y, int comp)
 {
@@ -521,7 +695,7 @@ static float   *ldr_to_hdr(stbi_uc *data, int x, int y, int comp)
    if (comp & 1) n = comp; else n = comp-1;
    for (i=0; i < x*y; ++i) {
       for (k=0; k < n; ++k) {
-         output[i*comp + k] = (float) pow(data[i*comp+k]/255.0f, l2h_gamma) * l2h_scale;
+         output[i*comp + k] = (float) pow(data[i*comp+k]/255.0f, stbi_ctx.l2h_gamma) * stbi_ctx.l2h_scale;
       }
       if (k < comp) output[i*comp + k] = data[i*comp+k]/255.0f;
    }
@@ -539,7 +713,7 @@ static stbi_uc *hdr_to_ldr(float   *data, int x, int y, int comp)
    if (comp & 1) n = comp; else n = comp-1;
    for (i=0; i < x*y; ++i) {
       for (k=0; k < n; ++k) {
-         float z = (float) pow(data[i*comp+k]*h2l_scale_i, h2l_gamma_i) * 255 + 0.5f;
+         float z = (float) pow(data[i*comp+k]*stbi_ctx.h2l_scale_i, stbi_ctx.h2l_gamma_i) * 255 + 0.5f;
          if (z < 0) z = 0;
          if (z > 255) z = 255;
          output[i*comp + k] = float2int(z);
@@ -556,6 +730,66 @@ static stbi_uc *hdr_to_ldr(float   *data, int x, int y, int comp)
 }
 #endif
 
+//////////////////////////////////////////////////////////////////////////////
+//
+// SIMD support of the decoders: SSE2 on x64 & on x86 builds that assume
+// it, AVX2 code on top of that is chosen at run time; NEON on ARM.
+//
+
+#if defined(_M_X64) || defined(__SSE2__) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define STBI_SSE2 1
+#include <emmintrin.h>
+#if defined(_MSC_VER)
+#define STBI_AVX2 1
+#define STBI_TARGET_AVX2
+#include <intrin.h>
+#include <immintrin.h>
+#elif defined(__GNUC__) || defined(__clang__)
+#define STBI_AVX2 1
+#define STBI_TARGET_AVX2 __attribute__((target("avx2")))
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__) || defined(_M_ARM64)
+#define STBI_NEON 1
+#include <arm_neon.h>
+#endif
+
+#ifdef STBI_AVX2
+// -1 until the CPU is asked, written with the same value by any thread
+static volatile int cpu_has_avx2 = -1;
+
+static int detect_avx2(void)
+{
+   int result = 0;
+#ifdef _MSC_VER
+   int info[4];
+   __cpuid(info, 1);
+   // the OS saves the ymm registers
+   if ((info[2] & (1 << 27)) && (info[2] & (1 << 28)) && (_xgetbv(0) & 6) == 6) {
+      __cpuidex(info, 7, 0);
+      result = (info[1] >> 5) & 1;
+   }
+#else
+   unsigned int eax, ebx, ecx, edx, xcr0_lo, xcr0_hi;
+   if (__get_cpuid(1, &eax, &ebx, &ecx, &edx) && (ecx & (1 << 27)) && (ecx & (1 << 28))) {
+      __asm__ volatile ("xgetbv" : "=a" (xcr0_lo), "=d" (xcr0_hi) : "c" (0));
+      if ((xcr0_lo & 6) == 6 && __get_cpuid_max(0, NULL) >= 7) {
+         __cpuid_count(7, 0, eax, ebx, ecx, edx);
+         result = (ebx >> 5) & 1;
+      }
+   }
+#endif
+   cpu_has_avx2 = result;
+   return result;
+}
+
+static int has_avx2(void)
+{
+   return cpu_has_avx2 > 0 || (cpu_has_avx2 < 0 && detect_avx2());
+}
+#endif
+
 //////////////////////////////////////////////////////////////////////////////
 //
 //  "baseline" JPEG/JFIF decoder (not actually fully baseline implementation)
@@ -599,13 +833,10 @@ typedef struct
 
 typedef struct
 {
-   #if STBI_SIMD
-   unsigned short dequant2[4][64];
-   #endif
    stbi s;
    huffman huff_dc[4];
    huffman huff_ac[4];
-   uint8 dequant[4][64];
+   unsigned short dequant[4][64];
 
 // sizes for components, interleaved MCUs
    int img_h_max, img_v_max;
@@ -870,12 +1101,12 @@ __forceinline static uint8 clamp(int x)
    t1 += p2+p4;                                \
    t0 += p1+p3;
 
-#if !STBI_SIMD
 // .344 seconds on 3*anemones.jpg
-static void idct_block(uint8 *out, int out_stride, short data[64], uint8 *dequantize)
+static void idct_block(uint8 *out, int out_stride, short data[64], unsigned short *dequantize)
 {
    int i,val[64],*v=val;
-   uint8 *o,*dq = dequantize;
+   uint8 *o;
+   unsigned short *dq = dequantize;
    short *d = data;
 
    // columns
@@ -923,66 +1154,212 @@ static void idct_block(uint8 *out, int out_stride, short data[64], uint8 *dequan
       o[4] = clamp((x3-t0) >> 17);
    }
 }
-#else
-static void idct_block(uint8 *out, int out_stride, short data[64], unsigned short *dequantize)
-{
-   int i,val[64],*v=val;
-   uint8 *o;
-   unsigned short *dq = dequantize;
-   short *d = data;
+#ifdef STBI_SSE2
+// the integer IDCT above with 8 columns, then 8 rows, in the lanes; the
+// results are identical. the column pass keeps 16 bits, the same as the
+// dequantized input, which valid data never exceeds.
+static void idct_sse2(uint8 *out, int out_stride, short data[64], unsigned short *dequantize)
+{
+   __m128i row0, row1, row2, row3, row4, row5, row6, row7;
+   __m128i tmp;
+
+   // dot product constant: even elems=x, odd elems=y
+   #define dct_const(x,y)  _mm_setr_epi16((x),(y),(x),(y),(x),(y),(x),(y))
+
+   // out(0) = c0[even]*x + c0[odd]*y   (c0, x, y 16-bit, out 32-bit)
+   // out(1) = c1[even]*x + c1[odd]*y
+   #define dct_rot(out0,out1, x,y,c0,c1) \
+      __m128i c0##lo = _mm_unpacklo_epi16((x),(y)); \
+      __m128i c0##hi = _mm_unpackhi_epi16((x),(y)); \
+      __m128i out0##_l = _mm_madd_epi16(c0##lo, c0); \
+      __m128i out0##_h = _mm_madd_epi16(c0##hi, c0); \
+      __m128i out1##_l = _mm_madd_epi16(c0##lo, c1); \
+      __m128i out1##_h = _mm_madd_epi16(c0##hi, c1)
+
+   // out = in << 12  (in 16-bit, out 32-bit)
+   #define dct_widen(out, in) \
+      __m128i out##_l = _mm_srai_epi32(_mm_unpacklo_epi16(_mm_setzero_si128(), (in)), 4); \
+      __m128i out##_h = _mm_srai_epi32(_mm_unpackhi_epi16(_mm_setzero_si128(), (in)), 4)
+
+   // wide add
+   #define dct_wadd(out, a, b) \
+      __m128i out##_l = _mm_add_epi32(a##_l, b##_l); \
+      __m128i out##_h = _mm_add_epi32(a##_h, b##_h)
+
+   // wide sub
+   #define dct_wsub(out, a, b) \
+      __m128i out##_l = _mm_sub_epi32(a##_l, b##_l); \
+      __m128i out##_h = _mm_sub_epi32(a##_h, b##_h)
+
+   // butterfly a/b, add bias, then shift by "s" and pack
+   #define dct_bfly32o(out0, out1, a,b,bias,s) \
+      { \
+         __m128i abiased_l = _mm_add_epi32(a##_l, bias); \
+         __m128i abiased_h = _mm_add_epi32(a##_h, bias); \
+         dct_wadd(sum, abiased, b); \
+         dct_wsub(dif, abiased, b); \
+         out0 = _mm_packs_epi32(_mm_srai_epi32(sum_l, s), _mm_srai_epi32(sum_h, s)); \
+         out1 = _mm_packs_epi32(_mm_srai_epi32(dif_l, s), _mm_srai_epi32(dif_h, s)); \
+      }
 
-   // columns
-   for (i=0; i < 8; ++i,++d,++dq, ++v) {
-      // if all zeroes, shortcut -- this avoids dequantizing 0s and IDCTing
-      if (d[ 8]==0 && d[16]==0 && d[24]==0 && d[32]==0
-           && d[40]==0 && d[48]==0 && d[56]==0) {
-         //    no shortcut                 0     seconds
-         //    (1|2|3|4|5|6|7)==0          0     seconds
-         //    all separate               -0.047 seconds
-         //    1 && 2|3 && 4|5 && 6|7:    -0.047 seconds
-         int dcterm = d[0] * dq[0] << 2;
-         v[0] = v[8] = v[16] = v[24] = v[32] = v[40] = v[48] = v[56] = dcterm;
-      } else {
-         IDCT_1D(d[ 0]*dq[ 0],d[ 8]*dq[ 8],d[16]*dq[16],d[24]*dq[24],
-                 d[32]*dq[32],d[40]*dq[40],d[48]*dq[48],d[56]*dq[56])
-         // constants scaled things up by 1<<12; let's bring them back
-         // down, but keep 2 extra bits of precision
-         x0 += 512; x1 += 512; x2 += 512; x3 += 512;
-         v[ 0] = (x0+t3) >> 10;
-         v[56] = (x0-t3) >> 10;
-         v[ 8] = (x1+t2) >> 10;
-         v[48] = (x1-t2) >> 10;
-         v[16] = (x2+t1) >> 10;
-         v[40] = (x2-t1) >> 10;
-         v[24] = (x3+t0) >> 10;
-         v[32] = (x3-t0) >> 10;
+   // 8-bit interleave step (for transposes)
+   #define dct_interleave8(a, b) \
+      tmp = a; \
+      a = _mm_unpacklo_epi8(a, b); \
+      b = _mm_unpackhi_epi8(tmp, b)
+
+   // 16-bit interleave step (for transposes)
+   #define dct_interleave16(a, b) \
+      tmp = a; \
+      a = _mm_unpacklo_epi16(a, b); \
+      b = _mm_unpackhi_epi16(tmp, b)
+
+   #define dct_pass(bias,shift) \
+      { \
+         /* even part */ \
+         dct_rot(t2e,t3e, row2,row6, rot0_0,rot0_1); \
+         __m128i sum04 = _mm_add_epi16(row0, row4); \
+         __m128i dif04 = _mm_sub_epi16(row0, row4); \
+         dct_widen(t0e, sum04); \
+         dct_widen(t1e, dif04); \
+         dct_wadd(x0, t0e, t3e); \
+         dct_wsub(x3, t0e, t3e); \
+         dct_wadd(x1, t1e, t2e); \
+         dct_wsub(x2, t1e, t2e); \
+         /* odd part */ \
+         dct_rot(y0o,y2o, row7,row3, rot2_0,rot2_1); \
+         dct_rot(y1o,y3o, row5,row1, rot3_0,rot3_1); \
+         __m128i sum17 = _mm_add_epi16(row1, row7); \
+         __m128i sum35 = _mm_add_epi16(row3, row5); \
+         dct_rot(y4o,y5o, sum17,sum35, rot1_0,rot1_1); \
+         dct_wadd(x4, y0o, y4o); \
+         dct_wadd(x5, y1o, y5o); \
+         dct_wadd(x6, y2o, y5o); \
+         dct_wadd(x7, y3o, y4o); \
+         dct_bfly32o(row0,row7, x0,x7,bias,shift); \
+         dct_bfly32o(row1,row6, x1,x6,bias,shift); \
+         dct_bfly32o(row2,row5, x2,x5,bias,shift); \
+         dct_bfly32o(row3,row4, x3,x4,bias,shift); \
       }
+
+   __m128i rot0_0 = dct_const(f2f(0.5411961f), f2f(0.5411961f) + f2f(-1.847759065f));
+   __m128i rot0_1 = dct_const(f2f(0.5411961f) + f2f( 0.765366865f), f2f(0.5411961f));
+   __m128i rot1_0 = dct_const(f2f(1.175875602f) + f2f(-0.899976223f), f2f(1.175875602f));
+   __m128i rot1_1 = dct_const(f2f(1.175875602f), f2f(1.175875602f) + f2f(-2.562915447f));
+   __m128i rot2_0 = dct_const(f2f(-1.961570560f) + f2f( 0.298631336f), f2f(-1.961570560f));
+   __m128i rot2_1 = dct_const(f2f(-1.961570560f), f2f(-1.961570560f) + f2f( 3.072711026f));
+   __m128i rot3_0 = dct_const(f2f(-0.390180644f) + f2f( 2.053119869f), f2f(-0.390180644f));
+   __m128i rot3_1 = dct_const(f2f(-0.390180644f), f2f(-0.390180644f) + f2f( 1.501321110f));
+
+   // the rounding of the two passes as in idct_block, the second one
+   // also moves the samples to 0..255 like clamp()
+   __m128i bias_0 = _mm_set1_epi32(512);
+   __m128i bias_1 = _mm_set1_epi32(65536 + (128<<17));
+
+   // load & dequantize
+   row0 = _mm_mullo_epi16(_mm_loadu_si128((const __m128i *) (data + 0*8)), _mm_loadu_si128((const __m128i *) (dequantize + 0*8)));
+   row1 = _mm_mullo_epi16(_mm_loadu_si128((const __m128i *) (data + 1*8)), _mm_loadu_si128((const __m128i *) (dequantize + 1*8)));
+   row2 = _mm_mullo_epi16(_mm_loadu_si128((const __m128i *) (data + 2*8)), _mm_loadu_si128((const __m128i *) (dequantize + 2*8)));
+   row3 = _mm_mullo_epi16(_mm_loadu_si128((const __m128i *) (data + 3*8)), _mm_loadu_si128((const __m128i *) (dequantize + 3*8)));
+   row4 = _mm_mullo_epi16(_mm_loadu_si128((const __m128i *) (data + 4*8)), _mm_loadu_si128((const __m128i *) (dequantize + 4*8)));
+   row5 = _mm_mullo_epi16(_mm_loadu_si128((const __m128i *) (data + 5*8)), _mm_loadu_si128((const __m128i *) (dequantize + 5*8)));
+   row6 = _mm_mullo_epi16(_mm_loadu_si128((const __m128i *) (data + 6*8)), _mm_loadu_si128((const __m128i *) (dequantize + 6*8)));
+   row7 = _mm_mullo_epi16(_mm_loadu_si128((const __m128i *) (data + 7*8)), _mm_loadu_si128((const __m128i *) (dequantize + 7*8)));
+
+   // column pass
+   dct_pass(bias_0, 10);
+
+   {
+      // 16bit 8x8 transpose pass 1
+      dct_interleave16(row0, row4);
+      dct_interleave16(row1, row5);
+      dct_interleave16(row2, row6);
+      dct_interleave16(row3, row7);
+
+      // transpose pass 2
+      dct_interleave16(row0, row2);
+      dct_interleave16(row1, row3);
+      dct_interleave16(row4, row6);
+      dct_interleave16(row5, row7);
+
+      // transpose pass 3
+      dct_interleave16(row0, row1);
+      dct_interleave16(row2, row3);
+      dct_interleave16(row4, row5);
+      dct_interleave16(row6, row7);
    }
 
-   for (i=0, v=val, o=out; i < 8; ++i,v+=8,o+=out_stride) {
-      // no fast case since the first 1D IDCT spread components out
-      IDCT_1D(v[0],v[1],v[2],v[3],v[4],v[5],v[6],v[7])
-      // constants scaled things up by 1<<12, plus we had 1<<2 from first
-      // loop, plus horizontal and vertical each scale by sqrt(8) so together
-      // we've got an extra 1<<3, so 1<<17 total we need to remove.
-      x0 += 65536; x1 += 65536; x2 += 65536; x3 += 65536;
-      o[0] = clamp((x0+t3) >> 17);
-      o[7] = clamp((x0-t3) >> 17);
-      o[1] = clamp((x1+t2) >> 17);
-      o[6] = clamp((x1-t2) >> 17);
-      o[2] = clamp((x2+t1) >> 17);
-      o[5] = clamp((x2-t1) >> 17);
-      o[3] = clamp((x3+t0) >> 17);
-      o[4] = clamp((x3-t0) >> 17);
+   // row pass
+   dct_pass(bias_1, 17);
+
+   {
+      // pack
+      __m128i p0 = _mm_packus_epi16(row0, row1); // a0a1a2a3...a7b0b1b2b3...b7
+      __m128i p1 = _mm_packus_epi16(row2, row3);
+      __m128i p2 = _mm_packus_epi16(row4, row5);
+      __m128i p3 = _mm_packus_epi16(row6, row7);
+
+      // 8bit 8x8 transpose pass 1
+      dct_interleave8(p0, p2); // a0e0a1e1...
+      dct_interleave8(p1, p3); // c0g0c1g1...
+
+      // transpose pass 2
+      dct_interleave8(p0, p1); // a0c0e0g0...
+      dct_interleave8(p2, p3); // b0d0f0h0...
+
+      // transpose pass 3
+      dct_interleave8(p0, p2); // a0b0c0d0...
+      dct_interleave8(p1, p3); // a4b4c4d4...
+
+      // store
+      _mm_storel_epi64((__m128i *) out, p0); out += out_stride;
+      _mm_storel_epi64((__m128i *) out, _mm_shuffle_epi32(p0, 0x4e)); out += out_stride;
+      _mm_storel_epi64((__m128i *) out, p2); out += out_stride;
+      _mm_storel_epi64((__m128i *) out, _mm_shuffle_epi32(p2, 0x4e)); out += out_stride;
+      _mm_storel_epi64((__m128i *) out, p1); out += out_stride;
+      _mm_storel_epi64((__m128i *) out, _mm_shuffle_epi32(p1, 0x4e)); out += out_stride;
+      _mm_storel_epi64((__m128i *) out, p3); out += out_stride;
+      _mm_storel_epi64((__m128i *) out, _mm_shuffle_epi32(p3, 0x4e));
    }
+
+   #undef dct_const
+   #undef dct_rot
+   #undef dct_widen
+   #undef dct_wadd
+   #undef dct_wsub
+   #undef dct_bfly32o
+   #undef dct_interleave8
+   #undef dct_interleave16
+   #undef dct_pass
 }
-static stbi_idct_8x8 stbi_idct_installed = idct_block;
+#endif // STBI_SSE2
+
+// the SIMD kernels of the decoder, on by default; off runs the scalar
+// reference code
+static int jpeg_simd = 1;
+
+void stbi_jpeg_simd(int flag_true_if_should_use_simd)
+{
+   jpeg_simd = flag_true_if_should_use_simd;
+}
+
+// the hooks are shared by all threads, install them before decoding.
+// NULL selects the built in code again.
+static stbi_idct_8x8 stbi_idct_installed = NULL;
 
 extern void stbi_install_idct(stbi_idct_8x8 func)
 {
    stbi_idct_installed = func;
 }
-#endif
+
+static stbi_idct_8x8 jpeg_idct(void)
+{
+   if (stbi_idct_installed) return stbi_idct_installed;
+   #ifdef STBI_SSE2
+   if (jpeg_simd) return idct_sse2;
+   #endif
+   return idct_block;
+}
 
 #define MARKER_none  0xff
 // if there's a pending marker from the entropy stream, return that
@@ -1017,14 +1394,22 @@ static void reset(jpeg *j)
    // since we don't even allow 1<<30 pixels
 }
 
-static int parse_entropy_coded_data(jpeg *z)
+// the MCUs of the scan in raster order; with a single component every
+// block is an MCU
+static int scan_mcu_count(jpeg *z)
 {
-   reset(z);
    if (z->scan_n == 1) {
-      int i,j;
-      #if STBI_SIMD
-      __declspec(align(16))
-      #endif
+      int n = z->order[0];
+      return ((z->img_comp[n].x+7) >> 3) * ((z->img_comp[n].y+7) >> 3);
+   }
+   return z->img_mcu_x * z->img_mcu_y;
+}
+
+// decode MCUs first .. end-1 of the scan from the stream position of z
+static int decode_mcus(jpeg *z, stbi_idct_8x8 idct, int first, int end)
+{
+   int m;
+   if (z->scan_n == 1) {
       short data[64];
       int n = z->order[0];
       // non-interleaved data, we just need to process one block at a time,
@@ -1032,63 +1417,159 @@ static int parse_entropy_coded_data(jpeg *z)
       // number of blocks to do just depends on how many actual "pixels" this
       // component has, independent of interleaved MCU blocking and such
       int w = (z->img_comp[n].x+7) >> 3;
-      int h = (z->img_comp[n].y+7) >> 3;
-      for (j=0; j < h; ++j) {
-         for (i=0; i < w; ++i) {
-            if (!decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+z->img_comp[n].ha, n)) return 0;
-            #if STBI_SIMD
-            stbi_idct_installed(z->img_comp[n].data+z->img_comp[n].w2*j*8+i*8, z->img_comp[n].w2, data, z->dequant2[z->img_comp[n].tq]);
-            #else
-            idct_block(z->img_comp[n].data+z->img_comp[n].w2*j*8+i*8, z->img_comp[n].w2, data, z->dequant[z->img_comp[n].tq]);
-            #endif
-            // every data block is an MCU, so countdown the restart interval
-            if (--z->todo <= 0) {
-               if (z->code_bits < 24) grow_buffer_unsafe(z);
-               // if it's NOT a restart, then just bail, so we get corrupt data
-               // rather than no data
-               if (!RESTART(z->marker)) return 1;
-               reset(z);
-            }
+      for (m=first; m < end; ++m) {
+         int i = m % w, j = m / w;
+         if (!decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+z->img_comp[n].ha, n)) return 0;
+         idct(z->img_comp[n].data+z->img_comp[n].w2*j*8+i*8, z->img_comp[n].w2, data, z->dequant[z->img_comp[n].tq]);
+         // every data block is an MCU, so countdown the restart interval
+         if (--z->todo <= 0) {
+            if (z->code_bits < 24) grow_buffer_unsafe(z);
+            // if it's NOT a restart, then just bail, so we get corrupt data
+            // rather than no data
+            if (!RESTART(z->marker)) return 1;
+            reset(z);
          }
       }
    } else { // interleaved!
-      int i,j,k,x,y;
+      int k,x,y;
       short data[64];
-      for (j=0; j < z->img_mcu_y; ++j) {
-         for (i=0; i < z->img_mcu_x; ++i) {
-            // scan an interleaved mcu... process scan_n components in order
-            for (k=0; k < z->scan_n; ++k) {
-               int n = z->order[k];
-               // scan out an mcu's worth of this component; that's just determined
-               // by the basic H and V specified for the component
-               for (y=0; y < z->img_comp[n].v; ++y) {
-                  for (x=0; x < z->img_comp[n].h; ++x) {
-                     int x2 = (i*z->img_comp[n].h + x)*8;
-                     int y2 = (j*z->img_comp[n].v + y)*8;
-                     if (!decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+z->img_comp[n].ha, n)) return 0;
-                     #if STBI_SIMD
-                     stbi_idct_installed(z->img_comp[n].data+z->img_comp[n].w2*y2+x2, z->img_comp[n].w2, data, z->dequant2[z->img_comp[n].tq]);
-                     #else
-                     idct_block(z->img_comp[n].data+z->img_comp[n].w2*y2+x2, z->img_comp[n].w2, data, z->dequant[z->img_comp[n].tq]);
-                     #endif
-                  }
+      for (m=first; m < end; ++m) {
+         int i = m % z->img_mcu_x, j = m / z->img_mcu_x;
+         // scan an interleaved mcu... process scan_n components in order
+         for (k=0; k < z->scan_n; ++k) {
+            int n = z->order[k];
+            // scan out an mcu's worth of this component; that's just determined
+            // by the basic H and V specified for the component
+            for (y=0; y < z->img_comp[n].v; ++y) {
+               for (x=0; x < z->img_comp[n].h; ++x) {
+                  int x2 = (i*z->img_comp[n].h + x)*8;
+                  int y2 = (j*z->img_comp[n].v + y)*8;
+                  if (!decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+z->img_comp[n].ha, n)) return 0;
+                  idct(z->img_comp[n].data+z->img_comp[n].w2*y2+x2, z->img_comp[n].w2, data, z->dequant[z->img_comp[n].tq]);
                }
             }
-            // after all interleaved components, that's an interleaved MCU,
-            // so now count down the restart interval
-            if (--z->todo <= 0) {
-               if (z->code_bits < 24) grow_buffer_unsafe(z);
-               // if it's NOT a restart, then just bail, so we get corrupt data
-               // rather than no data
-               if (!RESTART(z->marker)) return 1;
-               reset(z);
-            }
+         }
+         // after all interleaved components, that's an interleaved MCU,
+         // so now count down the restart interval
+         if (--z->todo <= 0) {
+            if (z->code_bits < 24) grow_buffer_unsafe(z);
+            // if it's NOT a restart, then just bail, so we get corrupt data
+            // rather than no data
+            if (!RESTART(z->marker)) return 1;
+            reset(z);
          }
       }
    }
    return 1;
 }
 
+// parallel decode: a restart marker resets the entropy decoder and the dc
+// prediction, so the restart intervals of a scan in memory decode
+// independently. every job takes a run of neighbouring intervals with a
+// copy of the decoder, the last one uses z itself so the stream is left
+// where the serial decode leaves it.
+void stbi_jpeg_parallel_for(stbi_parallel_for func, void *context)
+{
+   stbi_ctx.jpeg_parallel_for = func;
+   stbi_ctx.jpeg_parallel_context = context;
+}
+
+#define JPEG_PARALLEL_MCUS   256   // fewest MCUs worth a job
+#define JPEG_PARALLEL_JOBS   64
+
+typedef struct
+{
+   jpeg *z;
+   jpeg *copies;               // the decoders of jobs 0 .. jobs-2
+   stbi_idct_8x8 idct;
+   int mcus, intervals, jobs;
+   uint8 *start[JPEG_PARALLEL_JOBS];  // stream position of each job
+   int ok[JPEG_PARALLEL_JOBS];
+} jpeg_parallel;
+
+// the first restart interval of job t, no overflow with less than 1<<30
+// pixels
+static int job_interval(jpeg_parallel *p, int t)
+{
+   return p->intervals * t / p->jobs;
+}
+
+static void decode_intervals_job(void *arg, int t)
+{
+   jpeg_parallel *p = (jpeg_parallel *) arg;
+   jpeg *j = t == p->jobs-1 ? p->z : &p->copies[t];
+   int first = job_interval(p, t) * p->z->restart_interval;
+   int end = t == p->jobs-1 ? p->mcus : job_interval(p, t+1) * p->z->restart_interval;
+   j->s.img_buffer = p->start[t];
+   reset(j);
+   p->ok[t] = decode_mcus(j, p->idct, first, end);
+   // a job before the last must have stopped at the restart marker the next
+   // one starts after, otherwise the serial decode would not have
+   if (t < p->jobs-1 && (j->s.img_buffer != p->start[t+1] || j->marker != MARKER_none))
+      p->ok[t] = 0;
+}
+
+// finds the restart markers the jobs start after, reading the bytes the
+// way grow_buffer_unsafe does. 0 if another marker or the end of the data
+// comes first
+static int find_restarts(jpeg_parallel *p)
+{
+   uint8 *c = p->z->s.img_buffer, *end = p->z->s.img_buffer_end;
+   int found = 0, t = 1;
+   p->start[0] = c;
+   while (t < p->jobs) {
+      c = (uint8 *) memchr(c, 0xff, end - c);
+      if (c == NULL || end - c < 2) return 0;
+      if (c[1] == 0) { c += 2; continue; }
+      if (!RESTART(c[1])) return 0;
+      c += 2;
+      if (++found == job_interval(p, t))
+         p->start[t++] = c;
+   }
+   return 1;
+}
+
+// 1 if the scan was decoded on several threads with the same result the
+// serial decode has, 0 leaves it to the serial decode
+static int decode_intervals_parallel(jpeg *z, stbi_idct_8x8 idct, int mcus)
+{
+   jpeg_parallel p;
+   int t, ok = 1;
+   stbi_parallel_for parallel_for = stbi_ctx.jpeg_parallel_for;
+   void *parallel_context = stbi_ctx.jpeg_parallel_context;
+   #ifndef STBI_NO_STDIO
+   if (z->s.img_file) return 0;
+   #endif
+   if (!parallel_for || !z->restart_interval) return 0;
+   p.z = z;
+   p.idct = idct;
+   p.mcus = mcus;
+   p.intervals = (mcus + z->restart_interval-1) / z->restart_interval;
+   p.jobs = mcus / JPEG_PARALLEL_MCUS;
+   if (p.jobs > p.intervals) p.jobs = p.intervals;
+   if (p.jobs > JPEG_PARALLEL_JOBS) p.jobs = JPEG_PARALLEL_JOBS;
+   if (p.jobs < 2 || !find_restarts(&p)) return 0;
+   p.copies = (jpeg *) malloc(sizeof(jpeg) * (p.jobs-1));
+   if (!p.copies) return 0;
+   for (t=0; t < p.jobs-1; ++t)
+      p.copies[t] = *z;
+   parallel_for(parallel_context, p.jobs, decode_intervals_job, &p);
+   free(p.copies);
+   for (t=0; t < p.jobs; ++t)
+      ok &= p.ok[t];
+   if (!ok) z->s.img_buffer = p.start[0];
+   return ok;
+}
+
+static int parse_entropy_coded_data(jpeg *z)
+{
+   stbi_idct_8x8 idct = jpeg_idct();
+   int mcus = scan_mcu_count(z);
+   if (decode_intervals_parallel(z, idct, mcus)) return 1;
+   reset(z);
+   return decode_mcus(z, idct, 0, mcus);
+}
+
 static int process_marker(jpeg *z, int m)
 {
    int L;
@@ -1114,10 +1595,6 @@ static int process_marker(jpeg *z, int m)
             if (t > 3) return e("bad DQT table","Corrupt JPEG");
             for (i=0; i < 64; ++i)
                z->dequant[t][dezigzag[i]] = get8u(&z->s);
-            #if STBI_SIMD
-            for (i=0; i < 64; ++i)
-               z->dequant2[t][i] = dequant[t][i];
-            #endif
             L -= 65;
          }
          return L==0;
@@ -1239,12 +1716,10 @@ static int process_frame_header(jpeg *z, int scan)
       // discard the extra data until colorspace conversion
       z->img_comp[i].w2 = z->img_mcu_x * z->img_comp[i].h * 8;
       z->img_comp[i].h2 = z->img_mcu_y * z->img_comp[i].v * 8;
-      z->img_comp[i].raw_data = malloc(z->img_comp[i].w2 * z->img_comp[i].h2+15);
+      z->img_comp[i].raw_data = scratch_get(SCRATCH_plane + i, z->img_comp[i].w2 * z->img_comp[i].h2+15);
       if (z->img_comp[i].raw_data == NULL) {
-         for(--i; i >= 0; --i) {
-            free(z->img_comp[i].raw_data);
+         for(--i; i >= 0; --i)
             z->img_comp[i].data = NULL;
-         }
          return e("outofmem", "Out of memory");
       }
       // align blocks for installable-idct using mmx/sse
@@ -1378,11 +1853,114 @@ static uint8 *resample_row_generic(uint8 *out, uint8 *in_near, uint8 *in_far, in
    return out;
 }
 
+#ifdef STBI_SSE2
+// SIMD versions of the 2x upsamplers above, same rounding & the same edge
+// samples, those are left to scalar code.
+static uint8 *resample_row_v_2_sse2(uint8 *out, uint8 *in_near, uint8 *in_far, int w, int hs)
+{
+   int i;
+   __m128i zero = _mm_setzero_si128();
+   __m128i bias = _mm_set1_epi16(2);
+   for (i=0; i+16 <= w; i += 16) {
+      __m128i n = _mm_loadu_si128((const __m128i *) (in_near + i));
+      __m128i f = _mm_loadu_si128((const __m128i *) (in_far + i));
+      __m128i nl = _mm_unpacklo_epi8(n, zero), nh = _mm_unpackhi_epi8(n, zero);
+      __m128i fl = _mm_unpacklo_epi8(f, zero), fh = _mm_unpackhi_epi8(f, zero);
+      // 3*near + far + 2
+      __m128i l = _mm_add_epi16(_mm_add_epi16(_mm_add_epi16(nl, nl), nl), _mm_add_epi16(fl, bias));
+      __m128i h = _mm_add_epi16(_mm_add_epi16(_mm_add_epi16(nh, nh), nh), _mm_add_epi16(fh, bias));
+      _mm_storeu_si128((__m128i *) (out + i), _mm_packus_epi16(_mm_srli_epi16(l, 2), _mm_srli_epi16(h, 2)));
+   }
+   for (; i < w; ++i)
+      out[i] = div4(3*in_near[i] + in_far[i] + 2);
+   return out;
+}
+
+// 8 input samples a, b, c widened to 16 bits, 3*b + a + bias, then
+// shifted down by s & interleaved with 3*b + c + bias
+#define resample_pairs(out, a, b, c, bias, s) \
+   { \
+      __m128i b3 = _mm_add_epi16(_mm_add_epi16(b, b), _mm_add_epi16(b, bias)); \
+      __m128i even = _mm_srli_epi16(_mm_add_epi16(b3, a), s); \
+      __m128i odd  = _mm_srli_epi16(_mm_add_epi16(b3, c), s); \
+      _mm_storeu_si128((__m128i *) (out), _mm_or_si128(even, _mm_slli_epi16(odd, 8))); \
+   }
+
+static uint8*  resample_row_h_2_sse2(uint8 *out, uint8 *in_near, uint8 *in_far, int w, int hs)
+{
+   int i;
+   uint8 *input = in_near;
+   __m128i zero = _mm_setzero_si128();
+   __m128i bias = _mm_set1_epi16(2);
+   if (w == 1) {
+      out[0] = out[1] = input[0];
+      return out;
+   }
+
+   out[0] = input[0];
+   out[1] = div4(input[0]*3 + input[1] + 2);
+   // input[i-1 .. i+8] are read
+   for (i=1; i+8 < w; i += 8) {
+      __m128i a = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) (input + i-1)), zero);
+      __m128i b = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) (input + i  )), zero);
+      __m128i c = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) (input + i+1)), zero);
+      resample_pairs(out + i*2, a, b, c, bias, 2);
+   }
+   for (; i < w-1; ++i) {
+      int n = 3*input[i]+2;
+      out[i*2+0] = div4(n+input[i-1]);
+      out[i*2+1] = div4(n+input[i+1]);
+   }
+   out[i*2+0] = div4(input[w-2]*3 + input[w-1] + 2);
+   out[i*2+1] = input[w-1];
+   return out;
+}
+
+static uint8 *resample_row_hv_2_sse2(uint8 *out, uint8 *in_near, uint8 *in_far, int w, int hs)
+{
+   int i,t0,t1;
+   __m128i zero = _mm_setzero_si128();
+   __m128i bias = _mm_set1_epi16(8);
+   if (w == 1) {
+      out[0] = out[1] = div4(3*in_near[0] + in_far[0] + 2);
+      return out;
+   }
+
+   out[0] = div4(3*in_near[0] + in_far[0] + 2);
+   out[1] = div16(3*(3*in_near[0] + in_far[0]) + 3*in_near[1] + in_far[1] + 8);
+   // the vertical sums 3*near + far of columns i-1 .. i+8
+   for (i=1; i+8 < w; i += 8) {
+      __m128i n, f, a, b, c;
+      n = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) (in_near + i-1)), zero);
+      f = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) (in_far  + i-1)), zero);
+      a = _mm_add_epi16(_mm_add_epi16(_mm_add_epi16(n, n), n), f);
+      n = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) (in_near + i  )), zero);
+      f = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) (in_far  + i  )), zero);
+      b = _mm_add_epi16(_mm_add_epi16(_mm_add_epi16(n, n), n), f);
+      n = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) (in_near + i+1)), zero);
+      f = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) (in_far  + i+1)), zero);
+      c = _mm_add_epi16(_mm_add_epi16(_mm_add_epi16(n, n), n), f);
+      resample_pairs(out + i*2, a, b, c, bias, 4);
+   }
+   // the scalar loop writes out[i*2-1] again, with the same value
+   t1 = 3*in_near[i-1] + in_far[i-1];
+   for (; i < w; ++i) {
+      t0 = t1;
+      t1 = 3*in_near[i]+in_far[i];
+      out[i*2-1] = div16(3*t0 + t1 + 8);
+      out[i*2  ] = div16(3*t1 + t0 + 8);
+   }
+   out[w*2-1] = div4(t1+2);
+   return out;
+}
+#undef resample_pairs
+#endif // STBI_SSE2
+
 #define float2fixed(x)  ((int) ((x) * 65536 + 0.5))
 
 // 0.38 seconds on 3*anemones.jpg   (0.25 with processor = Pro)
 // VC6 without processor=Pro is generating multiple LEAs per multiply!
-static void YCbCr_to_RGB_row(uint8 *out, uint8 *y, uint8 *pcb, uint8 *pcr, int count, int step)
+static void YCbCr_to_RGB_row(uint8 *out, uint8 const *y, uint8 const *pcb, uint8 const *pcr, int count, int step)
 {
    int i;
    for (i=0; i < count; ++i) {
@@ -1407,29 +1985,165 @@ static void YCbCr_to_RGB_row(uint8 *out, uint8 *y, uint8 *pcb, uint8 *pcr, int c
    }
 }
 
-#if STBI_SIMD
-static stbi_YCbCr_to_RGB_run stbi_YCbCr_installed = YCbCr_to_RGB_row;
+#ifdef STBI_SSE2
+// YCbCr_to_RGB_row with the same 16.16 fixed point math, 8 pixels at a time
+// (16 with AVX2, chosen at run time). the products are pairs of 16 bit
+// multiplies, e.g. cr*91881 is 4*cr*22970 + cr*1. 3 byte pixels are
+// stored as 4 bytes that overlap, so the last one spills a byte like the
+// scalar code does.
+#define YCC_R_COEFFS   float2fixed(1.40200f) >> 2, float2fixed(1.40200f) & 3
+#define YCC_GR_COEFFS  -(float2fixed(0.71414f) >> 2), -(float2fixed(0.71414f) & 3)
+#define YCC_GB_COEFFS  -(float2fixed(0.34414f) >> 2), -(float2fixed(0.34414f) & 3)
+#define YCC_B_COEFFS   float2fixed(1.77200f) >> 2, float2fixed(1.77200f) & 3
+
+// 4 RGBA pixels in 'px' to 3 byte pixels
+static void YCbCr_store_rgb_sse2(uint8 *out, __m128i px)
+{
+   int i, v;
+   for (i=0; i < 4; ++i) {
+      v = _mm_cvtsi128_si32(px);
+      memcpy(out + i*3, &v, 4);
+      px = _mm_srli_si128(px, 4);
+   }
+}
+
+static void YCbCr_to_RGB_sse2(uint8 *out, uint8 const *y, uint8 const *pcb, uint8 const *pcr, int count, int step)
+{
+   int i;
+   __m128i zero = _mm_setzero_si128();
+   __m128i bias = _mm_set1_epi16(128);
+   __m128i half = _mm_set1_epi16((short) 0x8000);
+   __m128i cr_r = _mm_setr_epi16(YCC_R_COEFFS, YCC_R_COEFFS, YCC_R_COEFFS, YCC_R_COEFFS);
+   __m128i cr_g = _mm_setr_epi16(YCC_GR_COEFFS, YCC_GR_COEFFS, YCC_GR_COEFFS, YCC_GR_COEFFS);
+   __m128i cb_g = _mm_setr_epi16(YCC_GB_COEFFS, YCC_GB_COEFFS, YCC_GB_COEFFS, YCC_GB_COEFFS);
+   __m128i cb_b = _mm_setr_epi16(YCC_B_COEFFS, YCC_B_COEFFS, YCC_B_COEFFS, YCC_B_COEFFS);
+   __m128i limit = _mm_set1_epi16(255);
+   __m128i alpha = _mm_set1_epi16((short) 0xff00);
+   for (i=0; i+8 <= count; i += 8) {
+      __m128i y16 = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) (y + i)), zero);
+      __m128i cb = _mm_sub_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) (pcb + i)), zero), bias);
+      __m128i cr = _mm_sub_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *) (pcr + i)), zero), bias);
+      __m128i cb4 = _mm_slli_epi16(cb, 2), cr4 = _mm_slli_epi16(cr, 2);
+      // (4*c, c) pairs & (y << 16) + 32768
+      __m128i crl = _mm_unpacklo_epi16(cr4, cr), crh = _mm_unpackhi_epi16(cr4, cr);
+      __m128i cbl = _mm_unpacklo_epi16(cb4, cb), cbh = _mm_unpackhi_epi16(cb4, cb);
+      __m128i yl = _mm_unpacklo_epi16(half, y16), yh = _mm_unpackhi_epi16(half, y16);
+      __m128i r, g, b, rg, ba;
+      r = _mm_packs_epi32(_mm_srai_epi32(_mm_add_epi32(yl, _mm_madd_epi16(crl, cr_r)), 16),
+                          _mm_srai_epi32(_mm_add_epi32(yh, _mm_madd_epi16(crh, cr_r)), 16));
+      g = _mm_packs_epi32(_mm_srai_epi32(_mm_add_epi32(_mm_add_epi32(yl, _mm_madd_epi16(crl, cr_g)), _mm_madd_epi16(cbl, cb_g)), 16),
+                          _mm_srai_epi32(_mm_add_epi32(_mm_add_epi32(yh, _mm_madd_epi16(crh, cr_g)), _mm_madd_epi16(cbh, cb_g)), 16));
+      b = _mm_packs_epi32(_mm_srai_epi32(_mm_add_epi32(yl, _mm_madd_epi16(cbl, cb_b)), 16),
+                          _mm_srai_epi32(_mm_add_epi32(yh, _mm_madd_epi16(cbh, cb_b)), 16));
+      r = _mm_min_epi16(_mm_max_epi16(r, zero), limit);
+      g = _mm_min_epi16(_mm_max_epi16(g, zero), limit);
+      b = _mm_min_epi16(_mm_max_epi16(b, zero), limit);
+      rg = _mm_or_si128(r, _mm_slli_epi16(g, 8));
+      ba = _mm_or_si128(b, alpha);
+      if (step == 4) {
+         _mm_storeu_si128((__m128i *) out, _mm_unpacklo_epi16(rg, ba));
+         _mm_storeu_si128((__m128i *) (out + 16), _mm_unpackhi_epi16(rg, ba));
+      } else {
+         YCbCr_store_rgb_sse2(out, _mm_unpacklo_epi16(rg, ba));
+         YCbCr_store_rgb_sse2(out + 12, _mm_unpackhi_epi16(rg, ba));
+      }
+      out += 8*step;
+   }
+   YCbCr_to_RGB_row(out, y+i, pcb+i, pcr+i, count-i, step);
+}
+
+#ifdef STBI_AVX2
+STBI_TARGET_AVX2
+static void YCbCr_to_RGB_avx2(uint8 *out, uint8 const *y, uint8 const *pcb, uint8 const *pcr, int count, int step)
+{
+   int i;
+   __m256i zero = _mm256_setzero_si256();
+   __m256i bias = _mm256_set1_epi16(128);
+   __m256i half = _mm256_set1_epi16((short) 0x8000);
+   __m256i cr_r = _mm256_setr_epi16(YCC_R_COEFFS, YCC_R_COEFFS, YCC_R_COEFFS, YCC_R_COEFFS, YCC_R_COEFFS, YCC_R_COEFFS, YCC_R_COEFFS, YCC_R_COEFFS);
+   __m256i cr_g = _mm256_setr_epi16(YCC_GR_COEFFS, YCC_GR_COEFFS, YCC_GR_COEFFS, YCC_GR_COEFFS, YCC_GR_COEFFS, YCC_GR_COEFFS, YCC_GR_COEFFS, YCC_GR_COEFFS);
+   __m256i cb_g = _mm256_setr_epi16(YCC_GB_COEFFS, YCC_GB_COEFFS, YCC_GB_COEFFS, YCC_GB_COEFFS, YCC_GB_COEFFS, YCC_GB_COEFFS, YCC_GB_COEFFS, YCC_GB_COEFFS);
+   __m256i cb_b = _mm256_setr_epi16(YCC_B_COEFFS, YCC_B_COEFFS, YCC_B_COEFFS, YCC_B_COEFFS, YCC_B_COEFFS, YCC_B_COEFFS, YCC_B_COEFFS, YCC_B_COEFFS);
+   __m256i limit = _mm256_set1_epi16(255);
+   __m256i alpha = _mm256_set1_epi16((short) 0xff00);
+   for (i=0; i+16 <= count; i += 16) {
+      // pixels 0..7 in the low lane, 8..15 in the high one; the unpacks
+      // work within the lanes & the packs put the pixels back in order
+      __m256i y16 = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *) (y + i)));
+      __m256i cb = _mm256_sub_epi16(_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *) (pcb + i))), bias);
+      __m256i cr = _mm256_sub_epi16(_mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *) (pcr + i))), bias);
+      __m256i cb4 = _mm256_slli_epi16(cb, 2), cr4 = _mm256_slli_epi16(cr, 2);
+      __m256i crl = _mm256_unpacklo_epi16(cr4, cr), crh = _mm256_unpackhi_epi16(cr4, cr);
+      __m256i cbl = _mm256_unpacklo_epi16(cb4, cb), cbh = _mm256_unpackhi_epi16(cb4, cb);
+      __m256i yl = _mm256_unpacklo_epi16(half, y16), yh = _mm256_unpackhi_epi16(half, y16);
+      __m256i r, g, b, rg, ba, lo, hi;
+      r = _mm256_packs_epi32(_mm256_srai_epi32(_mm256_add_epi32(yl, _mm256_madd_epi16(crl, cr_r)), 16),
+                             _mm256_srai_epi32(_mm256_add_epi32(yh, _mm256_madd_epi16(crh, cr_r)), 16));
+      g = _mm256_packs_epi32(_mm256_srai_epi32(_mm256_add_epi32(_mm256_add_epi32(yl, _mm256_madd_epi16(crl, cr_g)), _mm256_madd_epi16(cbl, cb_g)), 16),
+                             _mm256_srai_epi32(_mm256_add_epi32(_mm256_add_epi32(yh, _mm256_madd_epi16(crh, cr_g)), _mm256_madd_epi16(cbh, cb_g)), 16));
+      b = _mm256_packs_epi32(_mm256_srai_epi32(_mm256_add_epi32(yl, _mm256_madd_epi16(cbl, cb_b)), 16),
+                             _mm256_srai_epi32(_mm256_add_epi32(yh, _mm256_madd_epi16(cbh, cb_b)), 16));
+      r = _mm256_min_epi16(_mm256_max_epi16(r, zero), limit);
+      g = _mm256_min_epi16(_mm256_max_epi16(g, zero), limit);
+      b = _mm256_min_epi16(_mm256_max_epi16(b, zero), limit);
+      rg = _mm256_or_si256(r, _mm256_slli_epi16(g, 8));
+      ba = _mm256_or_si256(b, alpha);
+      // pixels 0..3 & 8..11, 4..7 & 12..15
+      lo = _mm256_unpacklo_epi16(rg, ba);
+      hi = _mm256_unpackhi_epi16(rg, ba);
+      if (step == 4) {
+         _mm256_storeu_si256((__m256i *) out, _mm256_permute2x128_si256(lo, hi, 0x20));
+         _mm256_storeu_si256((__m256i *) (out + 32), _mm256_permute2x128_si256(lo, hi, 0x31));
+      } else {
+         YCbCr_store_rgb_sse2(out,      _mm256_castsi256_si128(lo));
+         YCbCr_store_rgb_sse2(out + 12, _mm256_castsi256_si128(hi));
+         YCbCr_store_rgb_sse2(out + 24, _mm256_extracti128_si256(lo, 1));
+         YCbCr_store_rgb_sse2(out + 36, _mm256_extracti128_si256(hi, 1));
+      }
+      out += 16*step;
+   }
+   YCbCr_to_RGB_sse2(out, y+i, pcb+i, pcr+i, count-i, step);
+}
+#endif // STBI_AVX2
+
+#undef YCC_R_COEFFS
+#undef YCC_GR_COEFFS
+#undef YCC_GB_COEFFS
+#undef YCC_B_COEFFS
+#endif // STBI_SSE2
+
+// NULL selects the built in code again
+static stbi_YCbCr_to_RGB_run stbi_YCbCr_installed = NULL;
 
 void stbi_install_YCbCr_to_RGB(stbi_YCbCr_to_RGB_run func)
 {
    stbi_YCbCr_installed = func;
 }
-#endif
+
+static stbi_YCbCr_to_RGB_run jpeg_YCbCr_to_RGB(void)
+{
+   if (stbi_YCbCr_installed) return stbi_YCbCr_installed;
+   #ifdef STBI_SSE2
+   if (jpeg_simd) {
+      #ifdef STBI_AVX2
+      if (has_avx2()) return YCbCr_to_RGB_avx2;
+      #endif
+      return YCbCr_to_RGB_sse2;
+   }
+   #endif
+   return YCbCr_to_RGB_row;
+}
 
 
-// clean up the temporary component buffers
+// let go of the temporary component buffers, they are scratch buffers
+// the next image reuses
 static void cleanup_jpeg(jpeg *j)
 {
    int i;
    for (i=0; i < j->s.img_n; ++i) {
-      if (j->img_comp[i].data) {
-         free(j->img_comp[i].raw_data);
-         j->img_comp[i].data = NULL;
-      }
-      if (j->img_comp[i].linebuf) {
-         free(j->img_comp[i].linebuf);
-         j->img_comp[i].linebuf = NULL;
-      }
+      j->img_comp[i].raw_data = NULL;
+      j->img_comp[i].data = NULL;
+      j->img_comp[i].linebuf = NULL;
    }
 }
 
@@ -1466,7 +2180,9 @@ static uint8 *load_jpeg_image(jpeg *z, int *out_x, int *out_y, int *comp, int re
       int k;
       uint i,j;
       uint8 *output;
+      uint output_stride;
       uint8 *coutput[4];
+      stbi_YCbCr_to_RGB_run YCbCr_to_RGB = jpeg_YCbCr_to_RGB();
 
       stbi_resample res_comp[4];
 
@@ -1475,7 +2191,7 @@ static uint8 *load_jpeg_image(jpeg *z, int *out_x, int *out_y, int *comp, int re
 
          // allocate line buffer big enough for upsampling off the edges
          // with upsample factor of 4
-         z->img_comp[k].linebuf = (uint8 *) malloc(z->s.img_x + 3);
+         z->img_comp[k].linebuf = scratch_get(SCRATCH_line + k, z->s.img_x + 3);
          if (!z->img_comp[k].linebuf) { cleanup_jpeg(z); return epuc("outofmem", "Out of memory"); }
 
          r->hs      = z->img_h_max / z->img_comp[k].h;
@@ -1490,15 +2206,30 @@ static uint8 *load_jpeg_image(jpeg *z, int *out_x, int *out_y, int *comp, int re
          else if (r->hs == 2 && r->vs == 1) r->resample = resample_row_h_2;
          else if (r->hs == 2 && r->vs == 2) r->resample = resample_row_hv_2;
          else                               r->resample = resample_row_generic;
+         #ifdef STBI_SSE2
+         if (jpeg_simd) {
+            if      (r->resample == resample_row_v_2)  r->resample = resample_row_v_2_sse2;
+            else if (r->resample == resample_row_h_2)  r->resample = resample_row_h_2_sse2;
+            else if (r->resample == resample_row_hv_2) r->resample = resample_row_hv_2_sse2;
+         }
+         #endif
       }
 
       // can't error after this so, this is safe
-      output = (uint8 *) malloc(n * z->s.img_x * z->s.img_y + 1);
-      if (!output) { cleanup_jpeg(z); return epuc("outofmem", "Out of memory"); }
+      if (z->s.dest) {
+         // the rows go straight to the destination
+         if (!check_dest_size(&z->s)) { cleanup_jpeg(z); return NULL; }
+         output = z->s.dest;
+         output_stride = z->s.dest_stride;
+      } else {
+         output = (uint8 *) malloc(n * z->s.img_x * z->s.img_y + 1);
+         if (!output) { cleanup_jpeg(z); return epuc("outofmem", "Out of memory"); }
+         output_stride = n * z->s.img_x;
+      }
 
       // now go ahead and resample
       for (j=0; j < z->s.img_y; ++j) {
-         uint8 *out = output + n * z->s.img_x * j;
+         uint8 *out = output + output_stride * j;
          for (k=0; k < decode_n; ++k) {
             stbi_resample *r = &res_comp[k];
             int y_bot = r->ystep >= (r->vs >> 1);
@@ -1515,18 +2246,26 @@ static uint8 *load_jpeg_image(jpeg *z, int *out_x, int *out_y, int *comp, int re
          }
          if (n >= 3) {
             uint8 *y = coutput[0];
+            // 3 component pixels are stored with 4 bytes, the last one of
+            // a row must not spill past the end of the destination row
+            uint count = z->s.img_x - (z->s.dest && n == 3);
             if (z->s.img_n == 3) {
-               #if STBI_SIMD
-               stbi_YCbCr_installed(out, y, coutput[1], coutput[2], z->s.img_x, n);
-               #else
-               YCbCr_to_RGB_row(out, y, coutput[1], coutput[2], z->s.img_x, n);
-               #endif
+               YCbCr_to_RGB(out, y, coutput[1], coutput[2], count, n);
             } else
-               for (i=0; i < z->s.img_x; ++i) {
+               for (i=0; i < count; ++i) {
                   out[0] = out[1] = out[2] = y[i];
                   out[3] = 255; // not used if n==3
                   out += n;
                }
+            if (count < z->s.img_x) {
+               uint8 tail[4];
+               if (z->s.img_n == 3)
+                  YCbCr_to_RGB_row(tail, y+count, coutput[1]+count, coutput[2]+count, 1, 4);
+               else
+                  tail[0] = tail[1] = tail[2] = y[count];
+               out = output + output_stride * j + count * 3;
+               out[0] = tail[0]; out[1] = tail[1]; out[2] = tail[2];
+            }
          } else {
             uint8 *y = coutput[0];
             if (n == 1)
@@ -1569,6 +2308,14 @@ unsigned char *stbi_jpeg_load_from_memory(stbi_uc const *buffer, int len, int *x
    return load_jpeg_image(&j, x,y,comp,req_comp);
 }
 
+// decode into dest, req_comp is the components written, never 0
+static int jpeg_load_into(jpeg *j, stbi_uc *dest, int dest_stride, int x, int y, int req_comp)
+{
+   int out_x, out_y;
+   set_dest(&j->s, dest, dest_stride, x, y);
+   return load_jpeg_image(j, &out_x, &out_y, NULL, req_comp) != NULL;
+}
+
 #ifndef STBI_NO_STDIO
 int stbi_jpeg_test_file(FILE *f)
 {
@@ -1589,34 +2336,96 @@ int stbi_jpeg_test_memory(stbi_uc const *buffer, int len)
    return decode_jpeg_header(&j, SCAN_type);
 }
 
-// @TODO:
+// reads the markers up to the frame header, no huffman or pixel data
+static int jpeg_info(jpeg *j, int *x, int *y, int *comp)
+{
+   if (!decode_jpeg_header(j, SCAN_header)) return 0;
+   if (x) *x = j->s.img_x;
+   if (y) *y = j->s.img_y;
+   if (comp) *comp = j->s.img_n;
+   return 1;
+}
+
 #ifndef STBI_NO_STDIO
-extern int      stbi_jpeg_info            (char const *filename,           int *x, int *y, int *comp);
-extern int      stbi_jpeg_info_from_file  (FILE *f,                  int *x, int *y, int *comp);
+int stbi_jpeg_info(char const *filename, int *x, int *y, int *comp)
+{
+   int r;
+   FILE *f = fopen(filename, "rb");
+   if (!f) return e("can't fopen", "Unable to open file");
+   r = stbi_jpeg_info_from_file(f, x, y, comp);
+   fclose(f);
+   return r;
+}
+
+int stbi_jpeg_info_from_file(FILE *f, int *x, int *y, int *comp)
+{
+   int n,r;
+   jpeg j;
+   n = ftell(f);
+   start_file(&j.s, f);
+   r = jpeg_info(&j, x, y, comp);
+   fseek(f,n,SEEK_SET);
+   return r;
+}
 #endif
-extern int      stbi_jpeg_info_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp);
+
+int stbi_jpeg_info_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp)
+{
+   jpeg j;
+   start_mem(&j.s, buffer,len);
+   return jpeg_info(&j, x, y, comp);
+}
 
 // public domain zlib decode    v0.2  Sean Barrett 2006-11-18
 //    simple implementation
 //      - all input must be provided in an upfront buffer
 //      - all output is written to a single output buffer (can malloc/realloc)
 //    performance
-//      - fast huffman
+//      - 64 bit bit buffer, refilled 8 bytes at a time
+//      - one table lookup decodes a literal/length or distance code of up
+//        to 11 bits, or 2 literals whose codes fit in 11 bits together
+//      - away from the ends of the buffers, matches are copied 8 bytes at a
+//        time and may write up to 15 bytes past their end
 
-// fast-way is faster to check than jpeg huffman, but slow way is slower
-#define ZFAST_BITS  9 // accelerate all cases in default tables
+#define ZFAST_BITS  11 // the fixed literal/length codes are 7-9 bits, 2 of them often fit
 #define ZFAST_MASK  ((1 << ZFAST_BITS) - 1)
 
+// the alphabets of the codes, a table entry means something different in each
+enum
+{
+   ZALPHA_LENGTH,       // literal/length
+   ZALPHA_DISTANCE,
+   ZALPHA_CODELENGTH
+};
+
+// fast table entries:
+//   bits  0..3    bits of the code (of both codes with ZE_PAIR)
+//   bits  4..5    kind
+//   bit   6       ZE_PAIR, 2 literals
+//   bits  8..11   extra bits of a length or distance
+//   bits 16..31   literal (2nd literal of a pair in 24..31), symbol of a code
+//                 length code, base of a length or distance
+#define ZE_LITERAL   0x00  // also distances & code length symbols
+#define ZE_LENGTH    0x10
+#define ZE_END       0x20
+#define ZE_SLOW      0x30  // code longer than ZFAST_BITS, unused or invalid: decode it canonically
+#define ZE_PAIR      0x40
+#define ZE_BITS(e)   ((e) & 15)
+#define ZE_KIND(e)   ((e) & 0x30)
+#define ZE_EXTRA(e)  (((e) >> 8) & 15)
+#define ZE_VALUE(e)  ((e) >> 16)
+
 // zlib-style huffman encoding
 // (jpegs packs from left, zlib from right, so can't share code)
 typedef struct
 {
-   uint16 fast[1 << ZFAST_BITS];
+   uint32 fast[1 << ZFAST_BITS];
    uint16 firstcode[16];
    int maxcode[17];
    uint16 firstsymbol[16];
    uint8  size[288];
    uint16 value[288];
+   int alphabet;
 } zhuffman;
 
 __forceinline static int bitreverse16(int n)
@@ -1636,19 +2445,53 @@ __forceinline static int bit_reverse(int v, int bits)
    return bitreverse16(v) >> (16-bits);
 }
 
-static int zbuild_huffman(zhuffman *z, uint8 *sizelist, int num)
+static int length_base[31] = {
+   3,4,5,6,7,8,9,10,11,13,
+   15,17,19,23,27,31,35,43,51,59,
+   67,83,99,115,131,163,195,227,258,0,0 };
+
+static int length_extra[31]=
+{ 0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,3,3,3,3,4,4,4,4,5,5,5,5,0,0,0 };
+
+static int dist_base[32] = { 1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,
+257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577,0,0};
+
+static int dist_extra[32] =
+{ 0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13};
+
+// the table entry of a symbol without its code bits, ZE_SLOW if the symbol
+// is not allowed (length 286 & 287, distance 30 & 31)
+static uint32 zsymbol_entry(int alphabet, int sym)
+{
+   if (alphabet == ZALPHA_LENGTH) {
+      if (sym < 256) return ((uint32) sym << 16) | ZE_LITERAL;
+      if (sym == 256) return ZE_END;
+      if (sym > 285) return ZE_SLOW;
+      sym -= 257;
+      return ((uint32) length_base[sym] << 16) | (length_extra[sym] << 8) | ZE_LENGTH;
+   }
+   if (alphabet == ZALPHA_DISTANCE) {
+      if (sym > 29) return ZE_SLOW;
+      return ((uint32) dist_base[sym] << 16) | (dist_extra[sym] << 8) | ZE_LITERAL;
+   }
+   return ((uint32) sym << 16) | ZE_LITERAL;
+}
+
+static int zbuild_huffman(zhuffman *z, uint8 *sizelist, int num, int alphabet)
 {
    int i,k=0;
    int code, next_code[16], sizes[17];
 
    // DEFLATE spec for generating codes
    memset(sizes, 0, sizeof(sizes));
-   memset(z->fast, 255, sizeof(z->fast));
+   for (i=0; i < (1 << ZFAST_BITS); ++i)
+      z->fast[i] = ZE_SLOW;
+   z->alphabet = alphabet;
    for (i=0; i < num; ++i)
       ++sizes[sizelist[i]];
    sizes[0] = 0;
    for (i=1; i < 16; ++i)
-      assert(sizes[i] <= (1 << i));
+      if (sizes[i] > (1 << i)) return e("bad codelengths","Corrupt PNG");
    code = 0;
    for (i=1; i < 16; ++i) {
       next_code[i] = code;
@@ -1656,7 +2499,7 @@ static int zbuild_huffman(zhuffman *z, uint8 *sizelist, int num)
       z->firstsymbol[i] = (uint16) k;
       code = (code + sizes[i]);
       if (sizes[i])
-         if (code-1 >= (1 << i)) return e("bad codelengths","Corrupt JPEG");
+         if (code-1 >= (1 << i)) return e("bad codelengths","Corrupt PNG");
       z->maxcode[i] = code << (16-i); // preshift for inner loop
       code <<= 1;
       k += sizes[i];
@@ -1669,15 +2512,30 @@ static int zbuild_huffman(zhuffman *z, uint8 *sizelist, int num)
          z->size[c] = (uint8)s;
          z->value[c] = (uint16)i;
          if (s <= ZFAST_BITS) {
+            uint32 entry = zsymbol_entry(alphabet, i);
             int k = bit_reverse(next_code[s],s);
+            if (ZE_KIND(entry) != ZE_SLOW) entry |= s;
             while (k < (1 << ZFAST_BITS)) {
-               z->fast[k] = (uint16) c;
+               z->fast[k] = entry;
                k += (1 << s);
             }
          }
          ++next_code[s];
       }
    }
+
+   // a literal followed by another one whose code fits in the bits left.
+   // going down, the lower entries read here are still single symbols
+   if (alphabet == ZALPHA_LENGTH) {
+      for (i=(1 << ZFAST_BITS)-1; i >= 0; --i) {
+         uint32 first = z->fast[i], second;
+         uint32 bits = ZE_BITS(first);
+         if (ZE_KIND(first) != ZE_LITERAL || bits == ZFAST_BITS) continue;
+         second = z->fast[i >> bits];
+         if (ZE_KIND(second) != ZE_LITERAL || ZE_BITS(second) > ZFAST_BITS - bits) continue;
+         z->fast[i] = (first & 0x00ff0000) | ((second & 0x00ff0000) << 8) | ZE_PAIR | ZE_LITERAL | (bits + ZE_BITS(second));
+      }
+   }
    return 1;
 }
 
@@ -1687,16 +2545,19 @@ static int zbuild_huffman(zhuffman *z, uint8 *sizelist, int num)
 //    we require PNG read all the IDATs and combine them into a single
 //    memory buffer
 
+typedef unsigned long long zbits;
+
 typedef struct
 {
    uint8 *zbuffer, *zbuffer_end;
    int num_bits;
-   uint32 code_buffer;
+   zbits code_buffer;   // the bits above num_bits may hold the next input bits
+   int zero_bytes;      // zeros put in the bit buffer past the end of the input
 
    char *zout;
    char *zout_start;
    char *zout_end;
-   int   z_expandable;
+   int   z_expandable;   // 0 fixed, 1 realloc, ZOUT_scratch
 
    zhuffman z_length, z_distance;
 } zbuf;
@@ -1707,52 +2568,67 @@ __forceinline static int zget8(zbuf *z)
    return *z->zbuffer++;
 }
 
+// at least 57 bits, zeros past the end of the input
 static void fill_bits(zbuf *z)
 {
-   do {
-      assert(z->code_buffer < (1U << z->num_bits));
-      z->code_buffer |= zget8(z) << z->num_bits;
+   while (z->num_bits <= 56) {
+      if (z->zbuffer < z->zbuffer_end)
+         z->code_buffer |= (zbits) *z->zbuffer++ << z->num_bits;
+      else
+         ++z->zero_bytes;
       z->num_bits += 8;
-   } while (z->num_bits <= 24);
+   }
 }
 
 __forceinline static unsigned int zreceive(zbuf *z, int n)
 {
    unsigned int k;
    if (z->num_bits < n) fill_bits(z);
-   k = z->code_buffer & ((1 << n) - 1);
+   k = (unsigned int) (z->code_buffer & ((1 << n) - 1));
    z->code_buffer >>= n;
    z->num_bits -= n;
    return k;
 }
 
-__forceinline static int zhuffman_decode(zbuf *a, zhuffman *z)
+// not resolved by fast table, so compute it the slow way.
+// returns the entry of the symbol, its code is consumed. ZE_SLOW for an
+// invalid code
+static uint32 zhuffman_slow(zbuf *a, zhuffman *z)
 {
    int b,s,k;
+   uint32 entry;
    if (a->num_bits < 16) fill_bits(a);
-   b = z->fast[a->code_buffer & ZFAST_MASK];
-   if (b < 0xffff) {
-      s = z->size[b];
-      a->code_buffer >>= s;
-      a->num_bits -= s;
-      return z->value[b];
-   }
-
-   // not resolved by fast table, so compute it the slow way
    // use jpeg approach, which requires MSbits at top
-   k = bit_reverse(a->code_buffer, 16);
+   k = bit_reverse((int) (a->code_buffer & 0xffff), 16);
    for (s=ZFAST_BITS+1; ; ++s)
       if (k < z->maxcode[s])
          break;
-   if (s == 16) return -1; // invalid code!
+   if (s >= 16) return ZE_SLOW; // invalid code!
    // code size is s, so:
    b = (k >> (16-s)) - z->firstcode[s] + z->firstsymbol[s];
-   assert(z->size[b] == s);
+   if (b < 0 || b >= 288 || z->size[b] != s) return ZE_SLOW;
    a->code_buffer >>= s;
    a->num_bits -= s;
-   return z->value[b];
+   entry = zsymbol_entry(z->alphabet, z->value[b]);
+   return ZE_KIND(entry) == ZE_SLOW ? ZE_SLOW : entry;
 }
 
+// the entry of the next code, the code is consumed
+__forceinline static uint32 zhuffman_decode(zbuf *a, zhuffman *z)
+{
+   uint32 entry;
+   if (a->num_bits < 16) fill_bits(a);
+   entry = z->fast[a->code_buffer & ZFAST_MASK];
+   if (ZE_KIND(entry) == ZE_SLOW)
+      return zhuffman_slow(a, z);
+   a->code_buffer >>= ZE_BITS(entry);
+   a->num_bits -= ZE_BITS(entry);
+   return entry;
+}
+
+// the output grows in the SCRATCH_inflate buffer
+#define ZOUT_scratch  2
+
 static int expand(zbuf *z, int n)  // need to make room for n bytes
 {
    char *q;
@@ -1762,7 +2638,10 @@ static int expand(zbuf *z, int n)  // need to make room for n bytes
    limit = (int) (z->zout_end - z->zout_start);
    while (cur + n > limit)
       limit *= 2;
-   q = (char *) realloc(z->zout_start, limit);
+   if (z->z_expandable == ZOUT_scratch)
+      q = (char *) scratch_get(SCRATCH_inflate, limit);
+   else
+      q = (char *) realloc(z->zout_start, limit);
    if (q == NULL) return e("outofmem", "Out of memory");
    z->zout_start = q;
    z->zout       = q + cur;
@@ -1770,39 +2649,148 @@ static int expand(zbuf *z, int n)  // need to make room for n bytes
    return 1;
 }
 
-static int length_base[31] = {
-   3,4,5,6,7,8,9,10,11,13,
-   15,17,19,23,27,31,35,43,51,59,
-   67,83,99,115,131,163,195,227,258,0,0 };
+__forceinline static void zcopy8(uint8 *dest, const uint8 *src)
+{
+   zbits v;
+   memcpy(&v, src, 8);
+   memcpy(dest, &v, 8);
+}
+
+// copy a match, up to 15 bytes past out + len are written
+static void zcopy_match(uint8 *out, int dist, int len)
+{
+   uint8 *end = out + len;
+   uint8 *src = out - dist;
+   if (dist == 1) {
+      memset(out, *src, len);
+      return;
+   }
+   if (dist < 8) {
+      // the bytes repeat every dist, so also every multiple of dist.
+      // after the first few bytes they are copied from 8 or more back
+      int period = dist * ((8 + dist - 1) / dist);
+      int head = period - dist;
+      if (head > len) head = len;
+      while (head--)
+         *out++ = *src++;
+      src = out - period;
+   }
+   while (out < end) {
+      zcopy8(out, src);
+      zcopy8(out + 8, src + 8);
+      out += 16;
+      src += 16;
+   }
+}
 
-static int length_extra[31]=
-{ 0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,3,3,3,3,4,4,4,4,5,5,5,5,0,0,0 };
+#define ZFAST_OUT_SLACK  (258 + 16) // the longest match & the bytes it may overrun
+
+// decode while there are 8 input bytes to load at once and room for the
+// longest match. returns 1 at the end of the block, 0 on an error, 2 near
+// the end of the input or output.
+static int inflate_fast(zbuf *a)
+{
+   const uint8 *in = a->zbuffer;
+   const uint8 *in_last = a->zbuffer_end - 8;
+   uint8 *out = (uint8 *) a->zout;
+   uint8 *out_start = (uint8 *) a->zout_start;
+   uint8 *out_last = (uint8 *) a->zout_end - ZFAST_OUT_SLACK;
+   zbits bits = a->code_buffer;
+   int num_bits = a->num_bits;
+   int result = 2;
+
+   while (in <= in_last && out <= out_last) {
+      uint32 entry;
+      int len, dist, extra;
+      zbits next;
+
+      // 56 bits at least, enough for a length & a distance with their extra bits
+      memcpy(&next, in, 8);
+      bits |= next << num_bits;
+      in += (63 - num_bits) >> 3;
+      num_bits |= 56;
+
+      entry = a->z_length.fast[bits & ZFAST_MASK];
+      if (ZE_KIND(entry) == ZE_SLOW) {
+         a->code_buffer = bits; a->num_bits = num_bits;
+         entry = zhuffman_slow(a, &a->z_length);
+         bits = a->code_buffer; num_bits = a->num_bits;
+         if (ZE_KIND(entry) == ZE_SLOW) { result = e("bad huffman code","Corrupt PNG"); break; }
+      } else {
+         bits >>= ZE_BITS(entry);
+         num_bits -= ZE_BITS(entry);
+      }
 
-static int dist_base[32] = { 1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,
-257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577,0,0};
+      if (ZE_KIND(entry) == ZE_LITERAL) {
+         out[0] = (uint8) (entry >> 16);
+         out[1] = (uint8) (entry >> 24);
+         out += (entry & ZE_PAIR) ? 2 : 1;
+         continue;
+      }
+      if (ZE_KIND(entry) == ZE_END) {
+         result = 1;
+         break;
+      }
 
-static int dist_extra[32] =
-{ 0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13};
+      extra = ZE_EXTRA(entry);
+      len = ZE_VALUE(entry) + (int) (bits & ((1 << extra) - 1));
+      bits >>= extra;
+      num_bits -= extra;
+
+      entry = a->z_distance.fast[bits & ZFAST_MASK];
+      if (ZE_KIND(entry) == ZE_SLOW) {
+         a->code_buffer = bits; a->num_bits = num_bits;
+         entry = zhuffman_slow(a, &a->z_distance);
+         bits = a->code_buffer; num_bits = a->num_bits;
+         if (ZE_KIND(entry) == ZE_SLOW) { result = e("bad huffman code","Corrupt PNG"); break; }
+      } else {
+         bits >>= ZE_BITS(entry);
+         num_bits -= ZE_BITS(entry);
+      }
+      extra = ZE_EXTRA(entry);
+      dist = ZE_VALUE(entry) + (int) (bits & ((1 << extra) - 1));
+      bits >>= extra;
+      num_bits -= extra;
+
+      if (out - out_start < dist) { result = e("bad dist","Corrupt PNG"); break; }
+      zcopy_match(out, dist, len);
+      out += len;
+   }
+
+   a->zbuffer = (uint8 *) in;
+   a->zout = (char *) out;
+   a->code_buffer = bits;
+   a->num_bits = num_bits;
+   return result;
+}
 
 static int parse_huffman_block(zbuf *a)
 {
    for(;;) {
-      int z = zhuffman_decode(a, &a->z_length);
-      if (z < 256) {
-         if (z < 0) return e("bad huffman code","Corrupt PNG"); // error in huffman codes
-         if (a->zout >= a->zout_end) if (!expand(a, 1)) return 0;
-         *a->zout++ = (char) z;
+      uint32 entry;
+      if (a->zbuffer_end - a->zbuffer >= 8 && a->zout_end - a->zout >= ZFAST_OUT_SLACK) {
+         int result = inflate_fast(a);
+         if (result != 2) return result;
+      }
+
+      // one symbol at a time near the ends of the buffers
+      if (a->zero_bytes > 16) return e("unexpected end","Corrupt PNG");
+      if (a->num_bits < 48) fill_bits(a);
+      entry = zhuffman_decode(a, &a->z_length);
+      if (ZE_KIND(entry) == ZE_SLOW) return e("bad huffman code","Corrupt PNG"); // error in huffman codes
+      if (ZE_KIND(entry) == ZE_LITERAL) {
+         int n = (entry & ZE_PAIR) ? 2 : 1;
+         if (a->zout + n > a->zout_end) if (!expand(a, n)) return 0;
+         *a->zout++ = (char) (entry >> 16);
+         if (n == 2) *a->zout++ = (char) (entry >> 24);
       } else {
          uint8 *p;
          int len,dist;
-         if (z == 256) return 1;
-         z -= 257;
-         len = length_base[z];
-         if (length_extra[z]) len += zreceive(a, length_extra[z]);
-         z = zhuffman_decode(a, &a->z_distance);
-         if (z < 0) return e("bad huffman code","Corrupt PNG");
-         dist = dist_base[z];
-         if (dist_extra[z]) dist += zreceive(a, dist_extra[z]);
+         if (ZE_KIND(entry) == ZE_END) return 1;
+         len = ZE_VALUE(entry) + zreceive(a, ZE_EXTRA(entry));
+         entry = zhuffman_decode(a, &a->z_distance);
+         if (ZE_KIND(entry) == ZE_SLOW) return e("bad huffman code","Corrupt PNG");
+         dist = ZE_VALUE(entry) + zreceive(a, ZE_EXTRA(entry));
          if (a->zout - a->zout_start < dist) return e("bad dist","Corrupt PNG");
          if (a->zout + len > a->zout_end) if (!expand(a, len)) return 0;
          p = (uint8 *) (a->zout - dist);
@@ -1815,8 +2803,8 @@ static int parse_huffman_block(zbuf *a)
 static int compute_huffman_codes(zbuf *a)
 {
    static uint8 length_dezigzag[19] = { 16,17,18,0,8,7,9,6,10,5,11,4,12,3,13,2,14,1,15 };
-   static zhuffman z_codelength; // static just to save stack space
-   uint8 lencodes[286+32+137];//padding for maximum single op
+   zhuffman z_codelength;
+   uint8 lencodes[286+32];
    uint8 codelength_sizes[19];
    int i,n;
 
@@ -1829,49 +2817,57 @@ static int compute_huffman_codes(zbuf *a)
       int s = zreceive(a,3);
       codelength_sizes[length_dezigzag[i]] = (uint8) s;
    }
-   if (!zbuild_huffman(&z_codelength, codelength_sizes, 19)) return 0;
+   if (!zbuild_huffman(&z_codelength, codelength_sizes, 19, ZALPHA_CODELENGTH)) return 0;
 
    n = 0;
    while (n < hlit + hdist) {
-      int c = zhuffman_decode(a, &z_codelength);
-      assert(c >= 0 && c < 19);
-      if (c < 16)
+      uint32 entry = zhuffman_decode(a, &z_codelength);
+      int c = ZE_VALUE(entry), fill;
+      if (ZE_KIND(entry) == ZE_SLOW) return e("bad codelengths","Corrupt PNG");
+      if (c < 16) {
          lencodes[n++] = (uint8) c;
-      else if (c == 16) {
+         continue;
+      }
+      if (c == 16) {
+         if (n == 0) return e("bad codelengths","Corrupt PNG");
          c = zreceive(a,2)+3;
-         memset(lencodes+n, lencodes[n-1], c);
-         n += c;
+         fill = lencodes[n-1];
       } else if (c == 17) {
          c = zreceive(a,3)+3;
-         memset(lencodes+n, 0, c);
-         n += c;
+         fill = 0;
       } else {
-         assert(c == 18);
          c = zreceive(a,7)+11;
-         memset(lencodes+n, 0, c);
-         n += c;
+         fill = 0;
       }
+      if (n + c > hlit + hdist) return e("bad codelengths","Corrupt PNG");
+      memset(lencodes+n, fill, c);
+      n += c;
    }
-   if (n != hlit+hdist) return e("bad codelengths","Corrupt PNG");
-   if (!zbuild_huffman(&a->z_length, lencodes, hlit)) return 0;
-   if (!zbuild_huffman(&a->z_distance, lencodes+hlit, hdist)) return 0;
+   if (!zbuild_huffman(&a->z_length, lencodes, hlit, ZALPHA_LENGTH)) return 0;
+   if (!zbuild_huffman(&a->z_distance, lencodes+hlit, hdist, ZALPHA_DISTANCE)) return 0;
    return 1;
 }
 
 static int parse_uncompressed_block(zbuf *a)
 {
    uint8 header[4];
-   int len,nlen,k;
+   int len,nlen,k,buffered;
    if (a->num_bits & 7)
       zreceive(a, a->num_bits & 7); // discard
-   // drain the bit-packed data into header
+   // drain the bit-packed data into header, the input bytes still in the
+   // bit buffer after it are read again
    k = 0;
-   while (a->num_bits > 0) {
+   while (a->num_bits > 0 && k < 4) {
       header[k++] = (uint8) (a->code_buffer & 255); // wtf this warns?
       a->code_buffer >>= 8;
       a->num_bits -= 8;
    }
-   assert(a->num_bits == 0);
+   buffered = (a->num_bits >> 3) - a->zero_bytes;
+   if (buffered > 0)
+      a->zbuffer -= buffered;
+   a->code_buffer = 0;
+   a->num_bits = 0;
+   a->zero_bytes = 0;
    // now fill header the normal way
    while (k < 4)
       header[k++] = (uint8) zget8(a);
@@ -1900,18 +2896,34 @@ static int parse_zlib_header(zbuf *a)
    return 1;
 }
 
-// @TODO: should statically initialize these for optimal thread safety
-static uint8 default_length[288], default_distance[32];
-static void init_defaults(void)
+// fixed code lengths: 0..143 are 8 bits, 144..255 are 9, 256..279 are 7,
+// 280..287 are 8. initialized statically, so no thread ever writes them
+static uint8 default_length[288] =
+{
+   8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,
+   8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,
+   8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,
+   8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,
+   8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,
+   8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,
+   8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,
+   8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,
+   8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,8,
+   9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,
+   9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,
+   9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,
+   9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,
+   9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,
+   9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,
+   9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,
+   7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,
+   7,7,7,7,7,7,7,7,8,8,8,8,8,8,8,8
+};
+static uint8 default_distance[32] =
 {
-   int i;   // use <= to match clearly with spec
-   for (i=0; i <= 143; ++i)     default_length[i]   = 8;
-   for (   ; i <= 255; ++i)     default_length[i]   = 9;
-   for (   ; i <= 279; ++i)     default_length[i]   = 7;
-   for (   ; i <= 287; ++i)     default_length[i]   = 8;
-
-   for (i=0; i <=  31; ++i)     default_distance[i] = 5;
-}
+   5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,
+   5,5,5,5,5,5,5,5,5,5,5,5,5,5,5,5
+};
 
 static int parse_zlib(zbuf *a, int parse_header)
 {
@@ -1920,6 +2932,7 @@ static int parse_zlib(zbuf *a, int parse_header)
       if (!parse_zlib_header(a)) return 0;
    a->num_bits = 0;
    a->code_buffer = 0;
+   a->zero_bytes = 0;
    do {
       final = zreceive(a,1);
       type = zreceive(a,2);
@@ -1930,9 +2943,8 @@ static int parse_zlib(zbuf *a, int parse_header)
       } else {
          if (type == 1) {
             // use fixed code lengths
-            if (!default_distance[31]) init_defaults();
-            if (!zbuild_huffman(&a->z_length  , default_length  , 288)) return 0;
-            if (!zbuild_huffman(&a->z_distance, default_distance,  32)) return 0;
+            if (!zbuild_huffman(&a->z_length  , default_length  , 288, ZALPHA_LENGTH)) return 0;
+            if (!zbuild_huffman(&a->z_distance, default_distance,  32, ZALPHA_DISTANCE)) return 0;
          } else {
             if (!compute_huffman_codes(a)) return 0;
          }
@@ -1968,6 +2980,20 @@ char *stbi_zlib_decode_malloc_guesssize(const char *buffer, int len, int initial
    }
 }
 
+// inflate into the SCRATCH_inflate buffer, at least initial_size bytes of
+// it to start with
+static char *zlib_decode_scratch(const char *buffer, int len, int initial_size, int *outlen)
+{
+   zbuf a;
+   char *p = (char *) scratch_get(SCRATCH_inflate, initial_size);
+   if (p == NULL) return (char *) epuc("outofmem", "Out of memory");
+   a.zbuffer = (uint8 *) buffer;
+   a.zbuffer_end = (uint8 *) buffer + len;
+   if (!do_zlib(&a, p, (int) stbi_ctx.scratch[SCRATCH_inflate].size, ZOUT_scratch, 1)) return NULL;
+   if (outlen) *outlen = (int) (a.zout - a.zout_start);
+   return a.zout_start;
+}
+
 char *stbi_zlib_decode_malloc(char const *buffer, int len, int *outlen)
 {
    return stbi_zlib_decode_malloc_guesssize(buffer, len, 16384, outlen);
@@ -2014,27 +3040,76 @@ int stbi_zlib_decode_noheader_buffer(char *obuffer, int olen, const char *ibuffe
 // public domain "baseline" PNG decoder   v0.10  Sean Barrett 2006-11-18
 //    simple implementation
 //      - only 8-bit samples
-//      - no CRC checking
+//      - CRC checking only after stbi_png_check_crc(1)
 //      - allocates lots of intermediate memory
 //        - avoids problem of streaming data between subsystems
 //        - avoids explicit window management
 //    performance
 //      - uses stb_zlib, a PD zlib implementation with fast huffman decoding
+//      - unfilters 3 & 4 byte pixels with SSE2/AVX2 or NEON, the scalar
+//        code after stbi_png_unfilter_simd(0)
 
 
 typedef struct
 {
    uint32 length;
    uint32 type;
+   int    bad_crc;
 } chunk;
 
 #define PNG_TYPE(a,b,c,d)  (((a) << 24) + ((b) << 16) + ((c) << 8) + (d))
 
+static int png_check_crc = 0;
+
+void stbi_png_check_crc(int flag_true_if_should_check)
+{
+   png_check_crc = flag_true_if_should_check;
+}
+
+// the CRC over the type & data of the chunk against the stored one, the
+// data is read ahead and the position restored
+static int chunk_crc_ok(stbi *s, chunk *c)
+{
+   uint8 tail[4];
+   uint32 crc;
+   tail[0] = (uint8) (c->type >> 24);
+   tail[1] = (uint8) (c->type >> 16);
+   tail[2] = (uint8) (c->type >>  8);
+   tail[3] = (uint8) (c->type >>  0);
+   crc = checksum_crc32(0, tail, 4);
+   #ifndef STBI_NO_STDIO
+   if (s->img_file) {
+      uint8 buffer[4096];
+      long start = ftell(s->img_file);
+      uint32 left = c->length, n;
+      int ok = 1;
+      while (ok && left > 0) {
+         n = left < sizeof(buffer) ? left : sizeof(buffer);
+         ok = fread(buffer, 1, n, s->img_file) == n;
+         crc = checksum_crc32(crc, buffer, n);
+         left -= n;
+      }
+      ok = ok && fread(tail, 1, 4, s->img_file) == 4;
+      fseek(s->img_file, start, SEEK_SET);
+      if (!ok) return 0;
+   }
+   else
+   #endif
+   {
+      uint32 avail = (uint32) (s->img_buffer_end - s->img_buffer);
+      if (c->length > avail || avail - c->length < 4) return 0;
+      crc = checksum_crc32(crc, s->img_buffer, c->length);
+      memcpy(tail, s->img_buffer + c->length, 4);
+   }
+   return crc == (((uint32) tail[0] << 24) | ((uint32) tail[1] << 16) | ((uint32) tail[2] << 8) | tail[3]);
+}
+
 static chunk get_chunk_header(stbi *s)
 {
    chunk c;
    c.length = get32(s);
    c.type   = get32(s);
+   c.bad_crc = png_check_crc && !chunk_crc_ok(s, &c);
    return c;
 }
 
@@ -2075,24 +3150,231 @@ static int paeth(int a, int b, int c)
    return c;
 }
 
-// create the png data from post-deflated data
-static int create_png_image(png *a, uint8 *raw, uint32 raw_len, int out_n)
+// SIMD unfiltering for 3 & 4 byte pixels. Sub, Average & Paeth need the
+// pixel to the left, so they step one pixel at a time in vector lanes;
+// Up has no such dependency and steps 16 bytes (32 with AVX2, chosen at
+// run time). The per pixel operations are defined for SSE2 & NEON, the
+// row loops are shared. The scalar loops in create_png_image are the
+// reference, stbi_png_unfilter_simd(0) selects them.
+#if defined(STBI_SSE2) || defined(STBI_NEON)
+#define STBI_PNG_SIMD 1
+#endif
+
+static int png_unfilter_simd = 1;
+
+void stbi_png_unfilter_simd(int flag_true_if_should_use_simd)
+{
+   png_unfilter_simd = flag_true_if_should_use_simd;
+}
+
+#ifdef STBI_PNG_SIMD
+
+// n (3 or 4) bytes of a pixel in the low lanes, the others are 0
+static uint32 load_pixel_bits(const uint8 *p, int n)
+{
+   uint32 v;
+   if (n == 4) {
+      memcpy(&v, p, 4);
+      return v;
+   }
+   return p[0] | (p[1] << 8) | (p[2] << 16);
+}
+
+static void store_pixel_bits(uint8 *p, uint32 v, int n)
+{
+   if (n == 4) {
+      memcpy(p, &v, 4);
+   } else {
+      p[0] = (uint8) v;
+      p[1] = (uint8) (v >> 8);
+      p[2] = (uint8) (v >> 16);
+   }
+}
+
+#ifdef STBI_SSE2
+typedef __m128i png_pixel;
+
+static png_pixel pixel_zero(void) { return _mm_setzero_si128(); }
+static png_pixel pixel_load(const uint8 *p, int n) { return _mm_cvtsi32_si128((int) load_pixel_bits(p, n)); }
+static void pixel_store(uint8 *p, png_pixel v, int n) { store_pixel_bits(p, (uint32) _mm_cvtsi128_si32(v), n); }
+static png_pixel pixel_add(png_pixel x, png_pixel y) { return _mm_add_epi8(x, y); }
+
+// (a + b) >> 1, the rounding up of pavgb is taken back
+static png_pixel pixel_avg(png_pixel a, png_pixel b)
+{
+   __m128i odd = _mm_and_si128(_mm_xor_si128(a, b), _mm_set1_epi8(1));
+   return _mm_sub_epi8(_mm_avg_epu8(a, b), odd);
+}
+
+static __m128i abs_epi16(__m128i x)
+{
+   __m128i sign = _mm_srai_epi16(x, 15);
+   return _mm_sub_epi16(_mm_xor_si128(x, sign), sign);
+}
+
+// paeth() in 16 bit lanes, the ties go to a, then b
+static png_pixel pixel_paeth(png_pixel a8, png_pixel b8, png_pixel c8)
+{
+   __m128i zero = _mm_setzero_si128();
+   __m128i a = _mm_unpacklo_epi8(a8, zero);
+   __m128i b = _mm_unpacklo_epi8(b8, zero);
+   __m128i c = _mm_unpacklo_epi8(c8, zero);
+   __m128i pa = abs_epi16(_mm_sub_epi16(b, c));
+   __m128i pb = abs_epi16(_mm_sub_epi16(a, c));
+   __m128i pc = abs_epi16(_mm_sub_epi16(_mm_add_epi16(a, b), _mm_add_epi16(c, c)));
+   __m128i not_a = _mm_or_si128(_mm_cmpgt_epi16(pa, pb), _mm_cmpgt_epi16(pa, pc));
+   __m128i not_b = _mm_cmpgt_epi16(pb, pc);
+   __m128i b_or_c = _mm_or_si128(_mm_andnot_si128(not_b, b), _mm_and_si128(not_b, c));
+   __m128i pred = _mm_or_si128(_mm_andnot_si128(not_a, a), _mm_and_si128(not_a, b_or_c));
+   return _mm_packus_epi16(pred, pred);
+}
+
+// cur = raw + prior for n bytes, returns how many are done
+static uint32 add_bytes_16(uint8 *cur, const uint8 *raw, const uint8 *prior, uint32 n)
+{
+   uint32 i = 0;
+   for (; i + 16 <= n; i += 16) {
+      __m128i x = _mm_loadu_si128((const __m128i *) (raw + i));
+      __m128i b = _mm_loadu_si128((const __m128i *) (prior + i));
+      _mm_storeu_si128((__m128i *) (cur + i), _mm_add_epi8(x, b));
+   }
+   return i;
+}
+#else
+typedef uint8x8_t png_pixel;
+
+static png_pixel pixel_zero(void) { return vdup_n_u8(0); }
+static png_pixel pixel_load(const uint8 *p, int n) { return vreinterpret_u8_u32(vdup_n_u32(load_pixel_bits(p, n))); }
+static void pixel_store(uint8 *p, png_pixel v, int n) { store_pixel_bits(p, vget_lane_u32(vreinterpret_u32_u8(v), 0), n); }
+static png_pixel pixel_add(png_pixel x, png_pixel y) { return vadd_u8(x, y); }
+static png_pixel pixel_avg(png_pixel a, png_pixel b) { return vhadd_u8(a, b); }
+
+// paeth() in 16 bit lanes, the ties go to a, then b
+static png_pixel pixel_paeth(png_pixel a, png_pixel b, png_pixel c)
+{
+   uint16x8_t pa = vabdl_u8(b, c);
+   uint16x8_t pb = vabdl_u8(a, c);
+   uint16x8_t pc = vabdq_u16(vaddl_u8(a, b), vaddl_u8(c, c));
+   uint8x8_t is_a = vmovn_u16(vandq_u16(vcleq_u16(pa, pb), vcleq_u16(pa, pc)));
+   uint8x8_t is_b = vmovn_u16(vcleq_u16(pb, pc));
+   return vbsl_u8(is_a, a, vbsl_u8(is_b, b, c));
+}
+
+static uint32 add_bytes_16(uint8 *cur, const uint8 *raw, const uint8 *prior, uint32 n)
+{
+   uint32 i = 0;
+   for (; i + 16 <= n; i += 16)
+      vst1q_u8(cur + i, vaddq_u8(vld1q_u8(raw + i), vld1q_u8(prior + i)));
+   return i;
+}
+#endif
+
+#ifdef STBI_AVX2
+STBI_TARGET_AVX2
+static uint32 add_bytes_32(uint8 *cur, const uint8 *raw, const uint8 *prior, uint32 n)
+{
+   uint32 i = 0;
+   for (; i + 32 <= n; i += 32) {
+      __m256i x = _mm256_loadu_si256((const __m256i *) (raw + i));
+      __m256i b = _mm256_loadu_si256((const __m256i *) (prior + i));
+      _mm256_storeu_si256((__m256i *) (cur + i), _mm256_add_epi8(x, b));
+   }
+   return i;
+}
+#endif
+
+// the pixel at a time filters, n & out_n are constants in the callers so
+// the pixel loads & stores are plain moves
+#define PIXEL_LOOP(body) \
+   for (i=0; i < x; ++i, raw += n, cur += out_n, prior += prior_step) { \
+      png_pixel d = pixel_load(raw, n); \
+      body; \
+      pixel_store(cur, a, n); \
+      if (n != out_n) cur[n] = 255; \
+   }
+
+static void unfilter_pixels(int filter, uint8 *cur, const uint8 *prior, const uint8 *raw, uint32 x, int n, int out_n)
+{
+   png_pixel a = pixel_zero(), b, c = pixel_zero(), zero = pixel_zero();
+   uint32 i, prior_step = prior ? out_n : 0;
+   switch (filter) {
+      case F_none       : PIXEL_LOOP(a = d) break;
+      case F_up         : PIXEL_LOOP(a = pixel_add(d, pixel_load(prior, out_n))) break;
+      case F_sub        :
+      case F_paeth_first: PIXEL_LOOP(a = pixel_add(d, a)) break; // paeth(a,0,0) is a
+      case F_avg        : PIXEL_LOOP(a = pixel_add(d, pixel_avg(a, pixel_load(prior, out_n)))) break;
+      case F_avg_first  : PIXEL_LOOP(a = pixel_add(d, pixel_avg(a, zero))) break;
+      case F_paeth      : PIXEL_LOOP(b = pixel_load(prior, out_n); a = pixel_add(d, pixel_paeth(a, b, c)); c = b) break;
+   }
+}
+
+#undef PIXEL_LOOP
+
+// one row of x pixels, raw has n bytes per pixel, cur & prior out_n.
+// prior is NULL on the first row, filter is then one of first_row_filter.
+static void unfilter_row_simd(int filter, uint8 *cur, const uint8 *prior, const uint8 *raw, uint32 x, int n, int out_n)
+{
+   uint32 done;
+
+   if ((filter == F_none || filter == F_up) && n == out_n) {
+      if (filter == F_none) {
+         memcpy(cur, raw, x*n);
+         return;
+      }
+      #ifdef STBI_AVX2
+      if (has_avx2())
+         done = add_bytes_32(cur, raw, prior, x*n);
+      else
+      #endif
+         done = 0;
+      done += add_bytes_16(cur + done, raw + done, prior + done, x*n - done);
+      for (; done < x*n; ++done)
+         cur[done] = raw[done] + prior[done];
+      return;
+   }
+
+   if (n == 4)
+      unfilter_pixels(filter, cur, prior, raw, x, 4, 4);
+   else if (out_n == 4)
+      unfilter_pixels(filter, cur, prior, raw, x, 3, 4);
+   else
+      unfilter_pixels(filter, cur, prior, raw, x, 3, 3);
+}
+
+#endif // STBI_PNG_SIMD
+
+// create the png data from post-deflated data, into a->out or to the
+// destination rows when to_dest is set
+static int create_png_image(png *a, uint8 *raw, uint32 raw_len, int out_n, int to_dest)
 {
    stbi *s = &a->s;
-   uint32 i,j,stride = s->img_x*out_n;
+   uint32 i,j,stride = to_dest ? s->dest_stride : s->img_x*out_n;
+   uint8 *out;
    int k;
    int img_n = s->img_n; // copy it into a local for later
    assert(out_n == s->img_n || out_n == s->img_n+1);
-   a->out = (uint8 *) malloc(s->img_x * s->img_y * out_n);
-   if (!a->out) return e("outofmem", "Out of memory");
    if (raw_len != (img_n * s->img_x + 1) * s->img_y) return e("not enough pixels","Corrupt PNG");
+   if (to_dest) {
+      out = s->dest;
+   } else {
+      a->out = image_alloc(s, s->img_x * s->img_y * out_n);
+      if (!a->out) return e("outofmem", "Out of memory");
+      out = a->out;
+   }
    for (j=0; j < s->img_y; ++j) {
-      uint8 *cur = a->out + stride*j;
+      uint8 *cur = out + stride*j;
       uint8 *prior = cur - stride;
       int filter = *raw++;
       if (filter > 4) return e("invalid filter","Corrupt PNG");
       // if first row, use special filter that doesn't sample previous row
       if (j == 0) filter = first_row_filter[filter];
+      #ifdef STBI_PNG_SIMD
+      if (png_unfilter_simd && (img_n == 3 || img_n == 4)) {
+         unfilter_row_simd(filter, cur, j ? prior : NULL, raw, s->img_x, img_n, out_n);
+         raw += img_n * s->img_x;
+         continue;
+      }
+      #endif
       // handle first pixel explicitly
       for (k=0; k < img_n; ++k) {
          switch(filter) {
@@ -2146,61 +3428,67 @@ static int create_png_image(png *a, uint8 *raw, uint32 raw_len, int out_n)
    return 1;
 }
 
-static int compute_transparency(png *z, uint8 tc[3], int out_n)
+static int compute_transparency(png *z, uint8 tc[3], int out_n, int to_dest)
 {
    stbi *s = &z->s;
-   uint32 i, pixel_count = s->img_x * s->img_y;
-   uint8 *p = z->out;
+   uint32 i, j;
+   uint8 *p;
 
    // compute color-based transparency, assuming we've
    // already got 255 as the alpha value in the output
    assert(out_n == 2 || out_n == 4);
 
-   if (out_n == 2) {
-      for (i=0; i < pixel_count; ++i) {
-         p[1] = (p[0] == tc[0] ? 0 : 255);
-         p += 2;
-      }
-   } else {
-      for (i=0; i < pixel_count; ++i) {
-         if (p[0] == tc[0] && p[1] == tc[1] && p[2] == tc[2])
-            p[3] = 0;
-         p += 4;
+   for (j=0; j < s->img_y; ++j) {
+      p = to_dest ? s->dest + s->dest_stride*j : z->out + s->img_x*out_n*j;
+      if (out_n == 2) {
+         for (i=0; i < s->img_x; ++i) {
+            p[1] = (p[0] == tc[0] ? 0 : 255);
+            p += 2;
+         }
+      } else {
+         for (i=0; i < s->img_x; ++i) {
+            if (p[0] == tc[0] && p[1] == tc[1] && p[2] == tc[2])
+               p[3] = 0;
+            p += 4;
+         }
       }
    }
    return 1;
 }
 
-static int expand_palette(png *a, uint8 *palette, int len, int pal_img_n)
+static int expand_palette(png *a, uint8 *palette, int len, int pal_img_n, int to_dest)
 {
-   uint32 i, pixel_count = a->s.img_x * a->s.img_y;
-   uint8 *p, *temp_out, *orig = a->out;
+   uint32 i, j, pixel_count = a->s.img_x * a->s.img_y;
+   uint8 *p, *temp_out = NULL, *orig = a->out;
 
-   p = (uint8 *) malloc(pixel_count * pal_img_n);
-   if (p == NULL) return e("outofmem", "Out of memory");
+   if (!to_dest) {
+      temp_out = a->s.dest ? scratch_get(SCRATCH_palette, pixel_count * pal_img_n) : (uint8 *) malloc(pixel_count * pal_img_n);
+      if (temp_out == NULL) return e("outofmem", "Out of memory");
+   }
 
    // between here and free(out) below, exitting would leak
-   temp_out = p;
-
-   if (pal_img_n == 3) {
-      for (i=0; i < pixel_count; ++i) {
-         int n = orig[i]*4;
-         p[0] = palette[n  ];
-         p[1] = palette[n+1];
-         p[2] = palette[n+2];
-         p += 3;
-      }
-   } else {
-      for (i=0; i < pixel_count; ++i) {
-         int n = orig[i]*4;
-         p[0] = palette[n  ];
-         p[1] = palette[n+1];
-         p[2] = palette[n+2];
-         p[3] = palette[n+3];
-         p += 4;
+   for (j=0; j < a->s.img_y; ++j) {
+      p = to_dest ? a->s.dest + a->s.dest_stride*j : temp_out + a->s.img_x*pal_img_n*j;
+      if (pal_img_n == 3) {
+         for (i=0; i < a->s.img_x; ++i, ++orig) {
+            int n = orig[0]*4;
+            p[0] = palette[n  ];
+            p[1] = palette[n+1];
+            p[2] = palette[n+2];
+            p += 3;
+         }
+      } else {
+         for (i=0; i < a->s.img_x; ++i, ++orig) {
+            int n = orig[0]*4;
+            p[0] = palette[n  ];
+            p[1] = palette[n+1];
+            p[2] = palette[n+2];
+            p[3] = palette[n+3];
+            p += 4;
+         }
       }
    }
-   free(a->out);
+   scratch_free(a->out);
    a->out = temp_out;
    return 1;
 }
@@ -2219,6 +3507,7 @@ static int parse_png_file(png *z, int scan, int req_comp)
 
    for(;;first=0) {
       chunk c = get_chunk_header(s);
+      if (c.bad_crc) return e("bad CRC","Corrupt PNG");
       if (first && c.type != PNG_TYPE('I','H','D','R'))
          return e("first not IHDR","Corrupt PNG");
       switch (c.type) {
@@ -2289,8 +3578,11 @@ static int parse_png_file(png *z, int scan, int req_comp)
                if (idata_limit == 0) idata_limit = c.length > 4096 ? c.length : 4096;
                while (ioff + c.length > idata_limit)
                   idata_limit *= 2;
-               p = (uint8 *) realloc(z->idata, idata_limit); if (p == NULL) return e("outofmem", "Out of memory");
+               // the buffer of the earlier images is usually big enough
+               p = scratch_get(SCRATCH_idata, idata_limit); if (p == NULL) return e("outofmem", "Out of memory");
                z->idata = p;
+               if (stbi_ctx.scratch[SCRATCH_idata].size > idata_limit)
+                  idata_limit = (uint32) stbi_ctx.scratch[SCRATCH_idata].size;
             }
             #ifndef STBI_NO_STDIO
             if (s->img_file)
@@ -2300,6 +3592,7 @@ static int parse_png_file(png *z, int scan, int req_comp)
             else
             #endif
             {
+               if (c.length > (uint32) (s->img_buffer_end - s->img_buffer)) return e("outofdata","Corrupt PNG");
                memcpy(z->idata+ioff, s->img_buffer, c.length);
                s->img_buffer += c.length;
             }
@@ -2309,27 +3602,34 @@ static int parse_png_file(png *z, int scan, int req_comp)
 
          case PNG_TYPE('I','E','N','D'): {
             uint32 raw_len;
+            int to_dest = 0;
             if (scan != SCAN_load) return 1;
             if (z->idata == NULL) return e("no IDAT","Corrupt PNG");
-            z->expanded = (uint8 *) stbi_zlib_decode_malloc((char *) z->idata, ioff, (int *) &raw_len);
+            // the filtered size is known from IHDR, a good stream never reallocs
+            z->expanded = (uint8 *) zlib_decode_scratch((char *) z->idata, ioff, (s->img_n * s->img_x + 1) * s->img_y, (int *) &raw_len);
             if (z->expanded == NULL) return 0; // zlib should set error
-            free(z->idata); z->idata = NULL;
+            z->idata = NULL;
             if ((req_comp == s->img_n+1 && req_comp != 3 && !pal_img_n) || has_trans)
                s->img_out_n = s->img_n+1;
             else
                s->img_out_n = s->img_n;
-            if (!create_png_image(z, z->expanded, raw_len, s->img_out_n)) return 0;
+            // the last step writes to the destination if it makes req_comp
+            if (s->dest) {
+               if (!check_dest_size(s)) return 0;
+               to_dest = pal_img_n ? req_comp >= 3 : s->img_out_n == req_comp;
+            }
+            if (!create_png_image(z, z->expanded, raw_len, s->img_out_n, to_dest && !pal_img_n)) return 0;
             if (has_trans)
-               if (!compute_transparency(z, tc, s->img_out_n)) return 0;
+               if (!compute_transparency(z, tc, s->img_out_n, to_dest && !pal_img_n)) return 0;
             if (pal_img_n) {
                // pal_img_n == 3 or 4
                s->img_n = pal_img_n; // record the actual colors we had
                s->img_out_n = pal_img_n;
                if (req_comp >= 3) s->img_out_n = req_comp;
-               if (!expand_palette(z, palette, pal_len, s->img_out_n))
+               if (!expand_palette(z, palette, pal_len, s->img_out_n, to_dest))
                   return 0;
             }
-            free(z->expanded); z->expanded = NULL;
+            z->expanded = NULL;
             return 1;
          }
 
@@ -2337,8 +3637,8 @@ static int parse_png_file(png *z, int scan, int req_comp)
             // if critical, fail
             if ((c.type & (1 << 29)) == 0) {
                #ifndef STBI_NO_FAILURE_STRINGS
-               // not threadsafe
-               static char invalid_chunk[] = "XXXX chunk not known";
+               char *invalid_chunk = stbi_ctx.failure_buffer;
+               strcpy(invalid_chunk, "XXXX chunk not known");
                invalid_chunk[0] = (uint8) (c.type >> 24);
                invalid_chunk[1] = (uint8) (c.type >> 16);
                invalid_chunk[2] = (uint8) (c.type >>  8);
@@ -2373,9 +3673,8 @@ static unsigned char *do_png(png *p, int *x, int *y, int *n, int req_comp)
       *y = p->s.img_y;
       if (n) *n = p->s.img_n;
    }
-   free(p->out);      p->out      = NULL;
-   free(p->expanded); p->expanded = NULL;
-   free(p->idata);    p->idata    = NULL;
+   // idata & expanded are scratch buffers
+   scratch_free(p->out); p->out = NULL;
 
    return result;
 }
@@ -2406,6 +3705,157 @@ unsigned char *stbi_png_load_from_memory(stbi_uc const *buffer, int len, int *x,
    return do_png(&p, x,y,comp,req_comp);
 }
 
+// decode into dest, req_comp is the components written, never 0.
+// a format the last step can not write as req_comp is decoded as usual
+// and copied.
+static int png_load_into(png *p, stbi_uc *dest, int dest_stride, int x, int y, int req_comp)
+{
+   int r;
+   p->expanded = NULL;
+   p->idata = NULL;
+   p->out = NULL;
+   set_dest(&p->s, dest, dest_stride, x, y);
+   r = parse_png_file(p, SCAN_load, req_comp);
+   if (r && p->out)
+      r = copy_to_dest(&p->s, p->out, p->s.img_out_n, req_comp);
+   // all of them are scratch buffers
+   p->out = NULL;
+   return r;
+}
+
+static stbi_uc *bmp_load(stbi *s, int *x, int *y, int *comp, int req_comp);
+static stbi_uc *tga_load(stbi *s, int *x, int *y, int *comp, int req_comp);
+
+// decode a bmp or tga into the SCRATCH_image buffer & copy it to the
+// destination set in s
+static int load_into_scratch(stbi *s, int is_bmp, int req_comp)
+{
+   int out_x, out_y, comp;
+   stbi_uc *data;
+   if (is_bmp) {
+      // comp is what the bmp decoded, it leaves converting to the copy
+      data = bmp_load(s, &out_x, &out_y, &comp, req_comp);
+   } else {
+      data = tga_load(s, &out_x, &out_y, &comp, req_comp);
+      comp = req_comp;
+   }
+   if (data == NULL) return 0;
+   s->img_x = out_x;
+   s->img_y = out_y;
+   return copy_to_dest(s, data, comp, req_comp);
+}
+
+// the types stbi_load tests before the tga, whose test is crappy
+#ifndef STBI_NO_STDIO
+static int test_before_tga_file(FILE *f)
+{
+   int i;
+   if (stbi_psd_test_file(f)) return 1;
+   #ifndef STBI_NO_DDS
+   if (stbi_dds_test_file(f)) return 1;
+   #endif
+   #ifndef STBI_NO_HDR
+   if (stbi_hdr_test_file(f)) return 1;
+   #endif
+   for (i=0; i < max_loaders; ++i)
+      if (loaders[i]->test_file(f)) return 1;
+   return 0;
+}
+#endif
+
+static int test_before_tga_memory(stbi_uc const *buffer, int len)
+{
+   int i;
+   if (stbi_psd_test_memory(buffer,len)) return 1;
+   #ifndef STBI_NO_DDS
+   if (stbi_dds_test_memory(buffer,len)) return 1;
+   #endif
+   #ifndef STBI_NO_HDR
+   if (stbi_hdr_test_memory(buffer,len)) return 1;
+   #endif
+   for (i=0; i < max_loaders; ++i)
+      if (loaders[i]->test_memory(buffer,len)) return 1;
+   return 0;
+}
+
+// decode into a x * y region of rows dest_stride bytes apart, with
+// req_comp (1..4) components. JPEG & PNG write to the region directly,
+// BMP & TGA are copied from a scratch buffer, the others are decoded as
+// usual and copied.
+#ifndef STBI_NO_STDIO
+int stbi_load_into(char const *filename, stbi_uc *dest, int dest_stride, int x, int y, int req_comp)
+{
+   FILE *f = fopen(filename, "rb");
+   int result;
+   if (!f) return e("can't fopen", "Unable to open file");
+   result = stbi_load_into_from_file(f, dest, dest_stride, x, y, req_comp);
+   fclose(f);
+   return result;
+}
+
+int stbi_load_into_from_file(FILE *f, stbi_uc *dest, int dest_stride, int x, int y, int req_comp)
+{
+   int out_x, out_y, comp, r;
+   stbi_uc *data;
+   stbi s;
+   if (req_comp < 1 || req_comp > 4) return e("bad req_comp", "Internal error");
+   if (stbi_jpeg_test_file(f)) {
+      jpeg j;
+      start_file(&j.s, f);
+      return jpeg_load_into(&j, dest, dest_stride, x, y, req_comp);
+   }
+   if (stbi_png_test_file(f)) {
+      png p;
+      start_file(&p.s, f);
+      return png_load_into(&p, dest, dest_stride, x, y, req_comp);
+   }
+   start_file(&s, f);
+   set_dest(&s, dest, dest_stride, x, y);
+   if (stbi_bmp_test_file(f))
+      return load_into_scratch(&s, 1, req_comp);
+   if (!test_before_tga_file(f) && stbi_tga_test_file(f))
+      return load_into_scratch(&s, 0, req_comp);
+   data = stbi_load_from_file(f, &out_x, &out_y, &comp, req_comp);
+   if (data == NULL) return 0;
+   s.img_x = out_x;
+   s.img_y = out_y;
+   r = copy_to_dest(&s, data, req_comp, req_comp);
+   free(data);
+   return r;
+}
+#endif
+
+int stbi_load_into_from_memory(stbi_uc const *buffer, int len, stbi_uc *dest, int dest_stride, int x, int y, int req_comp)
+{
+   int out_x, out_y, comp, r;
+   stbi_uc *data;
+   stbi s;
+   if (req_comp < 1 || req_comp > 4) return e("bad req_comp", "Internal error");
+   if (stbi_jpeg_test_memory(buffer, len)) {
+      jpeg j;
+      start_mem(&j.s, buffer, len);
+      return jpeg_load_into(&j, dest, dest_stride, x, y, req_comp);
+   }
+   if (stbi_png_test_memory(buffer, len)) {
+      png p;
+      start_mem(&p.s, buffer, len);
+      return png_load_into(&p, dest, dest_stride, x, y, req_comp);
+   }
+   start_mem(&s, buffer, len);
+   set_dest(&s, dest, dest_stride, x, y);
+   if (stbi_bmp_test_memory(buffer, len))
+      return load_into_scratch(&s, 1, req_comp);
+   if (!test_before_tga_memory(buffer, len) && stbi_tga_test_memory(buffer, len))
+      return load_into_scratch(&s, 0, req_comp);
+   data = stbi_load_from_memory(buffer, len, &out_x, &out_y, &comp, req_comp);
+   if (data == NULL) return 0;
+   s.img_x = out_x;
+   s.img_y = out_y;
+   r = copy_to_dest(&s, data, req_comp, req_comp);
+   free(data);
+   return r;
+}
+
 #ifndef STBI_NO_STDIO
 int stbi_png_test_file(FILE *f)
 {
@@ -2426,12 +3876,49 @@ int stbi_png_test_memory(stbi_uc const *buffer, int len)
    return parse_png_file(&p, SCAN_type,STBI_default);
 }
 
-// TODO: load header from png
+// reads the chunks up to IDAT at most, a paletted image needs PLTE/tRNS to
+// know its components. comp is what stbi_png_load would report.
+static int png_info(png *p, int *x, int *y, int *comp)
+{
+   p->expanded = NULL;
+   p->idata = NULL;
+   p->out = NULL;
+   if (!parse_png_file(p, SCAN_header, 0)) return 0;
+   if (x) *x = p->s.img_x;
+   if (y) *y = p->s.img_y;
+   if (comp) *comp = p->s.img_n;
+   return 1;
+}
+
 #ifndef STBI_NO_STDIO
-extern int      stbi_png_info             (char const *filename,           int *x, int *y, int *comp);
-extern int      stbi_png_info_from_file   (FILE *f,                  int *x, int *y, int *comp);
+int stbi_png_info(char const *filename, int *x, int *y, int *comp)
+{
+   int r;
+   FILE *f = fopen(filename, "rb");
+   if (!f) return e("can't fopen", "Unable to open file");
+   r = stbi_png_info_from_file(f, x, y, comp);
+   fclose(f);
+   return r;
+}
+
+int stbi_png_info_from_file(FILE *f, int *x, int *y, int *comp)
+{
+   png p;
+   int n,r;
+   n = ftell(f);
+   start_file(&p.s, f);
+   r = png_info(&p, x, y, comp);
+   fseek(f,n,SEEK_SET);
+   return r;
+}
 #endif
-extern int      stbi_png_info_from_memory (stbi_uc const *buffer, int len, int *x, int *y, int *comp);
+
+int stbi_png_info_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp)
+{
+   png p;
+   start_mem(&p.s, buffer, len);
+   return png_info(&p, x, y, comp);
+}
 
 // Microsoft/Windows BMP image
 
@@ -2522,7 +4009,7 @@ static stbi_uc *bmp_load(stbi *s, int *x, int *y, int *comp, int req_comp)
    offset = get32le(s);
    hsz = get32le(s);
    if (hsz != 12 && hsz != 40 && hsz != 56 && hsz != 108) return epuc("unknown BMP", "BMP type not supported: unknown");
-   failure_reason = "bad BMP";
+   stbi_ctx.failure_reason = "bad BMP";
    if (hsz == 12) {
       s->img_x = get16le(s);
       s->img_y = get16le(s);
@@ -2595,11 +4082,11 @@ static stbi_uc *bmp_load(stbi *s, int *x, int *y, int *comp, int req_comp)
       target = req_comp;
    else
       target = s->img_n; // if they want monochrome, we'll post-convert
-   out = (stbi_uc *) malloc(target * s->img_x * s->img_y);
+   out = image_alloc(s, target * s->img_x * s->img_y);
    if (!out) return epuc("outofmem", "Out of memory");
    if (bpp < 16) {
       int z=0;
-      if (psize == 0 || psize > 256) { free(out); return epuc("invalid", "Corrupt BMP"); }
+      if (psize == 0 || psize > 256) { scratch_free(out); return epuc("invalid", "Corrupt BMP"); }
       for (i=0; i < psize; ++i) {
          pal[i][2] = get8(s);
          pal[i][1] = get8(s);
@@ -2610,7 +4097,7 @@ static stbi_uc *bmp_load(stbi *s, int *x, int *y, int *comp, int req_comp)
       skip(s, offset - 14 - hsz - psize * (hsz == 12 ? 3 : 4));
       if (bpp == 4) width = (s->img_x + 1) >> 1;
       else if (bpp == 8) width = s->img_x;
-      else { free(out); return epuc("bad bpp", "Corrupt BMP"); }
+      else { scratch_free(out); return epuc("bad bpp", "Corrupt BMP"); }
       pad = (-width)&3;
       for (j=0; j < (int) s->img_y; ++j) {
          for (i=0; i < (int) s->img_x; i += 2) {
@@ -2648,7 +4135,7 @@ static stbi_uc *bmp_load(stbi *s, int *x, int *y, int *comp, int req_comp)
             easy = 2;
       }
       if (!easy) {
-         if (!mr || !mg || !mb) return epuc("bad masks", "Corrupt BMP");
+         if (!mr || !mg || !mb) { scratch_free(out); return epuc("bad masks", "Corrupt BMP"); }
          // right shift amt to put high bit in position #7
          rshift = high_bit(mr)-7; rcount = bitcount(mr);
          gshift = high_bit(mg)-7; gcount = bitcount(mr);
@@ -2691,7 +4178,8 @@ static stbi_uc *bmp_load(stbi *s, int *x, int *y, int *comp, int req_comp)
       }
    }
 
-   if (req_comp && req_comp != target) {
+   // load_into converts while it copies
+   if (req_comp && req_comp != target && !s->dest) {
       out = convert_format(out, target, req_comp, s->img_x, s->img_y);
       if (out == NULL) return out; // convert_format frees input on failure
    }
@@ -2834,7 +4322,11 @@ static stbi_uc *tga_load(stbi *s, int *x, int *y, int *comp, int req_comp)
 		//	force a new number of components
 		*comp = tga_bits_per_pixel/8;
 	}
-	tga_data = (unsigned char*)malloc( tga_width * tga_height * req_comp );
+	tga_data = image_alloc( s, tga_width * tga_height * req_comp );
+	if( tga_data == NULL )
+	{
+		return epuc("outofmem", "Out of memory");
+	}
 
 	//	skip to the data's starting position (offset usually = 0)
 	skip(s, tga_offset );
@@ -3574,6 +5066,13 @@ stbi_uc *stbi_hdr_load_rgbe_memory(stbi_uc *buffer, int len, int *x, int *y, int
 
 #ifndef STBI_NO_WRITE
 
+#if defined(_M_X64) || defined(__SSE2__) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define STBI_WRITE_SSE2 1
+#include <emmintrin.h>
+#else
+#define STBI_WRITE_SSE2 0
+#endif
+
 static void write8(FILE *f, int x) { uint8 z = (uint8) x; fwrite(&z,1,1,f); }
 
 static void writefv(FILE *f, char *fmt, va_list v)
@@ -3592,81 +5091,150 @@ static void writefv(FILE *f, char *fmt, va_list v)
    }
 }
 
-static void writef(FILE *f, char *fmt, ...)
+// the pixels are converted a whole row at a time into one buffer, which
+// is written with a single fwrite
+static void convert_row(uint8 *out, uint8 *d, int rgb_dir, int x, int comp, int write_alpha)
 {
-   va_list v;
-   va_start(v, fmt);
-   writefv(f,fmt,v);
-   va_end(v);
+   uint8 bg[3] = { 255, 0, 255}, px[3];
+   int i=0,k;
+
+   #if STBI_WRITE_SSE2
+   // rgba -> bgra, 4 pixels at a time
+   if (comp == 4 && write_alpha > 0 && rgb_dir < 0) {
+      __m128i green_alpha = _mm_set1_epi32((int) 0xFF00FF00);
+      __m128i red_blue = _mm_set1_epi32(0x000000FF);
+      for (; i+4 <= x; i += 4) {
+         __m128i p = _mm_loadu_si128((__m128i *) (d + i*4));
+         __m128i q = _mm_or_si128(_mm_and_si128(p, green_alpha),
+                     _mm_or_si128(_mm_and_si128(_mm_srli_epi32(p, 16), red_blue),
+                                  _mm_slli_epi32(_mm_and_si128(p, red_blue), 16)));
+         _mm_storeu_si128((__m128i *) (out + i*4), q);
+      }
+      out += i*4;
+   }
+   #endif
+
+   for (; i < x; ++i) {
+      uint8 *p = d + i*comp;
+      if (write_alpha < 0)
+         *out++ = (comp & 1) ? 255 : p[comp-1];
+      switch (comp) {
+         case 1:
+         case 2: out[0] = out[1] = out[2] = p[0];
+                 break;
+         case 4:
+            if (!write_alpha) {
+               for (k=0; k < 3; ++k)
+                  px[k] = bg[k] + ((p[k] - bg[k]) * p[3])/255;
+               out[0] = px[1-rgb_dir]; out[1] = px[1]; out[2] = px[1+rgb_dir];
+               break;
+            }
+            /* FALLTHROUGH */
+         case 3:
+            out[0] = p[1-rgb_dir]; out[1] = p[1]; out[2] = p[1+rgb_dir];
+            break;
+      }
+      out += 3;
+      if (write_alpha > 0)
+         *out++ = (comp & 1) ? 255 : p[comp-1];
+   }
+}
+
+// TGA run-length packets of at most 128 pixels, a packet never crosses
+// a row. returns the bytes written to out
+static int rle_row(uint8 *out, uint8 *row, int x, int bpp)
+{
+   uint8 *start = out;
+   int i=0, n;
+   while (i < x) {
+      n = 1;
+      while (i+n < x && n < 128 && memcmp(row + i*bpp, row + (i+n)*bpp, bpp) == 0)
+         ++n;
+      if (n > 1) {
+         *out++ = (uint8) (0x80 | (n-1));
+         memcpy(out, row + i*bpp, bpp);
+         out += bpp;
+      } else {
+         // raw up to where the next run starts
+         while (i+n < x && n < 128 && !(i+n+1 < x && memcmp(row + (i+n)*bpp, row + (i+n+1)*bpp, bpp) == 0))
+            ++n;
+         *out++ = (uint8) (n-1);
+         memcpy(out, row + i*bpp, n*bpp);
+         out += n*bpp;
+      }
+      i += n;
+   }
+   return (int) (out - start);
 }
 
-static void write_pixels(FILE *f, int rgb_dir, int vdir, int x, int y, int comp, void *data, int write_alpha, int scanline_pad)
+static int write_pixels(FILE *f, int rgb_dir, int vdir, int x, int y, int comp, void *data, int write_alpha, int scanline_pad, int rle)
 {
-   uint8 bg[3] = { 255, 0, 255}, px[3];
-   uint32 zero = 0;
-   int i,j,k, j_end;
+   int bpp = 3 + (write_alpha != 0);
+   int row_bytes = x*bpp + scanline_pad;
+   int j, j_end, n, ok = 1;
+   // the row, then its rle packets: one header per pixel at most
+   uint8 *row = (uint8 *) malloc(row_bytes + (rle ? x*(bpp+1) : 0));
+   uint8 *packets = row + row_bytes;
+   if (row == NULL) return 0;
+   memset(row + x*bpp, 0, scanline_pad);
 
    if (vdir < 0)
       j_end = -1, j = y-1;
    else
       j_end =  y, j = 0;
 
-   for (; j != j_end; j += vdir) {
-      for (i=0; i < x; ++i) {
-         uint8 *d = (uint8 *) data + (j*x+i)*comp;
-         if (write_alpha < 0)
-            fwrite(&d[comp-1], 1, 1, f);
-         switch (comp) {
-            case 1:
-            case 2: writef(f, "111", d[0],d[0],d[0]);
-                    break;
-            case 4:
-               if (!write_alpha) {
-                  for (k=0; k < 3; ++k)
-                     px[k] = bg[k] + ((d[k] - bg[k]) * d[3])/255;
-                  writef(f, "111", px[1-rgb_dir],px[1],px[1+rgb_dir]);
-                  break;
-               }
-               /* FALLTHROUGH */
-            case 3:
-               writef(f, "111", d[1-rgb_dir],d[1],d[1+rgb_dir]);
-               break;
-         }
-         if (write_alpha > 0)
-            fwrite(&d[comp-1], 1, 1, f);
-      }
-      fwrite(&zero,scanline_pad,1,f);
+   for (; ok && j != j_end; j += vdir) {
+      convert_row(row, (uint8 *) data + j*x*comp, rgb_dir, x, comp, write_alpha);
+      if (rle) {
+         n = rle_row(packets, row, x, bpp);
+         ok = fwrite(packets, 1, n, f) == (size_t) n;
+      } else
+         ok = fwrite(row, 1, row_bytes, f) == (size_t) row_bytes;
    }
+   free(row);
+   return ok;
 }
 
-static int outfile(char const *filename, int rgb_dir, int vdir, int x, int y, int comp, void *data, int alpha, int pad, char *fmt, ...)
+static int outfile(char const *filename, int rgb_dir, int vdir, int x, int y, int comp, void *data, int alpha, int pad, int rle, char *fmt, ...)
 {
+   int ok;
    FILE *f = fopen(filename, "wb");
-   if (f) {
+   if (f == NULL) return 0;
+   {
       va_list v;
       va_start(v, fmt);
       writefv(f, fmt, v);
       va_end(v);
-      write_pixels(f,rgb_dir,vdir,x,y,comp,data,alpha,pad);
+      ok = write_pixels(f,rgb_dir,vdir,x,y,comp,data,alpha,pad,rle);
       fclose(f);
    }
-   return f != NULL;
+   return ok;
 }
 
 int stbi_write_bmp(char const *filename, int x, int y, int comp, void *data)
 {
-   int pad = (-x*3) & 3;
-   return outfile(filename,-1,-1,x,y,comp,data,1,pad,
+   // 32 bit rows need no padding
+   return outfile(filename,-1,-1,x,y,comp,data,1,0,0,
            "11 4 22 4" "4 44 22 444444",
-           'B', 'M', 14+40+(x*3+pad)*y, 0,0, 14+40,  // file header
-            40, x,y, 1,32, 0,0,0,0,0,0);             // bitmap header
+           'B', 'M', 14+40+x*4*y, 0,0, 14+40,  // file header
+            40, x,y, 1,32, 0,0,0,0,0,0);       // bitmap header
 }
 
-int stbi_write_tga(char const *filename, int x, int y, int comp, void *data)
+static int write_tga(char const *filename, int x, int y, int comp, void *data, int rle)
 {
    int has_alpha = !(comp & 1);
-   return outfile(filename, -1,-1, x, y, comp, data, has_alpha, 0,
-                  "111 221 2222 11", 0,0,2, 0,0,0, 0,0,x,y, 24+8*has_alpha, 8*has_alpha);
+   return outfile(filename, -1,-1, x, y, comp, data, has_alpha, 0, rle,
+                  "111 221 2222 11", 0,0,rle ? 10 : 2, 0,0,0, 0,0,x,y, 24+8*has_alpha, 8*has_alpha);
+}
+
+int stbi_write_tga(char const *filename, int x, int y, int comp, void *data)
+{
+   return write_tga(filename, x, y, comp, data, 0);
+}
+
+int stbi_write_tga_rle(char const *filename, int x, int y, int comp, void *data)
+{
+   return write_tga(filename, x, y, comp, data, 1);
 }
 
 // any other image formats that do interleaved rgb data?
@@ -13,7 +13,7 @@
       HDR (radiance rgbE format)
       writes BMP,TGA (define STBI_NO_WRITE to remove code)
       decoded from memory or through stdio FILE (define STBI_NO_STDIO to remove code)
-      supports installable dequantizing-IDCT, YCbCr-to-RGB conversion (define STBI_SIMD)
+      SSE2 (AVX2 chosen at run time) dequantizing-IDCT, upsampling & YCbCr-to-RGB, installable replacements
         
    TODO:
       stbi_info_*
@@ -71,7 +71,10 @@
 // Limitations:
 //    - no progressive/interlaced support (jpeg, png)
 //    - 8-bit samples only (jpeg, png)
-//    - not threadsafe
+//    - threadsafe: the failure reason, the HDR settings, the scratch
+//      buffers & the jpeg parallel_for are per thread, the installable
+//      hooks, the registered loaders & the png CRC check are shared, set
+//      them up before decoding on several threads
 //    - channel subsampling of at most 2 in each dimension (jpeg)
 //    - no delayed line count (jpeg) -- IJG doesn't support either
 //
@@ -133,7 +136,7 @@
 //     stbi_hdr_to_ldr_scale(1.0f);
 //
 // (note, do not use _inverse_ constants; stbi_image will invert them
-// appropriately).
+// appropriately). The settings apply to the calling thread only.
 //
 // Additionally, there is a new, parallel interface for loading files as
 // (linear) floats to preserve the full dynamic range:
@@ -157,6 +160,7 @@
 #ifndef STBI_NO_STDIO
 #include <stdio.h>
 #endif
+#include <stddef.h>
 
 #define STBI_VERSION 1
 
@@ -184,6 +188,8 @@ extern "C" {
 // returns TRUE on success, FALSE if couldn't open file, error writing file
 extern int      stbi_write_bmp       (char const *filename,     int x, int y, int comp, void *data);
 extern int      stbi_write_tga       (char const *filename,     int x, int y, int comp, void *data);
+// run-length encoded TGA (image type 10), smaller for flat art & empty atlas space
+extern int      stbi_write_tga_rle   (char const *filename,     int x, int y, int comp, void *data);
 #endif
 
 // PRIMARY API - works on images of any type
@@ -219,11 +225,25 @@ extern char    *stbi_failure_reason  (void);
 // free the loaded image -- this is just free()
 extern void     stbi_image_free      (void *retval_from_stbi_load);
 
+// the temporary buffers of a decode (compressed & inflated png data, jpeg
+// planes, the image stbi_load_into copies from) stay with the thread for
+// the next one, at the size of the largest image so far. trim frees those
+// of the calling thread above max_keep bytes, 0 frees all of them; call it
+// before a decoding thread exits. size is the bytes the thread holds.
+extern void     stbi_scratch_trim    (size_t max_keep);
+extern size_t   stbi_scratch_size    (void);
+
 // get image dimensions & components without fully decoding
 extern int      stbi_info_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp);
+
+// decode into an existing x * y region whose rows are dest_stride bytes
+// apart, with req_comp components. fails if the image is not x * y.
+extern int      stbi_load_into_from_memory(stbi_uc const *buffer, int len, stbi_uc *dest, int dest_stride, int x, int y, int req_comp);
 extern int      stbi_is_hdr_from_memory(stbi_uc const *buffer, int len);
 #ifndef STBI_NO_STDIO
 extern int      stbi_info            (char const *filename,     int *x, int *y, int *comp);
+extern int      stbi_load_into       (char const *filename,     stbi_uc *dest, int dest_stride, int x, int y, int req_comp);
+extern int      stbi_load_into_from_file(FILE *f,               stbi_uc *dest, int dest_stride, int x, int y, int req_comp);
 extern int      stbi_is_hdr          (char const *filename);
 extern int      stbi_is_hdr_from_file(FILE *f);
 #endif
@@ -244,6 +264,18 @@ extern int      stbi_jpeg_test_memory     (stbi_uc const *buffer, int len);
 extern stbi_uc *stbi_jpeg_load_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp);
 extern int      stbi_jpeg_info_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp);
 
+// run the IDCT, upsampling & color conversion with SIMD, on by default.
+// off runs the scalar reference code.
+extern void     stbi_jpeg_simd            (int flag_true_if_should_use_simd);
+
+// decode the restart intervals of big jpegs in memory on several threads.
+// parallel_for runs job(arg, 0) .. job(arg, count-1), possibly at the same
+// time, and returns when all are done. it applies to the jpegs the calling
+// thread decodes. NULL, the default, decodes on the calling thread, so do
+// jpegs without restart markers.
+typedef void (*stbi_parallel_for)(void *context, int count, void (*job)(void *arg, int index), void *arg);
+extern void     stbi_jpeg_parallel_for    (stbi_parallel_for func, void *context);
+
 #ifndef STBI_NO_STDIO
 extern stbi_uc *stbi_jpeg_load            (char const *filename,     int *x, int *y, int *comp, int req_comp);
 extern int      stbi_jpeg_test_file       (FILE *f);
@@ -258,6 +290,13 @@ extern int      stbi_png_test_memory      (stbi_uc const *buffer, int len);
 extern stbi_uc *stbi_png_load_from_memory (stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp);
 extern int      stbi_png_info_from_memory (stbi_uc const *buffer, int len, int *x, int *y, int *comp);
 
+// verify the CRC of every png chunk before its data is used, off by default
+extern void     stbi_png_check_crc        (int flag_true_if_should_check);
+
+// undo the row filters of 3 & 4 channel pngs with SIMD, on by default.
+// off runs the scalar reference code.
+extern void     stbi_png_unfilter_simd    (int flag_true_if_should_use_simd);
+
 #ifndef STBI_NO_STDIO
 extern stbi_uc *stbi_png_load             (char const *filename,     int *x, int *y, int *comp, int req_comp);
 extern int      stbi_png_info             (char const *filename,     int *x, int *y, int *comp);
@@ -325,14 +364,15 @@ typedef struct
 // NOT THREADSAFE
 extern int stbi_register_loader(stbi_loader *loader);
 
-// define faster low-level operations (typically SIMD support)
-#if STBI_SIMD
-typedef void (*stbi_idct_8x8)(uint8 *out, int out_stride, short data[64], unsigned short *dequantize);
+// define faster low-level operations (typically SIMD support). the
+// installed ones replace the built in SSE2/AVX2 or scalar code, NULL selects
+// it again. shared by all threads, install them before decoding.
+typedef void (*stbi_idct_8x8)(stbi_uc *out, int out_stride, short data[64], unsigned short *dequantize);
 // compute an integer IDCT on "input"
 //     input[x] = data[x] * dequantize[x]
 //     write results to 'out': 64 samples, each run of 8 spaced by 'out_stride'
 //                             CLAMP results to 0..255
-typedef void (*stbi_YCbCr_to_RGB_run)(uint8 *output, uint8 const *y, uint8 const *cb, uint8 const *cr, int count, int step);
+typedef void (*stbi_YCbCr_to_RGB_run)(stbi_uc *output, stbi_uc const *y, stbi_uc const *cb, stbi_uc const *cr, int count, int step);
 // compute a conversion from YCbCr to RGB
 //     'count' pixels
 //     write pixels to 'output'; each pixel is 'step' bytes (either 3 or 4; if 4, write '255' as 4th), order R,G,B
@@ -342,7 +382,6 @@ typedef void (*stbi_YCbCr_to_RGB_run)(uint8 *output, uint8 const *y, uint8 const
 
 extern void stbi_install_idct(stbi_idct_8x8 func);
 extern void stbi_install_YCbCr_to_RGB(stbi_YCbCr_to_RGB_run func);
-#endif // STBI_SIMD
 
 #ifdef __cplusplus
 }
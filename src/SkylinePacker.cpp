@@ -0,0 +1,274 @@
+// \brief
+//		Skyline packer
+//
+//
+
+#include <cstddef>
+#include <cassert>
+#include <climits>
+
+#include "SkylinePacker.h"
+
+
+FSkylinePacker::FSkylinePacker(bool InUseWasteMap)
+	: bUseWasteMap(InUseWasteMap)
+	, BinWidth(0)
+	, BinHeight(0)
+	, UsedArea(0)
+	, MinImageW(UINT_MAX)
+	, MinImageH(UINT_MAX)
+{
+}
+
+void FSkylinePacker::Init(uint32_t InWidth, uint32_t InHeight)
+{
+	BinWidth = InWidth;
+	BinHeight = InHeight;
+	UsedArea = 0;
+	MinImageW = UINT_MAX;
+	MinImageH = UINT_MAX;
+
+	Skyline.clear();
+	WasteRects.clear();
+	Skyline.push_back(FSkylineNode(0, 0, InWidth));
+}
+
+bool FSkylinePacker::Insert(uint32_t InW, uint32_t InH, FPackRect &OutRect)
+{
+	return InsertImpl(InW, InH, false, OutRect);
+}
+
+bool FSkylinePacker::InsertRotatable(uint32_t InW, uint32_t InH, FPackRect &OutRect)
+{
+	return InsertImpl(InW, InH, InW != InH, OutRect);
+}
+
+bool FSkylinePacker::InsertImpl(uint32_t InW, uint32_t InH, bool InAllowRotation, FPackRect &OutRect)
+{
+	if (InW == 0 || InH == 0)
+	{
+		return false;
+	}
+
+	// a rotated image may fill a gap with either side
+	const uint32_t kMinW = InAllowRotation && InH < InW ? InH : InW;
+	const uint32_t kMinH = InAllowRotation && InW < InH ? InW : InH;
+	MinImageW = kMinW < MinImageW ? kMinW : MinImageW;
+	MinImageH = kMinH < MinImageH ? kMinH : MinImageH;
+
+	// first try to fill a gap under the skyline
+	if (bUseWasteMap && InsertToWasteMap(InW, InH, InAllowRotation, OutRect))
+	{
+		UsedArea += (uint64_t)InW * InH;
+		return true;
+	}
+
+	size_t NodeIndex = 0;
+	if (!FindPositionBottomLeft(InW, InH, InAllowRotation, OutRect, NodeIndex))
+	{
+		return false;
+	}
+
+	AddSkylineLevel(NodeIndex, OutRect);
+	UsedArea += (uint64_t)InW * InH;
+	return true;
+}
+
+float FSkylinePacker::Occupancy() const
+{
+	const uint64_t kBinArea = (uint64_t)BinWidth * BinHeight;
+	return kBinArea > 0 ? (float)((double)UsedArea / kBinArea) : 0.f;
+}
+
+bool FSkylinePacker::FindPositionBottomLeft(uint32_t InW, uint32_t InH, bool InAllowRotation, FPackRect &OutRect, size_t &OutNodeIndex) const
+{
+	uint32_t BestBottom = UINT_MAX;
+	uint32_t BestWidth = UINT_MAX;
+	bool bFound = false;
+
+	for (size_t k = 0; k < Skyline.size(); k++)
+	{
+		for (int32_t Rotation = 0; Rotation < (InAllowRotation ? 2 : 1); Rotation++)
+		{
+			const uint32_t kW = Rotation ? InH : InW;
+			const uint32_t kH = Rotation ? InW : InH;
+
+			uint32_t Y = 0;
+			if (!RectangleFits(k, kW, kH, Y))
+			{
+				continue;
+			}
+
+			// lowest top edge first, then the narrowest segment
+			const uint32_t kBottom = Y + kH;
+			if (kBottom < BestBottom || (kBottom == BestBottom && Skyline[k].W < BestWidth))
+			{
+				BestBottom = kBottom;
+				BestWidth = Skyline[k].W;
+				OutRect = FPackRect(Skyline[k].X, Y, kW, kH);
+				OutNodeIndex = k;
+				bFound = true;
+			}
+		} // end for Rotation
+	} // end for k
+
+	return bFound;
+}
+
+bool FSkylinePacker::RectangleFits(size_t InNodeIndex, uint32_t InW, uint32_t InH, uint32_t &OutY) const
+{
+	const uint32_t kX = Skyline[InNodeIndex].X;
+	if (kX + InW > BinWidth)
+	{
+		return false;
+	}
+
+	// the rectangle rests on the highest segment it spans
+	uint32_t WidthLeft = InW;
+	uint32_t Y = Skyline[InNodeIndex].Y;
+	for (size_t k = InNodeIndex; WidthLeft > 0; k++)
+	{
+		assert(k < Skyline.size());
+		const FSkylineNode &Node = Skyline[k];
+		Y = Node.Y > Y ? Node.Y : Y;
+		if (Y + InH > BinHeight)
+		{
+			return false;
+		}
+
+		WidthLeft = Node.W >= WidthLeft ? 0 : WidthLeft - Node.W;
+	} // end for k
+
+	OutY = Y;
+	return true;
+}
+
+void FSkylinePacker::AddSkylineLevel(size_t InNodeIndex, const FPackRect &InRect)
+{
+	const uint32_t kRight = InRect.X + InRect.W;
+
+	// the area between the old skyline and the new rectangle is wasted
+	if (bUseWasteMap)
+	{
+		for (size_t k = InNodeIndex; k < Skyline.size() && Skyline[k].X < kRight; k++)
+		{
+			const FSkylineNode &Node = Skyline[k];
+			if (Node.Y >= InRect.Y)
+			{
+				continue;
+			}
+
+			const uint32_t kLeft = Node.X;
+			const uint32_t kNodeRight = Node.X + Node.W < kRight ? Node.X + Node.W : kRight;
+			AddWasteRect(FPackRect(kLeft, Node.Y, kNodeRight - kLeft, InRect.Y - Node.Y));
+		} // end for k
+	}
+
+	Skyline.insert(Skyline.begin() + InNodeIndex, FSkylineNode(InRect.X, InRect.Y + InRect.H, InRect.W));
+
+	// shrink or remove the segments that are covered by the new one
+	for (size_t k = InNodeIndex + 1; k < Skyline.size();)
+	{
+		FSkylineNode &Node = Skyline[k];
+		if (Node.X >= kRight)
+		{
+			break;
+		}
+
+		const uint32_t kShrink = kRight - Node.X;
+		if (Node.W <= kShrink)
+		{
+			Skyline.erase(Skyline.begin() + k);
+			continue;
+		}
+
+		Node.X += kShrink;
+		Node.W -= kShrink;
+		break;
+	} // end for k
+
+	MergeSkylines();
+}
+
+void FSkylinePacker::MergeSkylines()
+{
+	for (size_t k = 0; k + 1 < Skyline.size();)
+	{
+		if (Skyline[k].Y == Skyline[k + 1].Y)
+		{
+			Skyline[k].W += Skyline[k + 1].W;
+			Skyline.erase(Skyline.begin() + (k + 1));
+		}
+		else
+		{
+			k++;
+		}
+	} // end for k
+}
+
+bool FSkylinePacker::InsertToWasteMap(uint32_t InW, uint32_t InH, bool InAllowRotation, FPackRect &OutRect)
+{
+	// best area fit
+	size_t BestIndex = WasteRects.size();
+	uint64_t BestArea = ~(uint64_t)0;
+	for (size_t k = 0; k < WasteRects.size(); k++)
+	{
+		const FPackRect &Waste = WasteRects[k];
+		const bool bFits = InW <= Waste.W && InH <= Waste.H;
+		const bool bFitsRotated = InAllowRotation && InH <= Waste.W && InW <= Waste.H;
+		if (!bFits && !bFitsRotated)
+		{
+			continue;
+		}
+
+		const uint64_t kArea = (uint64_t)Waste.W * Waste.H;
+		if (kArea < BestArea)
+		{
+			BestArea = kArea;
+			BestIndex = k;
+		}
+	} // end for k
+
+	if (BestIndex == WasteRects.size())
+	{
+		return false;
+	}
+
+	const FPackRect kWaste = WasteRects[BestIndex];
+	WasteRects[BestIndex] = WasteRects.back();
+	WasteRects.pop_back();
+
+	// rotate only when the upright one does not fit the gap
+	if (InW > kWaste.W || InH > kWaste.H)
+	{
+		const uint32_t kSwap = InW;
+		InW = InH;
+		InH = kSwap;
+	}
+	OutRect = FPackRect(kWaste.X, kWaste.Y, InW, InH);
+
+	// guillotine split of the rest, cut along the shorter leftover axis
+	const uint32_t kLeftoverW = kWaste.W - InW;
+	const uint32_t kLeftoverH = kWaste.H - InH;
+	if (kLeftoverW < kLeftoverH)
+	{
+		AddWasteRect(FPackRect(kWaste.X + InW, kWaste.Y, kLeftoverW, InH));
+		AddWasteRect(FPackRect(kWaste.X, kWaste.Y + InH, kWaste.W, kLeftoverH));
+	}
+	else
+	{
+		AddWasteRect(FPackRect(kWaste.X + InW, kWaste.Y, kLeftoverW, kWaste.H));
+		AddWasteRect(FPackRect(kWaste.X, kWaste.Y + InH, InW, kLeftoverH));
+	}
+	return true;
+}
+
+void FSkylinePacker::AddWasteRect(const FPackRect &InRect)
+{
+	// drop slivers no image seen so far could use, they would only make
+	// the waste map longer to scan.
+	if (InRect.W >= MinImageW && InRect.H >= MinImageH)
+	{
+		WasteRects.push_back(InRect);
+	}
+}
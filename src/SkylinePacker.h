@@ -0,0 +1,73 @@
+// \brief
+//		Skyline packer
+// Algorithm:
+//		ref: Jukka Jylanki, "A Thousand Ways to Pack the Bin"
+//		Only the upper contour (skyline) of the placed images is kept.
+//      A new image is put at the bottom-left most position on the skyline,
+//      the gaps left under it are recorded in a waste map and reused first.
+//                     *------*
+//       *-----*       | new  |
+//       |     |       *------*--------*
+//       |     |~waste~|      |        |
+//       |     *-------*      |        |
+//       *-----------------------------*
+//
+//		The cost of an insert grows with the skyline length, not with the
+//		count of images already placed.
+//
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "RectPacker.h"
+
+
+class FSkylinePacker : public FRectPacker
+{
+public:
+	FSkylinePacker(bool InUseWasteMap = true);
+
+	virtual void Init(uint32_t InWidth, uint32_t InHeight);
+	virtual bool Insert(uint32_t InW, uint32_t InH, FPackRect &OutRect);
+	virtual bool InsertRotatable(uint32_t InW, uint32_t InH, FPackRect &OutRect);
+	virtual float Occupancy() const;
+
+protected:
+	// a horizontal segment of the skyline
+	struct FSkylineNode
+	{
+		FSkylineNode()
+			: X(0), Y(0), W(0)
+		{}
+
+		FSkylineNode(uint32_t InX, uint32_t InY, uint32_t InW)
+			: X(InX), Y(InY), W(InW)
+		{}
+
+		uint32_t	X;
+		uint32_t	Y;
+		uint32_t	W;
+	};
+
+	bool InsertImpl(uint32_t InW, uint32_t InH, bool InAllowRotation, FPackRect &OutRect);
+	bool FindPositionBottomLeft(uint32_t InW, uint32_t InH, bool InAllowRotation, FPackRect &OutRect, size_t &OutNodeIndex) const;
+	bool RectangleFits(size_t InNodeIndex, uint32_t InW, uint32_t InH, uint32_t &OutY) const;
+	void AddSkylineLevel(size_t InNodeIndex, const FPackRect &InRect);
+	void MergeSkylines();
+
+	bool InsertToWasteMap(uint32_t InW, uint32_t InH, bool InAllowRotation, FPackRect &OutRect);
+	void AddWasteRect(const FPackRect &InRect);
+
+private:
+	bool						bUseWasteMap;
+	uint32_t					BinWidth;
+	uint32_t					BinHeight;
+	uint64_t					UsedArea;
+	uint32_t					MinImageW;	// smallest image inserted
+	uint32_t					MinImageH;
+	std::vector<FSkylineNode>	Skyline;
+	std::vector<FPackRect>		WasteRects;	// free areas under the skyline
+};
@@ -0,0 +1,259 @@
+// \brief
+//		Thread pool
+//
+//
+
+#include <cassert>
+#include <atomic>
+#include <memory>
+
+#include "ThreadPool.h"
+
+
+// the pool & the worker index of the current thread, the pool is NULL on
+// threads that are not workers.
+static thread_local FThreadPool *tlsPool = NULL;
+static thread_local uint32_t tlsWorkerIndex = 0;
+
+FThreadPool::FThreadPool(uint32_t InNumThreads)
+	: NextQueue(0)
+	, PendingCount(0)
+	, bStopping(false)
+{
+	const uint32_t kNumThreads = InNumThreads > 0 ? InNumThreads : DefaultThreadCount();
+	Queues.reset(new FTaskQueue[kNumThreads]);
+	NumQueues = kNumThreads;
+	for (uint32_t k = 0; k < kNumThreads; k++)
+	{
+		Workers.push_back(std::thread(&FThreadPool::WorkerMain, this, k));
+	} // end for k
+}
+
+FThreadPool::~FThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> Lock(Mutex);
+		bStopping = true;
+	}
+	TaskCond.notify_all();
+
+	for (size_t k = 0; k < Workers.size(); k++)
+	{
+		Workers[k].join();
+	} // end for k
+	Workers.clear();
+}
+
+uint32_t FThreadPool::DefaultThreadCount()
+{
+	const uint32_t kCount = std::thread::hardware_concurrency();
+	return kCount > 0 ? kCount : 1;
+}
+
+void FThreadPool::AddTask(const std::function<void()> &InTask)
+{
+	const uint32_t kQueue = tlsPool == this ? tlsWorkerIndex : NextQueue++ % NumThreads();
+	{
+		// the count changes together with the deque, so a sleeping worker
+		// never misses a task.
+		std::lock_guard<std::mutex> Lock(Mutex);
+		{
+			std::lock_guard<std::mutex> QueueLock(Queues[kQueue].Mutex);
+			Queues[kQueue].Tasks.push_back(InTask);
+		}
+		PendingCount++;
+	}
+	TaskCond.notify_one();
+}
+
+bool FThreadPool::PopTask(uint32_t InWorkerIndex, std::function<void()> &OutTask)
+{
+	const uint32_t kNumQueues = NumThreads();
+	bool bFound = false;
+	for (uint32_t k = 0; k < kNumQueues && !bFound; k++)
+	{
+		// the own deque from the back, the others from the front
+		const uint32_t kQueue = (InWorkerIndex + k) % kNumQueues;
+		FTaskQueue &Queue = Queues[kQueue];
+		std::lock_guard<std::mutex> QueueLock(Queue.Mutex);
+		if (Queue.Tasks.empty())
+		{
+			continue;
+		}
+
+		if (k == 0)
+		{
+			OutTask = Queue.Tasks.back();
+			Queue.Tasks.pop_back();
+		}
+		else
+		{
+			OutTask = Queue.Tasks.front();
+			Queue.Tasks.pop_front();
+		}
+		bFound = true;
+	} // end for k
+
+	if (bFound)
+	{
+		std::lock_guard<std::mutex> Lock(Mutex);
+		PendingCount--;
+	}
+	return bFound;
+}
+
+void FThreadPool::WorkerMain(uint32_t InWorkerIndex)
+{
+	tlsPool = this;
+	tlsWorkerIndex = InWorkerIndex;
+
+	for (;;)
+	{
+		std::function<void()> Task;
+		if (PopTask(InWorkerIndex, Task))
+		{
+			Task();
+			continue;
+		}
+
+		std::unique_lock<std::mutex> Lock(Mutex);
+		while (!bStopping && PendingCount == 0)
+		{
+			TaskCond.wait(Lock);
+		}
+
+		if (PendingCount == 0)
+		{
+			break; // stopping
+		}
+	}
+
+	tlsPool = NULL;
+}
+
+void FThreadPool::ParallelFor(uint32_t InCount, const std::function<void(uint32_t)> &InBody)
+{
+	if (InCount == 0)
+	{
+		return;
+	}
+
+	// every thread starts on its own range of items. one that runs out steals
+	// the upper half of the largest range left, the owner keeps the lower half,
+	// so neighbouring items mostly stay on the same thread.
+	// helpers that start after all items are taken return at once.
+	struct FRange
+	{
+		std::mutex	Mutex;
+		uint32_t	Begin;
+		uint32_t	End;
+	};
+
+	struct FJob
+	{
+		std::unique_ptr<FRange[]>	Ranges;
+		uint32_t				NumRanges;
+		std::atomic<uint32_t>	NextRange;
+		uint32_t				DoneCount;
+		uint32_t				Count;
+		const std::function<void(uint32_t)>	*pBody;
+		std::mutex				Mutex;
+		std::condition_variable	DoneCond;
+	};
+
+	const uint32_t kHelpers = InCount - 1 < NumThreads() ? InCount - 1 : NumThreads();
+
+	std::shared_ptr<FJob> Job = std::make_shared<FJob>();
+	Job->NumRanges = kHelpers + 1;
+	Job->Ranges.reset(new FRange[Job->NumRanges]);
+	for (uint32_t k = 0; k < Job->NumRanges; k++)
+	{
+		Job->Ranges[k].Begin = (uint32_t)((uint64_t)InCount * k / Job->NumRanges);
+		Job->Ranges[k].End = (uint32_t)((uint64_t)InCount * (k + 1) / Job->NumRanges);
+	} // end for k
+	Job->NextRange = 0;
+	Job->DoneCount = 0;
+	Job->Count = InCount;
+	Job->pBody = &InBody;
+
+	std::function<void()> RunItems = [Job]()
+	{
+		const uint32_t kOwn = Job->NextRange++;
+		assert(kOwn < Job->NumRanges);
+		FRange &Own = Job->Ranges[kOwn];
+
+		for (;;)
+		{
+			uint32_t Item = Job->Count;
+			{
+				std::lock_guard<std::mutex> Lock(Own.Mutex);
+				if (Own.Begin < Own.End)
+				{
+					Item = Own.Begin++;
+				}
+			}
+
+			if (Item == Job->Count)
+			{
+				// steal from the thread with the most items left
+				uint32_t Victim = Job->NumRanges;
+				uint32_t MostLeft = 0;
+				for (uint32_t k = 0; k < Job->NumRanges; k++)
+				{
+					std::lock_guard<std::mutex> Lock(Job->Ranges[k].Mutex);
+					const uint32_t kLeft = Job->Ranges[k].End - Job->Ranges[k].Begin;
+					if (kLeft > MostLeft)
+					{
+						MostLeft = kLeft;
+						Victim = k;
+					}
+				} // end for k
+
+				if (Victim == Job->NumRanges)
+				{
+					break;
+				}
+
+				uint32_t StolenBegin, StolenEnd;
+				{
+					FRange &Other = Job->Ranges[Victim];
+					std::lock_guard<std::mutex> Lock(Other.Mutex);
+					if (Other.Begin >= Other.End)
+					{
+						continue; // taken meanwhile, look again
+					}
+					StolenEnd = Other.End;
+					StolenBegin = Other.Begin + (Other.End - Other.Begin) / 2;
+					Other.End = StolenBegin;
+				}
+
+				// only this thread refills its own range
+				std::lock_guard<std::mutex> Lock(Own.Mutex);
+				Item = StolenBegin;
+				Own.Begin = StolenBegin + 1;
+				Own.End = StolenEnd;
+			}
+
+			(*Job->pBody)(Item);
+
+			std::lock_guard<std::mutex> Lock(Job->Mutex);
+			if (++Job->DoneCount == Job->Count)
+			{
+				Job->DoneCond.notify_all();
+			}
+		}
+	};
+
+	for (uint32_t k = 0; k < kHelpers; k++)
+	{
+		AddTask(RunItems);
+	} // end for k
+
+	RunItems();
+
+	std::unique_lock<std::mutex> Lock(Job->Mutex);
+	while (Job->DoneCount < Job->Count)
+	{
+		Job->DoneCond.wait(Lock);
+	}
+}
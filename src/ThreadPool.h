@@ -0,0 +1,71 @@
+// \brief
+//		Thread pool
+//		A fixed group of worker threads running queued tasks.
+//		ParallelFor() lets the calling thread take part in the work, so it
+//		may be called from inside a task without dead locking the pool.
+//
+//		Work stealing:
+//		every worker has its own task deque. it runs its newest task first,
+//		an idle worker takes the oldest task of another one.
+//		ParallelFor() gives every thread a range of neighbouring items, a thread
+//		that runs out takes the upper half of the largest range left.
+//
+
+#pragma once
+
+#include <cstdint>
+#include <deque>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+
+class FThreadPool
+{
+public:
+	// \brief
+	//		InNumThreads	count of worker threads, 0 means one per hardware thread.
+	FThreadPool(uint32_t InNumThreads = 0);
+	~FThreadPool();
+
+	uint32_t NumThreads() const { return NumQueues; }
+
+	// \brief
+	//		queue a task, it runs on any worker. a task queued by a worker goes
+	//		to the deque of that worker.
+	void AddTask(const std::function<void()> &InTask);
+
+	// \brief
+	//		run InBody(0) ... InBody(InCount - 1) on the workers and the calling
+	//		thread, return when all of them are finished.
+	void ParallelFor(uint32_t InCount, const std::function<void(uint32_t)> &InBody);
+
+	static uint32_t DefaultThreadCount();
+
+protected:
+	struct FTaskQueue
+	{
+		std::mutex							Mutex;
+		std::deque<std::function<void()> >	Tasks;
+	};
+
+	void WorkerMain(uint32_t InWorkerIndex);
+	bool PopTask(uint32_t InWorkerIndex, std::function<void()> &OutTask);
+
+private:
+	FThreadPool(const FThreadPool &InOther);
+	FThreadPool& operator =(const FThreadPool &InOther);
+
+	std::vector<std::thread>			Workers;
+	std::unique_ptr<FTaskQueue[]>		Queues;			// one per worker
+	uint32_t							NumQueues;		// set before the workers start
+	std::atomic<uint32_t>				NextQueue;		// round robin for tasks from other threads
+	uint32_t							PendingCount;	// queued tasks, guarded by Mutex
+	std::mutex							Mutex;
+	std::condition_variable				TaskCond;
+	bool								bStopping;
+};
@@ -2,8 +2,12 @@
 //
 
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include "ImageIO.h"
 #include "ImagePacker.h"
+#include "image_png.h"
+#include "stb_image_aug.h"
 
 
 int main(int argc, char *argv[])
@@ -18,10 +22,91 @@ int main(int argc, char *argv[])
 	{
 		FImageIO::WriteImage("img_test_copy.bmp", pixels, width, height, format);
 	}
+	else
+	{
+		printf("ReadImage Failed: %s\n", FImageIO::LastError());
+	}
 
 	delete[] pixels;
 #endif
 
+// test png unfiltering, the SIMD kernels against the scalar reference.
+// every filter type at 3 & 4 channels, decoded as is and expanded to 4.
+#if 0
+	{
+		const int kWidths[] = { 1, 3, 5, 16, 17, 33, 257 };
+		const int kHeight = 7;
+		int Mismatches = 0;
+		for (int Channels = 3; Channels <= 4; Channels++)
+		{
+			for (int Filter = PNG_FILTER_NONE; Filter <= PNG_FILTER_PAETH; Filter++)
+			{
+				for (size_t w = 0; w < sizeof(kWidths) / sizeof(kWidths[0]); w++)
+				{
+					const int kWidth = kWidths[w];
+					uint8_t *pPixels = new uint8_t[kWidth * kHeight * Channels];
+					for (int k = 0; k < kWidth * kHeight * Channels; k++)
+					{
+						pPixels[k] = (uint8_t)(k * 7 + rand() % 5);
+					} // end for k
+
+					png_save_settings Settings;
+					png_default_save_settings(&Settings);
+					Settings.filter = Filter;
+					save_image_as_PNG_ex("unfilter_test.png", kWidth, kHeight, Channels, pPixels, &Settings);
+
+					for (int ReqChannels = 0; ReqChannels <= 4; ReqChannels += 4)
+					{
+						int x, y, n;
+						stbi_png_unfilter_simd(0);
+						uint8_t *pScalar = stbi_load("unfilter_test.png", &x, &y, &n, ReqChannels);
+						stbi_png_unfilter_simd(1);
+						uint8_t *pSimd = stbi_load("unfilter_test.png", &x, &y, &n, ReqChannels);
+						if (!pScalar || !pSimd || memcmp(pScalar, pSimd, x * y * (ReqChannels ? ReqChannels : n)) != 0)
+						{
+							printf("unfilter mismatch: channels %d, filter %d, width %d\n", Channels, Filter, kWidth);
+							Mismatches++;
+						}
+						free(pScalar);
+						free(pSimd);
+					} // end for ReqChannels
+
+					delete[] pPixels;
+				} // end for w
+			} // end for Filter
+		} // end for Channels
+		printf("png unfilter test: %d mismatches\n", Mismatches);
+	}
+#endif
+
+// test jpeg decoding, the SIMD IDCT, upsampling & color conversion against
+// the scalar reference, at every channel count.
+#if 0
+	{
+		const char *JpegFiles[] = { "img_test.jpg" };
+		int Mismatches = 0;
+		for (size_t f = 0; f < sizeof(JpegFiles) / sizeof(JpegFiles[0]); f++)
+		{
+			for (int ReqChannels = 0; ReqChannels <= 4; ReqChannels++)
+			{
+				int x, y, n;
+				stbi_jpeg_simd(0);
+				uint8_t *pScalar = stbi_load(JpegFiles[f], &x, &y, &n, ReqChannels);
+				stbi_jpeg_simd(1);
+				uint8_t *pSimd = stbi_load(JpegFiles[f], &x, &y, &n, ReqChannels);
+				if (!pScalar || !pSimd || memcmp(pScalar, pSimd, x * y * (ReqChannels ? ReqChannels : n)) != 0)
+				{
+					printf("jpeg mismatch: %s, channels %d\n", JpegFiles[f], ReqChannels);
+					Mismatches++;
+				}
+				free(pScalar);
+				free(pSimd);
+			} // end for ReqChannels
+		} // end for f
+		printf("jpeg simd test: %d mismatches\n", Mismatches);
+	}
+#endif
+
 // test packer
 #if 1
 	const char *ImageFiles[] = 